@@ -0,0 +1,496 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* HTTP load generator for obelisk.  Drives a running server, or one it
+ * spawns itself, over raw keep-alive (or one-shot) connections and
+ * reports throughput and latency percentiles as JSON. */
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define OBELISK_BENCH_PORT 18351
+
+typedef struct obelisk_bench_s obelisk_bench_t;
+
+typedef struct {
+    obelisk_bench_t *bench;
+    struct bufferevent *bev;
+    uint64_t sent_at;
+    size_t body_left;
+    int in_body;
+    int status;
+    int close;
+} obelisk_bench_conn_t;
+
+struct obelisk_bench_s {
+    struct event_base *base;
+    struct sockaddr_in addr;
+
+    /* configuration */
+    const char *server;
+    const char *method;
+    const char *params;
+    const char *output;
+    unsigned int server_threads;
+    unsigned int connections;
+    unsigned int batch;
+    size_t payload;
+    uint64_t requests;
+    double duration;
+    int keepalive;
+
+    /* the pre-built HTTP request sent on every connection */
+    char *request;
+    size_t request_len;
+
+    /* results */
+    uint64_t issued;
+    uint64_t done;
+    uint64_t errors;
+    uint64_t start;
+    uint64_t end;
+    uint64_t stop_at;
+    unsigned int active;
+    uint64_t *lat;
+    size_t nlat;
+    size_t alat;
+};
+
+static uint64_t
+obelisk_bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+obelisk_bench_connect(obelisk_bench_t *bench);
+
+static int
+obelisk_bench_more(obelisk_bench_t *bench)
+{
+    if (bench->requests && bench->issued >= bench->requests) {
+        return 0;
+    }
+    if (bench->stop_at && obelisk_bench_now() >= bench->stop_at) {
+        return 0;
+    }
+    return 1;
+}
+
+static void
+obelisk_bench_send(obelisk_bench_conn_t *conn)
+{
+    conn->bench->issued++;
+    conn->sent_at = obelisk_bench_now();
+    conn->in_body = 0;
+    conn->status = 0;
+    conn->close = 0;
+    bufferevent_write(conn->bev, conn->bench->request, conn->bench->request_len);
+}
+
+static void
+obelisk_bench_close(obelisk_bench_conn_t *conn)
+{
+    obelisk_bench_t *bench = conn->bench;
+
+    bufferevent_free(conn->bev);
+    free(conn);
+
+    if (obelisk_bench_more(bench)) {
+        obelisk_bench_connect(bench);
+    }
+    else if (--bench->active == 0) {
+        bench->end = obelisk_bench_now();
+        event_base_loopexit(bench->base, NULL);
+    }
+}
+
+static void
+obelisk_bench_record(obelisk_bench_t *bench, uint64_t ns)
+{
+    if (bench->nlat == bench->alat) {
+        bench->alat = bench->alat ? bench->alat * 2 : 65536;
+        bench->lat = realloc(bench->lat, bench->alat * sizeof(uint64_t));
+    }
+    bench->lat[bench->nlat++] = ns;
+}
+
+static void
+obelisk_bench_read_cb(struct bufferevent *bev, void *arg)
+{
+    obelisk_bench_conn_t *conn = (obelisk_bench_conn_t*) arg;
+    obelisk_bench_t *bench = conn->bench;
+    struct evbuffer *input = bufferevent_get_input(bev);
+
+    for (;;) {
+        if (!conn->in_body) {
+            char *line;
+            size_t len;
+
+            while ((line = evbuffer_readln(input, &len, EVBUFFER_EOL_CRLF)) != NULL) {
+                if (len == 0) {
+                    free(line);
+                    conn->in_body = 1;
+                    break;
+                }
+                if (conn->status == 0) {
+                    const char *sp = strchr(line, ' ');
+                    conn->status = sp ? atoi(sp + 1) : -1;
+                    conn->body_left = 0;
+                }
+                else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                    conn->body_left = strtoul(line + 15, NULL, 10);
+                }
+                else if (strncasecmp(line, "Connection:", 11) == 0 &&
+                         strstr(line + 11, "close")) {
+                    conn->close = 1;
+                }
+                free(line);
+            }
+            if (!conn->in_body) {
+                return;
+            }
+        }
+
+        if (evbuffer_get_length(input) < conn->body_left) {
+            return;
+        }
+        evbuffer_drain(input, conn->body_left);
+
+        bench->done++;
+        if (conn->status != 200) {
+            bench->errors++;
+        }
+        obelisk_bench_record(bench, obelisk_bench_now() - conn->sent_at);
+
+        if (!bench->keepalive || conn->close || !obelisk_bench_more(bench)) {
+            obelisk_bench_close(conn);
+            return;
+        }
+        obelisk_bench_send(conn);
+    }
+}
+
+static void
+obelisk_bench_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+    obelisk_bench_conn_t *conn = (obelisk_bench_conn_t*) arg;
+
+    if (what & BEV_EVENT_CONNECTED) {
+        return;
+    }
+
+    /* the connection went away with a request outstanding */
+    conn->bench->errors++;
+    conn->bench->done++;
+    obelisk_bench_close(conn);
+}
+
+static void
+obelisk_bench_connect(obelisk_bench_t *bench)
+{
+    obelisk_bench_conn_t *conn = calloc(1, sizeof(obelisk_bench_conn_t));
+
+    conn->bench = bench;
+    conn->bev = bufferevent_socket_new(bench->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(conn->bev, obelisk_bench_read_cb, NULL,
+                      obelisk_bench_event_cb, conn);
+    bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+
+    /* queue the request now, it is flushed once connected */
+    obelisk_bench_send(conn);
+    if (bufferevent_socket_connect(conn->bev, (struct sockaddr*) &bench->addr,
+                                   sizeof(bench->addr)) < 0) {
+        conn->bench->errors++;
+        conn->bench->done++;
+        obelisk_bench_close(conn);
+    }
+}
+
+static void
+obelisk_bench_build(obelisk_bench_t *bench)
+{
+    struct evbuffer *body = evbuffer_new();
+    struct evbuffer *req = evbuffer_new();
+    unsigned int calls = bench->batch ? bench->batch : 1;
+    unsigned int i;
+    char *params = NULL;
+
+    if (bench->payload) {
+        params = malloc(bench->payload + 5);
+        params[0] = '[';
+        params[1] = '"';
+        memset(params + 2, 'x', bench->payload);
+        strcpy(params + 2 + bench->payload, "\"]");
+    }
+
+    if (bench->batch) evbuffer_add(body, "[", 1);
+    for (i=0; i<calls; i++) {
+        evbuffer_add_printf(body, "%s{\"jsonrpc\":\"2.0\",\"method\":\"%s\","
+                            "\"params\":%s,\"id\":%u}", i ? "," : "",
+                            bench->method, params ? params : bench->params, i + 1);
+    }
+    if (bench->batch) evbuffer_add(body, "]", 1);
+
+    evbuffer_add_printf(req, "POST /api HTTP/1.1\r\n"
+                             "Host: %s\r\n"
+                             "Content-Type: application/json\r\n"
+                             "Content-Length: %zu\r\n"
+                             "%s"
+                             "\r\n",
+                        inet_ntoa(bench->addr.sin_addr),
+                        evbuffer_get_length(body),
+                        bench->keepalive ? "" : "Connection: close\r\n");
+    evbuffer_add_buffer(req, body);
+
+    bench->request_len = evbuffer_get_length(req);
+    bench->request = malloc(bench->request_len);
+    evbuffer_remove(req, bench->request, bench->request_len);
+
+    evbuffer_free(body);
+    evbuffer_free(req);
+    free(params);
+}
+
+static pid_t
+obelisk_bench_spawn(obelisk_bench_t *bench)
+{
+    char port[16];
+    char threads[16];
+    pid_t pid;
+    int i;
+
+    snprintf(port, sizeof(port), "%u", ntohs(bench->addr.sin_port));
+    snprintf(threads, sizeof(threads), "%u", bench->server_threads);
+
+    pid = fork();
+    if (pid == 0) {
+        execl(bench->server, bench->server, "-l", "127.0.0.1", "-p", port,
+              "-t", threads, (char*) NULL);
+        fprintf(stderr, "exec %s: %s\n", bench->server, strerror(errno));
+        _exit(127);
+    }
+    if (pid < 0) {
+        return pid;
+    }
+
+    /* wait for the server to accept connections */
+    for (i=0; i<500; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        int ok = connect(fd, (struct sockaddr*) &bench->addr, sizeof(bench->addr)) == 0;
+
+        close(fd);
+        if (ok) {
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return -1;
+        }
+        usleep(10000);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static int
+obelisk_bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static double
+obelisk_bench_percentile(obelisk_bench_t *bench, double p)
+{
+    size_t i;
+
+    if (bench->nlat == 0) {
+        return 0;
+    }
+    i = (size_t) (p * (bench->nlat - 1) + 0.5);
+    return bench->lat[i] / 1000.0;
+}
+
+static void
+obelisk_bench_report(obelisk_bench_t *bench, FILE *fp)
+{
+    double seconds = (bench->end - bench->start) / 1e9;
+    unsigned int calls = bench->batch ? bench->batch : 1;
+    double sum = 0;
+    size_t i;
+
+    qsort(bench->lat, bench->nlat, sizeof(uint64_t), obelisk_bench_cmp);
+    for (i=0; i<bench->nlat; i++) {
+        sum += bench->lat[i];
+    }
+
+    fprintf(fp, "{\"config\":{\"method\":\"%s\",\"connections\":%u,\"batch\":%u,"
+                "\"payload\":%zu,\"keepalive\":%s,\"server_threads\":%u},\n",
+            bench->method, bench->connections, bench->batch, bench->payload,
+            bench->keepalive ? "true" : "false", bench->server_threads);
+    fprintf(fp, " \"requests\":%llu,\"calls\":%llu,\"errors\":%llu,\"seconds\":%.3f,\n",
+            (unsigned long long) bench->done,
+            (unsigned long long) bench->done * calls,
+            (unsigned long long) bench->errors, seconds);
+    fprintf(fp, " \"requests_per_sec\":%.1f,\"calls_per_sec\":%.1f,\n",
+            seconds > 0 ? bench->done / seconds : 0,
+            seconds > 0 ? bench->done * calls / seconds : 0);
+    fprintf(fp, " \"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,"
+                "\"p999\":%.1f,\"max\":%.1f}}\n",
+            bench->nlat ? sum / bench->nlat / 1000.0 : 0,
+            obelisk_bench_percentile(bench, 0.5),
+            obelisk_bench_percentile(bench, 0.99),
+            obelisk_bench_percentile(bench, 0.999),
+            obelisk_bench_percentile(bench, 1.0));
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "%s : obelisk load generator\n", name);
+    fprintf(stderr, "-S <path>     spawn this obelisk binary (default:use running server)\n");
+    fprintf(stderr, "-T <num>      worker threads of the spawned server (default:1)\n");
+    fprintf(stderr, "-H <address>  server address (default:127.0.0.1)\n");
+    fprintf(stderr, "-p <num>      server port (default:%i)\n", OBELISK_BENCH_PORT);
+    fprintf(stderr, "-c <num>      concurrent connections (default:16)\n");
+    fprintf(stderr, "-n <num>      total requests, 0 runs for -d (default:100000)\n");
+    fprintf(stderr, "-d <seconds>  run time limit (default:none)\n");
+    fprintf(stderr, "-b <num>      calls per batch, 0 sends single calls (default:0)\n");
+    fprintf(stderr, "-m <method>   method to call (default:time)\n");
+    fprintf(stderr, "-a <json>     params (default:[])\n");
+    fprintf(stderr, "-z <bytes>    send a [\"xxx...\"] string param of this size\n");
+    fprintf(stderr, "-k <0|1>      keep-alive (default:1)\n");
+    fprintf(stderr, "-o <path>     write the JSON report here (default:stdout)\n");
+    exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    obelisk_bench_t bench;
+    const char *host = "127.0.0.1";
+    unsigned short port = OBELISK_BENCH_PORT;
+    pid_t server = 0;
+    unsigned int i;
+    FILE *fp = stdout;
+    int ch;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.method = "time";
+    bench.params = "[]";
+    bench.server_threads = 1;
+    bench.connections = 16;
+    bench.requests = 100000;
+    bench.keepalive = 1;
+
+    while (-1 != (ch = getopt(argc, argv, "S:T:H:p:c:n:d:b:m:a:z:k:o:h"))) {
+        switch (ch) {
+            case 'S': bench.server = optarg; break;
+            case 'T': bench.server_threads = atoi(optarg); break;
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': bench.connections = atoi(optarg); break;
+            case 'n': bench.requests = strtoull(optarg, NULL, 10); break;
+            case 'd': bench.duration = atof(optarg); break;
+            case 'b': bench.batch = atoi(optarg); break;
+            case 'm': bench.method = optarg; break;
+            case 'a': bench.params = optarg; break;
+            case 'z': bench.payload = strtoul(optarg, NULL, 10); break;
+            case 'k': bench.keepalive = atoi(optarg); break;
+            case 'o': bench.output = optarg; break;
+            default: usage(argv[0]); break;
+        }
+    }
+
+    if (bench.connections == 0 || (bench.requests == 0 && bench.duration <= 0)) {
+        usage(argv[0]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    bench.addr.sin_family = AF_INET;
+    bench.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &bench.addr.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", host);
+        return EXIT_FAILURE;
+    }
+
+    if (bench.server && (server = obelisk_bench_spawn(&bench)) < 0) {
+        fprintf(stderr, "unable to start %s\n", bench.server);
+        return EXIT_FAILURE;
+    }
+
+    obelisk_bench_build(&bench);
+    bench.base = event_base_new();
+    bench.start = obelisk_bench_now();
+    if (bench.duration > 0) {
+        bench.stop_at = bench.start + (uint64_t) (bench.duration * 1e9);
+    }
+
+    for (i=0; i<bench.connections && obelisk_bench_more(&bench); i++) {
+        bench.active++;
+        obelisk_bench_connect(&bench);
+    }
+    event_base_dispatch(bench.base);
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+
+    if (bench.output && (fp = fopen(bench.output, "w")) == NULL) {
+        fprintf(stderr, "%s: %s\n", bench.output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    obelisk_bench_report(&bench, fp);
+    if (fp != stdout) {
+        fclose(fp);
+        obelisk_bench_report(&bench, stderr);
+    }
+
+    event_base_free(bench.base);
+    free(bench.request);
+    free(bench.lat);
+    return bench.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
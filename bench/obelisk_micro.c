@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* In-process microbenchmarks of the request pipeline stages, run on
+ * canned requests without any sockets.  Reports ns/op and heap
+ * allocations/op for each stage. */
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <jansson.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "obelisk.h"
+#include "obelisk_arena.h"
+#include "obelisk_dispatch.h"
+#include "obelisk_error.h"
+#include "obelisk_json.h"
+#include "obelisk_request.h"
+#include "obelisk_worker.h"
+
+static uint64_t allocs;
+
+#ifdef __GLIBC__
+/* Count every heap allocation of the process, libevent and jansson
+ * included, by interposing on the glibc allocator */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void*
+malloc(size_t size)
+{
+    allocs++;
+    return __libc_malloc(size);
+}
+
+void*
+calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __libc_calloc(n, size);
+}
+
+void*
+realloc(void *ptr, size_t size)
+{
+    allocs++;
+    return __libc_realloc(ptr, size);
+}
+#define OBELISK_MICRO_ALLOCS 1
+#else
+#define OBELISK_MICRO_ALLOCS 0
+#endif
+
+typedef struct {
+    const char *name;
+    void (*fn)(void *arg);
+    void *arg;
+    unsigned int ops;       /* operations per call of fn, e.g. batch size */
+} obelisk_micro_t;
+
+static obelisk_worker_t worker;
+static struct evbuffer *sink;
+
+static uint64_t
+obelisk_micro_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static obelisk_error_t*
+obelisk_micro_time_cb(json_t *params, json_t **result)
+{
+    *result = json_integer(1234567890);
+    return OBELISK_SUCCESS;
+}
+
+static obelisk_error_t*
+obelisk_micro_echo_cb(json_t *params, json_t **result)
+{
+    *result = json_incref(params);
+    return OBELISK_SUCCESS;
+}
+
+static obelisk_rpc_t methods[] = {
+    {"add", obelisk_micro_time_cb, NULL, 0, 0, 0},
+    {"echo", obelisk_micro_echo_cb, NULL, 0, 0, 0},
+    {"status", obelisk_micro_time_cb, NULL, 0, 0, 0},
+    {"time", obelisk_micro_time_cb, NULL, 0, 0, 0},
+    {"version", obelisk_micro_time_cb, NULL, 0, 0, 0}
+};
+
+/* Canned corpus */
+
+static struct evbuffer*
+obelisk_micro_batch(unsigned int n, const char *method, const char *params)
+{
+    struct evbuffer *buf = evbuffer_new();
+    unsigned int i;
+
+    if (n) evbuffer_add(buf, "[", 1);
+    for (i=0; i<(n ? n : 1); i++) {
+        evbuffer_add_printf(buf, "%s{\"jsonrpc\":\"2.0\",\"method\":\"%s\","
+                            "\"params\":%s,\"id\":%u}", i ? "," : "",
+                            method, params, i + 1);
+    }
+    if (n) evbuffer_add(buf, "]", 1);
+    return buf;
+}
+
+/* Stages */
+
+static void
+obelisk_micro_reply(obelisk_request_t *r, struct evbuffer *body)
+{
+    evbuffer_drain(body, evbuffer_get_length(body));
+}
+
+static void
+obelisk_micro_request(void *arg)
+{
+    obelisk_request_t *r = obelisk_request_new(&worker, obelisk_micro_reply, NULL);
+    obelisk_request_run(r, (struct evbuffer*) arg);
+}
+
+static void
+obelisk_micro_parse(void *arg)
+{
+    json_error_t err;
+    json_decref(obelisk_json_load_evbuffer((struct evbuffer*) arg, &err));
+}
+
+static void
+obelisk_micro_dispatch(void *arg)
+{
+    const obelisk_rpc_t *rpc = obelisk_dispatch_find(worker.baton->dispatch, (const char*) arg,
+                                                 strlen((const char*) arg));
+    __asm__ __volatile__("" : : "r"(rpc));
+}
+
+static void
+obelisk_micro_handler(void *arg)
+{
+    const obelisk_rpc_t *rpc = obelisk_dispatch_find(worker.baton->dispatch, "echo", 4);
+    json_t *result = NULL;
+
+    (*rpc->cb)((json_t*) arg, &result);
+    json_decref(result);
+}
+
+static void
+obelisk_micro_write_response(void *arg)
+{
+    obelisk_writer_t w;
+
+    obelisk_writer_init(&w, sink);
+    obelisk_json_write_response(&w, (json_t*) arg, (json_t*) arg);
+    obelisk_writer_finish(&w);
+    evbuffer_drain(sink, evbuffer_get_length(sink));
+}
+
+static void
+obelisk_micro_json_response(void *arg)
+{
+    json_t *response = obelisk_json_response(json_incref((json_t*) arg), (json_t*) arg);
+    char *str = json_dumps(response, JSON_COMPACT);
+
+    /* jansson allocates through obelisk_malloc() */
+    obelisk_free(str);
+    json_decref(response);
+}
+
+static void
+obelisk_micro_error(void *arg)
+{
+    obelisk_error_t *err = obelisk_error_create((json_t*) arg,
+                                                OBELISK_ERROR_INVALID_PARAMS,
+                                                "expected [milliseconds]");
+    obelisk_error_destroy(err);
+}
+
+static void
+obelisk_micro_error_write(void *arg)
+{
+    obelisk_error_t *err = obelisk_error_create((json_t*) arg,
+                                                OBELISK_ERROR_INVALID_PARAMS,
+                                                "expected [milliseconds]");
+    obelisk_writer_t w;
+
+    obelisk_writer_init(&w, sink);
+    obelisk_error_write(err, &w);
+    obelisk_writer_finish(&w);
+    evbuffer_drain(sink, evbuffer_get_length(sink));
+    obelisk_error_destroy(err);
+}
+
+/* Harness */
+
+static void
+obelisk_micro_run(const obelisk_micro_t *m, uint64_t min_ns, FILE *json, int first)
+{
+    uint64_t iters = 0;
+    uint64_t batch = 1;
+    uint64_t a0;
+    uint64_t t0;
+    uint64_t elapsed;
+    uint64_t i;
+    double ns_op;
+    double allocs_op;
+
+    /* warm up caches, arenas and jansson's hashtables */
+    for (i=0; i<100; i++) {
+        m->fn(m->arg);
+    }
+
+    a0 = allocs;
+    t0 = obelisk_micro_now();
+    do {
+        for (i=0; i<batch; i++) {
+            m->fn(m->arg);
+        }
+        iters += batch;
+        batch *= 2;
+        elapsed = obelisk_micro_now() - t0;
+    } while (elapsed < min_ns);
+
+    ns_op = (double) elapsed / (iters * m->ops);
+    allocs_op = (double) (allocs - a0) / (iters * m->ops);
+
+    printf("%-28s %12.1f ns/op %10.2f allocs/op %10llu ops\n", m->name, ns_op,
+           OBELISK_MICRO_ALLOCS ? allocs_op : -1.0,
+           (unsigned long long) iters * m->ops);
+    if (json) {
+        fprintf(json, "%s\n {\"name\":\"%s\",\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f,"
+                      "\"ops\":%llu}", first ? "" : ",", m->name, ns_op,
+                OBELISK_MICRO_ALLOCS ? allocs_op : -1.0,
+                (unsigned long long) iters * m->ops);
+    }
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "%s : obelisk pipeline microbenchmarks\n", name);
+    fprintf(stderr, "-t <ms>       minimum run time per benchmark (default:200)\n");
+    fprintf(stderr, "-f <text>     only run benchmarks whose name contains text\n");
+    fprintf(stderr, "-o <path>     also write a JSON report here\n");
+    exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    obelisk_settings_t settings;
+    obelisk_baton_t baton;
+    uint64_t min_ns = 200 * 1000000ULL;
+    const char *filter = NULL;
+    FILE *json = NULL;
+    json_t *params;
+    json_t *id;
+    size_t i;
+    int first = 1;
+    int ch;
+
+    while (-1 != (ch = getopt(argc, argv, "t:f:o:h"))) {
+        switch (ch) {
+            case 't': min_ns = strtoull(optarg, NULL, 10) * 1000000ULL; break;
+            case 'f': filter = optarg; break;
+            case 'o':
+                if ((json = fopen(optarg, "w")) == NULL) {
+                    perror(optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default: usage(argv[0]); break;
+        }
+    }
+
+    obelisk_init(&settings);
+    memset(&baton, 0, sizeof(baton));
+    baton.settings = &settings;
+    for (i=0; i<sizeof(methods) / sizeof(methods[0]); i++) {
+        obelisk_register_method(&baton, &methods[i]);
+    }
+    obelisk_dispatch_build(baton.dispatch);
+
+    memset(&worker, 0, sizeof(worker));
+    worker.baton = &baton;
+    worker.base = event_base_new();
+    obelisk_stats_init(&worker.stats, baton.dispatch->count);
+    obelisk_trace_init(&worker.trace, 0);
+    baton.workers = &worker;
+    baton.nworkers = 1;
+    sink = evbuffer_new();
+
+    params = json_loads("[1, \"two\", {\"three\": 3.0}]", 0, NULL);
+    id = json_integer(42);
+
+    {
+        const obelisk_micro_t micro[] = {
+            {"parse/single", obelisk_micro_parse, obelisk_micro_batch(0, "time", "[]"), 1},
+            {"parse/batch10", obelisk_micro_parse, obelisk_micro_batch(10, "time", "[]"), 10},
+            {"dispatch/hit", obelisk_micro_dispatch, "time", 1},
+            {"dispatch/miss", obelisk_micro_dispatch, "nosuchmethod", 1},
+            {"handler/echo", obelisk_micro_handler, params, 1},
+            {"serialize/write_response", obelisk_micro_write_response, params, 1},
+            {"serialize/json_response", obelisk_micro_json_response, params, 1},
+            {"error/create_destroy", obelisk_micro_error, id, 1},
+            {"error/write", obelisk_micro_error_write, id, 1},
+            {"request/single", obelisk_micro_request, obelisk_micro_batch(0, "time", "[]"), 1},
+            {"request/batch1", obelisk_micro_request, obelisk_micro_batch(1, "time", "[]"), 1},
+            {"request/batch10", obelisk_micro_request, obelisk_micro_batch(10, "time", "[]"), 10},
+            {"request/batch1000", obelisk_micro_request, obelisk_micro_batch(1000, "time", "[]"), 1000},
+            {"request/echo", obelisk_micro_request, obelisk_micro_batch(0, "echo", "[1,\"two\",{\"three\":3.0}]"), 1},
+            {"request/parse_error", obelisk_micro_request, obelisk_micro_batch(0, "time", "[}"), 1}
+        };
+
+        if (json) fprintf(json, "{\"benchmarks\":[");
+        for (i=0; i<sizeof(micro) / sizeof(micro[0]); i++) {
+            if (filter && strstr(micro[i].name, filter) == NULL) {
+                continue;
+            }
+            obelisk_micro_run(&micro[i], min_ns, json, first);
+            first = 0;
+        }
+        if (json) {
+            fprintf(json, "\n]}\n");
+            fclose(json);
+        }
+    }
+
+    json_decref(params);
+    json_decref(id);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,609 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Replays a capture taken with obelisk -r against a running server,
+ * either at the recorded pacing (scaled by -x) or as fast as the
+ * connections allow, and reports throughput and latency per method. */
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <jansson.h>
+#include "obelisk_capture.h"
+#include "obelisk_msgpack.h"
+
+#define OBELISK_REPLAY_PORT 18351
+
+typedef struct {
+    uint64_t *lat;
+    size_t nlat;
+    size_t alat;
+    uint64_t errors;
+} obelisk_replay_latency_t;
+
+typedef struct {
+    char name[64];
+    obelisk_replay_latency_t lat;
+} obelisk_replay_method_t;
+
+typedef struct {
+    uint64_t time_us;
+    uint64_t at;
+    char *request;
+    size_t request_len;
+    unsigned int method;
+} obelisk_replay_record_t;
+
+typedef struct obelisk_replay_s obelisk_replay_t;
+
+typedef struct obelisk_replay_conn_s {
+    obelisk_replay_t *replay;
+    struct bufferevent *bev;
+    obelisk_replay_record_t *record;
+    uint64_t sent_at;
+    size_t body_left;
+    int in_body;
+    int status;
+    struct obelisk_replay_conn_s *next;
+} obelisk_replay_conn_t;
+
+struct obelisk_replay_s {
+    struct event_base *base;
+    struct event *timer;
+    struct sockaddr_in addr;
+
+    /* configuration */
+    const char *input;
+    const char *output;
+    unsigned int connections;
+    unsigned int loops;
+    double speed;
+
+    obelisk_replay_record_t *records;
+    size_t nrecords;
+    uint64_t span;
+    obelisk_replay_method_t *methods;
+    unsigned int nmethods;
+
+    /* progress */
+    uint64_t next;
+    uint64_t total;
+    uint64_t outstanding;
+    unsigned int open;
+    obelisk_replay_conn_t *idle;
+    uint64_t start;
+    uint64_t end;
+    obelisk_replay_latency_t all;
+};
+
+static uint64_t
+obelisk_replay_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+obelisk_replay_pump(obelisk_replay_t *replay);
+
+static void
+obelisk_replay_record(obelisk_replay_latency_t *lat, uint64_t ns, int error)
+{
+    if (lat->nlat == lat->alat) {
+        lat->alat = lat->alat ? lat->alat * 2 : 4096;
+        lat->lat = realloc(lat->lat, lat->alat * sizeof(uint64_t));
+    }
+    lat->lat[lat->nlat++] = ns;
+    lat->errors += error;
+}
+
+/* Account for the request the connection carried, if any */
+static void
+obelisk_replay_done(obelisk_replay_conn_t *conn, int error)
+{
+    obelisk_replay_t *replay = conn->replay;
+    uint64_t ns;
+
+    if (conn->record == NULL) {
+        return;
+    }
+
+    ns = obelisk_replay_now() - conn->sent_at;
+    obelisk_replay_record(&replay->methods[conn->record->method].lat, ns, error);
+    obelisk_replay_record(&replay->all, ns, error);
+    conn->record = NULL;
+    replay->outstanding--;
+}
+
+static void
+obelisk_replay_finish(obelisk_replay_t *replay)
+{
+    if (replay->next == replay->total && replay->outstanding == 0 && !replay->end) {
+        replay->end = obelisk_replay_now();
+        event_base_loopexit(replay->base, NULL);
+    }
+}
+
+static void
+obelisk_replay_close(obelisk_replay_conn_t *conn)
+{
+    obelisk_replay_t *replay = conn->replay;
+
+    bufferevent_free(conn->bev);
+    free(conn);
+    replay->open--;
+
+    obelisk_replay_pump(replay);
+    obelisk_replay_finish(replay);
+}
+
+static void
+obelisk_replay_read_cb(struct bufferevent *bev, void *arg)
+{
+    obelisk_replay_conn_t *conn = (obelisk_replay_conn_t*) arg;
+    obelisk_replay_t *replay = conn->replay;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    int close = 0;
+
+    if (!conn->in_body) {
+        char *line;
+        size_t len;
+
+        while ((line = evbuffer_readln(input, &len, EVBUFFER_EOL_CRLF)) != NULL) {
+            if (len == 0) {
+                free(line);
+                conn->in_body = 1;
+                break;
+            }
+            if (conn->status == 0) {
+                const char *sp = strchr(line, ' ');
+                conn->status = sp ? atoi(sp + 1) : -1;
+                conn->body_left = 0;
+            }
+            else if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                conn->body_left = strtoul(line + 15, NULL, 10);
+            }
+            else if (strncasecmp(line, "Connection:", 11) == 0 &&
+                     strstr(line + 11, "close")) {
+                close = 1;
+            }
+            free(line);
+        }
+        if (!conn->in_body) {
+            return;
+        }
+    }
+
+    if (evbuffer_get_length(input) < conn->body_left) {
+        return;
+    }
+    evbuffer_drain(input, conn->body_left);
+
+    /* 204 answers notification-only requests */
+    obelisk_replay_done(conn, conn->status != 200 && conn->status != 204);
+
+    if (close) {
+        obelisk_replay_close(conn);
+        return;
+    }
+
+    conn->next = replay->idle;
+    replay->idle = conn;
+    obelisk_replay_pump(replay);
+    obelisk_replay_finish(replay);
+}
+
+static void
+obelisk_replay_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+    obelisk_replay_conn_t *conn = (obelisk_replay_conn_t*) arg;
+    obelisk_replay_t *replay = conn->replay;
+    obelisk_replay_conn_t **p;
+
+    if (what & BEV_EVENT_CONNECTED) {
+        return;
+    }
+
+    for (p=&replay->idle; *p; p=&(*p)->next) {
+        if (*p == conn) {
+            *p = conn->next;
+            break;
+        }
+    }
+    obelisk_replay_done(conn, 1);
+    obelisk_replay_close(conn);
+}
+
+static obelisk_replay_conn_t*
+obelisk_replay_connect(obelisk_replay_t *replay)
+{
+    obelisk_replay_conn_t *conn = calloc(1, sizeof(obelisk_replay_conn_t));
+
+    conn->replay = replay;
+    conn->bev = bufferevent_socket_new(replay->base, -1, BEV_OPT_CLOSE_ON_FREE);
+    bufferevent_setcb(conn->bev, obelisk_replay_read_cb, NULL,
+                      obelisk_replay_event_cb, conn);
+    bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+
+    if (bufferevent_socket_connect(conn->bev, (struct sockaddr*) &replay->addr,
+                                   sizeof(replay->addr)) < 0) {
+        bufferevent_free(conn->bev);
+        free(conn);
+        return NULL;
+    }
+    replay->open++;
+    return conn;
+}
+
+/* When record i is due, relative to the start of the replay */
+static uint64_t
+obelisk_replay_due(obelisk_replay_t *replay, uint64_t i)
+{
+    obelisk_replay_record_t *rec = &replay->records[i % replay->nrecords];
+    double at = (double) (i / replay->nrecords) * replay->span + rec->at;
+
+    return replay->start + (uint64_t) (at / replay->speed);
+}
+
+/* Send every record that is due on an idle connection, opening new ones
+ * up to the limit.  Paced latency counts from the due time, so queueing
+ * behind busy connections shows up instead of being hidden. */
+static void
+obelisk_replay_pump(obelisk_replay_t *replay)
+{
+    while (replay->next < replay->total) {
+        obelisk_replay_conn_t *conn;
+        uint64_t now = obelisk_replay_now();
+        uint64_t due = now;
+
+        if (replay->speed > 0) {
+            due = obelisk_replay_due(replay, replay->next);
+            if (due > now) {
+                struct timeval tv;
+
+                tv.tv_sec = (due - now) / 1000000000ULL;
+                tv.tv_usec = ((due - now) % 1000000000ULL) / 1000;
+                evtimer_add(replay->timer, &tv);
+                return;
+            }
+        }
+
+        if ((conn = replay->idle) != NULL) {
+            replay->idle = conn->next;
+        }
+        else if (replay->open >= replay->connections ||
+                 (conn = obelisk_replay_connect(replay)) == NULL) {
+            return;
+        }
+
+        conn->record = &replay->records[replay->next % replay->nrecords];
+        conn->sent_at = due;
+        conn->in_body = 0;
+        conn->status = 0;
+        bufferevent_write(conn->bev, conn->record->request, conn->record->request_len);
+        replay->next++;
+        replay->outstanding++;
+    }
+}
+
+static void
+obelisk_replay_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+    obelisk_replay_pump((obelisk_replay_t*) arg);
+}
+
+static unsigned int
+obelisk_replay_method(obelisk_replay_t *replay, const char *name)
+{
+    char label[64];
+    unsigned int i;
+
+    /* names go into the JSON report as they are */
+    snprintf(label, sizeof(label), "%s", name);
+    for (i=0; label[i]; i++) {
+        if (label[i] == '"' || label[i] == '\\' || (unsigned char) label[i] < 0x20) {
+            label[i] = '_';
+        }
+    }
+
+    for (i=0; i<replay->nmethods; i++) {
+        if (strcmp(replay->methods[i].name, label) == 0) {
+            return i;
+        }
+    }
+
+    replay->methods = realloc(replay->methods,
+                              (replay->nmethods + 1) * sizeof(obelisk_replay_method_t));
+    memset(&replay->methods[i], 0, sizeof(obelisk_replay_method_t));
+    memcpy(replay->methods[i].name, label, sizeof(label));
+    replay->nmethods++;
+    return i;
+}
+
+/* Batches are reported together, whatever they call */
+static const char*
+obelisk_replay_label(json_t *req)
+{
+    json_t *method;
+
+    if (json_is_array(req)) {
+        return "(batch)";
+    }
+    method = json_object_get(req, "method");
+    return json_is_string(method) ? json_string_value(method) : "(invalid)";
+}
+
+static int
+obelisk_replay_time_cmp(const void *a, const void *b)
+{
+    const obelisk_replay_record_t *x = (const obelisk_replay_record_t*) a;
+    const obelisk_replay_record_t *y = (const obelisk_replay_record_t*) b;
+    return x->time_us < y->time_us ? -1 : x->time_us > y->time_us;
+}
+
+static int
+obelisk_replay_load(obelisk_replay_t *replay, const char *host)
+{
+    FILE *fp = fopen(replay->input, "rb");
+    obelisk_capture_header_t hdr;
+    char magic[8];
+    size_t alloc = 0;
+    size_t i;
+
+    if (fp == NULL) {
+        fprintf(stderr, "%s: %s\n", replay->input, strerror(errno));
+        return -1;
+    }
+    if (fread(magic, 1, 8, fp) != 8 || memcmp(magic, OBELISK_CAPTURE_MAGIC, 8) != 0) {
+        fprintf(stderr, "%s: not an obelisk capture\n", replay->input);
+        fclose(fp);
+        return -1;
+    }
+
+    while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+        int msgpack = hdr.flags & OBELISK_CAPTURE_MSGPACK;
+        struct evbuffer *req = evbuffer_new();
+        struct evbuffer *body = evbuffer_new();
+        obelisk_replay_record_t *rec;
+        json_error_t err;
+        json_t *js;
+        char *data;
+
+        /* the server never writes a record larger than its ring */
+        if (hdr.length > OBELISK_CAPTURE_RING) {
+            fprintf(stderr, "%s: corrupt record after %zu requests\n",
+                    replay->input, replay->nrecords);
+            evbuffer_free(req);
+            evbuffer_free(body);
+            break;
+        }
+        data = malloc(hdr.length);
+        if (data == NULL || fread(data, 1, hdr.length, fp) != hdr.length) {
+            /* a capture cut short while being written */
+            free(data);
+            evbuffer_free(req);
+            evbuffer_free(body);
+            break;
+        }
+
+        if (replay->nrecords == alloc) {
+            alloc = alloc ? alloc * 2 : 4096;
+            replay->records = realloc(replay->records,
+                                      alloc * sizeof(obelisk_replay_record_t));
+        }
+        rec = &replay->records[replay->nrecords++];
+        rec->time_us = hdr.time_us;
+
+        evbuffer_add(body, data, hdr.length);
+        js = msgpack ? obelisk_msgpack_load_evbuffer(body, &err)
+                     : json_loadb(data, hdr.length, 0, &err);
+        rec->method = obelisk_replay_method(replay, js ? obelisk_replay_label(js) : "(invalid)");
+        json_decref(js);
+
+        evbuffer_add_printf(req, "POST /api HTTP/1.1\r\n"
+                                 "Host: %s\r\n"
+                                 "Content-Type: %s\r\n"
+                                 "Content-Length: %u\r\n"
+                                 "\r\n",
+                            host, msgpack ? "application/msgpack" : "application/json",
+                            (unsigned int) hdr.length);
+        evbuffer_add_buffer(req, body);
+        rec->request_len = evbuffer_get_length(req);
+        rec->request = malloc(rec->request_len);
+        evbuffer_remove(req, rec->request, rec->request_len);
+
+        free(data);
+        evbuffer_free(req);
+        evbuffer_free(body);
+    }
+    fclose(fp);
+
+    if (replay->nrecords == 0) {
+        fprintf(stderr, "%s: no requests captured\n", replay->input);
+        return -1;
+    }
+
+    qsort(replay->records, replay->nrecords, sizeof(obelisk_replay_record_t),
+          obelisk_replay_time_cmp);
+    for (i=0; i<replay->nrecords; i++) {
+        replay->records[i].at = (replay->records[i].time_us - replay->records[0].time_us) * 1000;
+    }
+    /* loops follow each other a millisecond apart */
+    replay->span = replay->records[replay->nrecords - 1].at + 1000000;
+    return 0;
+}
+
+static int
+obelisk_replay_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static double
+obelisk_replay_percentile(obelisk_replay_latency_t *lat, double p)
+{
+    if (lat->nlat == 0) {
+        return 0;
+    }
+    return lat->lat[(size_t) (p * (lat->nlat - 1) + 0.5)] / 1000.0;
+}
+
+static void
+obelisk_replay_report_latency(FILE *fp, obelisk_replay_latency_t *lat, double seconds)
+{
+    double sum = 0;
+    size_t i;
+
+    qsort(lat->lat, lat->nlat, sizeof(uint64_t), obelisk_replay_cmp);
+    for (i=0; i<lat->nlat; i++) {
+        sum += lat->lat[i];
+    }
+
+    fprintf(fp, "{\"requests\":%zu,\"errors\":%llu,\"requests_per_sec\":%.1f,"
+                "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p99\":%.1f,"
+                "\"p999\":%.1f,\"max\":%.1f}}",
+            lat->nlat, (unsigned long long) lat->errors,
+            seconds > 0 ? lat->nlat / seconds : 0,
+            lat->nlat ? sum / lat->nlat / 1000.0 : 0,
+            obelisk_replay_percentile(lat, 0.5),
+            obelisk_replay_percentile(lat, 0.99),
+            obelisk_replay_percentile(lat, 0.999),
+            obelisk_replay_percentile(lat, 1.0));
+}
+
+static void
+obelisk_replay_report(obelisk_replay_t *replay, FILE *fp)
+{
+    double seconds = (replay->end - replay->start) / 1e9;
+    unsigned int i;
+
+    fprintf(fp, "{\"config\":{\"capture\":\"%s\",\"records\":%zu,\"loops\":%u,"
+                "\"speed\":%g,\"connections\":%u},\n",
+            replay->input, replay->nrecords, replay->loops, replay->speed,
+            replay->connections);
+    fprintf(fp, " \"seconds\":%.3f,\n \"total\":", seconds);
+    obelisk_replay_report_latency(fp, &replay->all, seconds);
+    fprintf(fp, ",\n \"methods\":{");
+    for (i=0; i<replay->nmethods; i++) {
+        fprintf(fp, "%s\n  \"%s\":", i ? "," : "", replay->methods[i].name);
+        obelisk_replay_report_latency(fp, &replay->methods[i].lat, seconds);
+    }
+    fprintf(fp, "}}\n");
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "%s : replay an obelisk capture\n", name);
+    fprintf(stderr, "%s [options] <capture>\n", name);
+    fprintf(stderr, "-H <address>  server address (default:127.0.0.1)\n");
+    fprintf(stderr, "-p <num>      server port (default:%i)\n", OBELISK_REPLAY_PORT);
+    fprintf(stderr, "-c <num>      maximum connections (default:16)\n");
+    fprintf(stderr, "-x <factor>   speed relative to the capture, 0 is flat out (default:1)\n");
+    fprintf(stderr, "-l <num>      times to replay the capture (default:1)\n");
+    fprintf(stderr, "-o <path>     write the JSON report here (default:stdout)\n");
+    exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    obelisk_replay_t replay;
+    const char *host = "127.0.0.1";
+    unsigned short port = OBELISK_REPLAY_PORT;
+    FILE *fp = stdout;
+    int ch;
+
+    memset(&replay, 0, sizeof(replay));
+    replay.connections = 16;
+    replay.loops = 1;
+    replay.speed = 1;
+
+    while (-1 != (ch = getopt(argc, argv, "H:p:c:x:l:o:h"))) {
+        switch (ch) {
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': replay.connections = atoi(optarg); break;
+            case 'x': replay.speed = atof(optarg); break;
+            case 'l': replay.loops = atoi(optarg); break;
+            case 'o': replay.output = optarg; break;
+            default: usage(argv[0]); break;
+        }
+    }
+
+    if (optind != argc - 1 || replay.connections == 0 || replay.loops == 0) {
+        usage(argv[0]);
+    }
+    replay.input = argv[optind];
+
+    signal(SIGPIPE, SIG_IGN);
+
+    replay.addr.sin_family = AF_INET;
+    replay.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &replay.addr.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", host);
+        return EXIT_FAILURE;
+    }
+
+    if (obelisk_replay_load(&replay, host) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    replay.base = event_base_new();
+    replay.timer = evtimer_new(replay.base, obelisk_replay_timer_cb, &replay);
+    replay.total = (uint64_t) replay.nrecords * replay.loops;
+    replay.start = obelisk_replay_now();
+
+    obelisk_replay_pump(&replay);
+    event_base_dispatch(replay.base);
+
+    if (replay.output && (fp = fopen(replay.output, "w")) == NULL) {
+        fprintf(stderr, "%s: %s\n", replay.output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    obelisk_replay_report(&replay, fp);
+    if (fp != stdout) {
+        fclose(fp);
+    }
+
+    event_free(replay.timer);
+    event_base_free(replay.base);
+    return replay.all.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Round-trip latency of the shared-memory transport against HTTP
+ * keep-alive.  One client issues the same call back to back over each
+ * transport of a running server, or one it spawns itself, and reports
+ * the latency percentiles of both as JSON. */
+
+/* for strcasestr() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "obelisk_shm_client.h"
+
+#define OBELISK_BENCH_PORT 18351
+#define OBELISK_BENCH_SHM "/tmp/obelisk-bench.shm"
+
+typedef struct {
+    const char *name;
+    uint64_t *lat;
+    size_t nlat;
+    uint64_t errors;
+} obelisk_bench_run_t;
+
+typedef struct {
+    struct sockaddr_in addr;
+    const char *server;
+    const char *shm_path;
+    const char *method;
+    const char *params;
+    const char *output;
+    size_t payload;
+    uint64_t requests;
+    uint64_t warmup;
+
+    char *body;
+    size_t body_len;
+} obelisk_bench_t;
+
+static uint64_t
+obelisk_bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+obelisk_bench_build(obelisk_bench_t *bench)
+{
+    size_t len = strlen(bench->method) + strlen(bench->params) + bench->payload + 64;
+    char *params = NULL;
+
+    if (bench->payload) {
+        params = malloc(bench->payload + 5);
+        params[0] = '[';
+        params[1] = '"';
+        memset(params + 2, 'x', bench->payload);
+        strcpy(params + 2 + bench->payload, "\"]");
+    }
+
+    bench->body = malloc(len);
+    bench->body_len = snprintf(bench->body, len,
+                               "{\"jsonrpc\":\"2.0\",\"method\":\"%s\",\"params\":%s,\"id\":1}",
+                               bench->method, params ? params : bench->params);
+    free(params);
+}
+
+/* One call over the shared-memory rings */
+static int
+obelisk_bench_shm(obelisk_bench_t *bench, void *arg)
+{
+    size_t len;
+    char *reply = obelisk_shm_call((obelisk_shm_client_t*) arg,
+                                   bench->body, bench->body_len, &len);
+
+    if (reply == NULL) {
+        return -1;
+    }
+    free(reply);
+    return 0;
+}
+
+/* One call over a keep-alive HTTP connection, reading the reply by its
+ * Content-Length */
+static int
+obelisk_bench_http(obelisk_bench_t *bench, void *arg)
+{
+    static char buf[1 << 16];
+    int fd = *(int*) arg;
+    char head[256];
+    size_t have = 0;
+    size_t need = 0;
+    int hlen = snprintf(head, sizeof(head),
+                        "POST /api HTTP/1.1\r\nHost: localhost\r\n"
+                        "Content-Type: application/json\r\nContent-Length: %zu\r\n\r\n",
+                        bench->body_len);
+
+    if (write(fd, head, hlen) != hlen ||
+        write(fd, bench->body, bench->body_len) != (ssize_t) bench->body_len) {
+        return -1;
+    }
+
+    for (;;) {
+        ssize_t n = read(fd, buf + have, sizeof(buf) - have - 1);
+        char *end;
+        char *cl;
+
+        if (n <= 0) {
+            return -1;
+        }
+        have += n;
+        buf[have] = '\0';
+
+        if (need == 0 && (end = strstr(buf, "\r\n\r\n")) != NULL) {
+            if (strncmp(buf, "HTTP/1.1 200", 12) != 0 ||
+                (cl = strcasestr(buf, "Content-Length:")) == NULL || cl > end) {
+                return -1;
+            }
+            need = (end + 4 - buf) + strtoul(cl + 15, NULL, 10);
+            if (need >= sizeof(buf)) {
+                return -1;
+            }
+        }
+        if (need && have >= need) {
+            return 0;
+        }
+        if (have == sizeof(buf) - 1) {
+            return -1;
+        }
+    }
+}
+
+static int
+obelisk_bench_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+obelisk_bench_run(obelisk_bench_t *bench, obelisk_bench_run_t *run,
+                  int (*call)(obelisk_bench_t *bench, void *arg), void *arg)
+{
+    uint64_t i;
+
+    run->lat = malloc(bench->requests * sizeof(uint64_t));
+    for (i=0; i<bench->warmup; i++) {
+        call(bench, arg);
+    }
+    for (i=0; i<bench->requests; i++) {
+        uint64_t start = obelisk_bench_now();
+
+        if (call(bench, arg) < 0) {
+            run->errors++;
+            break;
+        }
+        run->lat[run->nlat++] = obelisk_bench_now() - start;
+    }
+    qsort(run->lat, run->nlat, sizeof(uint64_t), obelisk_bench_cmp);
+}
+
+static int
+obelisk_bench_http_connect(obelisk_bench_t *bench)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+
+    if (fd < 0) {
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr*) &bench->addr, sizeof(bench->addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static pid_t
+obelisk_bench_spawn(obelisk_bench_t *bench)
+{
+    char port[16];
+    pid_t pid;
+    int i;
+
+    snprintf(port, sizeof(port), "%u", ntohs(bench->addr.sin_port));
+
+    pid = fork();
+    if (pid == 0) {
+        execl(bench->server, bench->server, "-l", "127.0.0.1", "-p", port,
+              "-S", bench->shm_path, (char*) NULL);
+        fprintf(stderr, "exec %s: %s\n", bench->server, strerror(errno));
+        _exit(127);
+    }
+    if (pid < 0) {
+        return pid;
+    }
+
+    /* wait for the server to accept connections */
+    for (i=0; i<500; i++) {
+        obelisk_shm_client_t *c = obelisk_shm_connect(bench->shm_path);
+
+        if (c) {
+            obelisk_shm_close(c);
+            return pid;
+        }
+        if (waitpid(pid, NULL, WNOHANG) == pid) {
+            return -1;
+        }
+        usleep(10000);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+static double
+obelisk_bench_percentile(obelisk_bench_run_t *run, double p)
+{
+    size_t i;
+
+    if (run->nlat == 0) {
+        return 0;
+    }
+    i = (size_t) (p * (run->nlat - 1) + 0.5);
+    return run->lat[i] / 1000.0;
+}
+
+static void
+obelisk_bench_report_run(obelisk_bench_run_t *run, FILE *fp)
+{
+    double sum = 0;
+    size_t i;
+
+    for (i=0; i<run->nlat; i++) {
+        sum += run->lat[i];
+    }
+    fprintf(fp, " \"%s\":{\"requests\":%zu,\"errors\":%llu,"
+                "\"latency_us\":{\"mean\":%.2f,\"p50\":%.2f,\"p99\":%.2f,"
+                "\"p999\":%.2f,\"max\":%.2f}}",
+            run->name, run->nlat, (unsigned long long) run->errors,
+            run->nlat ? sum / run->nlat / 1000.0 : 0,
+            obelisk_bench_percentile(run, 0.5),
+            obelisk_bench_percentile(run, 0.99),
+            obelisk_bench_percentile(run, 0.999),
+            obelisk_bench_percentile(run, 1.0));
+}
+
+static void
+obelisk_bench_report(obelisk_bench_t *bench, obelisk_bench_run_t *shm,
+                     obelisk_bench_run_t *http, FILE *fp)
+{
+    double shm_p50 = obelisk_bench_percentile(shm, 0.5);
+
+    fprintf(fp, "{\"config\":{\"method\":\"%s\",\"payload\":%zu,\"requests\":%llu},\n",
+            bench->method, bench->payload, (unsigned long long) bench->requests);
+    obelisk_bench_report_run(shm, fp);
+    fprintf(fp, ",\n");
+    obelisk_bench_report_run(http, fp);
+    fprintf(fp, ",\n \"p50_speedup\":%.2f}\n",
+            shm_p50 > 0 ? obelisk_bench_percentile(http, 0.5) / shm_p50 : 0);
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "%s : obelisk shared-memory vs HTTP round trips\n", name);
+    fprintf(stderr, "-S <path>     spawn this obelisk binary (default:use running server)\n");
+    fprintf(stderr, "-u <path>     shared-memory handshake socket (default:%s)\n",
+            OBELISK_BENCH_SHM);
+    fprintf(stderr, "-H <address>  server address (default:127.0.0.1)\n");
+    fprintf(stderr, "-p <num>      server port (default:%i)\n", OBELISK_BENCH_PORT);
+    fprintf(stderr, "-n <num>      round trips per transport (default:100000)\n");
+    fprintf(stderr, "-w <num>      untimed round trips first (default:1000)\n");
+    fprintf(stderr, "-m <method>   method to call (default:time)\n");
+    fprintf(stderr, "-a <json>     params (default:[])\n");
+    fprintf(stderr, "-z <bytes>    send a [\"xxx...\"] string param of this size\n");
+    fprintf(stderr, "-o <path>     write the JSON report here (default:stdout)\n");
+    exit(0);
+}
+
+int
+main(int argc, char **argv)
+{
+    obelisk_bench_t bench;
+    obelisk_bench_run_t shm;
+    obelisk_bench_run_t http;
+    obelisk_shm_client_t *c;
+    const char *host = "127.0.0.1";
+    unsigned short port = OBELISK_BENCH_PORT;
+    pid_t server = 0;
+    FILE *fp = stdout;
+    int fd;
+    int ch;
+
+    memset(&bench, 0, sizeof(bench));
+    memset(&shm, 0, sizeof(shm));
+    memset(&http, 0, sizeof(http));
+    bench.shm_path = OBELISK_BENCH_SHM;
+    bench.method = "time";
+    bench.params = "[]";
+    bench.requests = 100000;
+    bench.warmup = 1000;
+    shm.name = "shm";
+    http.name = "http";
+
+    while (-1 != (ch = getopt(argc, argv, "S:u:H:p:n:w:m:a:z:o:h"))) {
+        switch (ch) {
+            case 'S': bench.server = optarg; break;
+            case 'u': bench.shm_path = optarg; break;
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'n': bench.requests = strtoull(optarg, NULL, 10); break;
+            case 'w': bench.warmup = strtoull(optarg, NULL, 10); break;
+            case 'm': bench.method = optarg; break;
+            case 'a': bench.params = optarg; break;
+            case 'z': bench.payload = strtoul(optarg, NULL, 10); break;
+            case 'o': bench.output = optarg; break;
+            default: usage(argv[0]); break;
+        }
+    }
+
+    if (bench.requests == 0) {
+        usage(argv[0]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    bench.addr.sin_family = AF_INET;
+    bench.addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &bench.addr.sin_addr) != 1) {
+        fprintf(stderr, "bad address %s\n", host);
+        return EXIT_FAILURE;
+    }
+
+    if (bench.server && (server = obelisk_bench_spawn(&bench)) < 0) {
+        fprintf(stderr, "unable to start %s\n", bench.server);
+        return EXIT_FAILURE;
+    }
+
+    obelisk_bench_build(&bench);
+
+    if ((c = obelisk_shm_connect(bench.shm_path)) == NULL) {
+        fprintf(stderr, "%s: %s\n", bench.shm_path, strerror(errno));
+        shm.errors++;
+    }
+    else {
+        obelisk_bench_run(&bench, &shm, obelisk_bench_shm, c);
+        obelisk_shm_close(c);
+    }
+
+    if ((fd = obelisk_bench_http_connect(&bench)) < 0) {
+        fprintf(stderr, "%s:%u: %s\n", host, port, strerror(errno));
+        http.errors++;
+    }
+    else {
+        obelisk_bench_run(&bench, &http, obelisk_bench_http, &fd);
+        close(fd);
+    }
+
+    if (server > 0) {
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+    }
+
+    if (bench.output && (fp = fopen(bench.output, "w")) == NULL) {
+        fprintf(stderr, "%s: %s\n", bench.output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    obelisk_bench_report(&bench, &shm, &http, fp);
+    if (fp != stdout) {
+        fclose(fp);
+        obelisk_bench_report(&bench, &shm, &http, stderr);
+    }
+
+    free(bench.body);
+    free(shm.lat);
+    free(http.lat);
+    return shm.errors || http.errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
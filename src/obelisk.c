@@ -24,197 +24,234 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <event2/event.h>
+#include <event2/buffer.h>
 #include <event2/http.h>
 #include <event2/http_struct.h>
+#include <event2/util.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netdb.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <errno.h>
 #include "obelisk.h"
+#include "obelisk_arena.h"
+#include "obelisk_cache.h"
+#include "obelisk_capture.h"
+#include "obelisk_compress.h"
+#include "obelisk_dispatch.h"
 #include "obelisk_error.h"
+#include "obelisk_log.h"
+#include "obelisk_pool.h"
+#include "obelisk_request.h"
+#include "obelisk_shm_server.h"
+#include "obelisk_stats.h"
+#include "obelisk_stream.h"
+#include "obelisk_trace.h"
+#include "obelisk_worker.h"
+#include "obelisk_ws.h"
 
-static int
-compare_methods(const void * va, const void * vb)
+static void
+obelisk_api_reply(obelisk_request_t *r, struct evbuffer *body)
 {
-    return strcmp(va, ((obelisk_rpc_t*)vb)->method);
-}
+    struct evhttp_request *req = (struct evhttp_request*) r->transport;
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    size_t min = r->worker->baton->settings->compress_min;
+    obelisk_encoding_t enc;
+    struct evbuffer *packed;
+
+    if (evbuffer_get_length(body) == 0) {
+        evhttp_send_reply(req, HTTP_NOCONTENT, "No Content", NULL);
+        return;
+    }
 
-static obelisk_error_t*
-obelisk_execute_rpc(json_t *request, json_t **response, obelisk_baton_t *baton)
-{
-    obelisk_error_t *obelisk_err = OBELISK_SUCCESS;
-    json_t *method; 
-    json_t *params;
-    json_t *id;
-    const char *method_string;
-    
-    /* fetch the ID first and make sure we have it, because we need it later */
-    if ((id = json_object_get(request, "id")) == NULL) {
-        obelisk_err = obelisk_error_create(id, OBELISK_ERROR_INVALID_REQUEST, 
-                                 "id missing");
+    evhttp_add_header(headers, "Content-Type",
+                      r->format == OBELISK_FORMAT_MSGPACK ? "application/msgpack"
+                                                          : "application/json");
+
+    /* small bodies are not worth the CPU */
+    if (min == 0 || evbuffer_get_length(body) < min) {
+        evhttp_send_reply(req, HTTP_OK, "ej", body);
+        return;
     }
 
-    /* Check the method and params parameters */
-    if ((method = json_object_get(request, "method")) == NULL ||
-        (method_string = json_string_value(method)) == NULL) {
-        obelisk_err = obelisk_error_create(id, OBELISK_ERROR_INVALID_REQUEST, 
-                                 "method missing");
+    evhttp_add_header(headers, "Vary", "Accept-Encoding");
+    enc = obelisk_encoding_negotiate(evhttp_find_header(evhttp_request_get_input_headers(req),
+                                                        "Accept-Encoding"));
+    if (enc == OBELISK_ENCODING_IDENTITY) {
+        evhttp_send_reply(req, HTTP_OK, "ej", body);
+        return;
     }
-    else if ((params = json_object_get(request, "params")) == NULL) {
-        obelisk_err = obelisk_error_create(id, OBELISK_ERROR_INVALID_REQUEST, 
-                                 "params missing");
+
+    packed = evbuffer_new();
+    if (obelisk_compress_evbuffer(enc, body, packed) < 0) {
+        evhttp_send_error(req, HTTP_INTERNAL, "Compression Failed");
     }
     else {
-        json_t *result;
-        obelisk_rpc_t *rpc = bsearch(method_string, 
-                                     baton->rpc,
-                                     baton->rpc_size / sizeof(obelisk_rpc_t),
-                                     sizeof(obelisk_rpc_t),
-                                     compare_methods);
-        if (!rpc) {
-            obelisk_err = obelisk_error_create(id, OBELISK_ERROR_METHOD_NOT_FOUND, "");
-            goto done;
-        }
+        evhttp_add_header(headers, "Content-Encoding", obelisk_encoding_name(enc));
+        evhttp_send_reply(req, HTTP_OK, "ej", packed);
+    }
+    evbuffer_free(packed);
+}
 
-        obelisk_err = (*rpc->cb)(params, &result);
-        if (obelisk_err) {
-            goto done;
-        }
+static void
+obelisk_api_stream_more(struct evhttp_connection *evcon, void *arg);
 
-        *response = obelisk_json_response(result, id);
+/* The client went away mid-stream */
+static void
+obelisk_api_stream_close(struct evhttp_connection *evcon, void *arg)
+{
+    obelisk_request_t *r = (obelisk_request_t*) arg;
+    struct evhttp_request *req = (struct evhttp_request*) r->transport;
+
+    /* a request cut off from its connection is ours to free */
+    if (evhttp_request_get_connection(req) == NULL) {
+        evhttp_send_reply_end(req);
+    }
+    obelisk_request_stream_end(r);
+}
 
-        json_decref(result);
+/* Called once the previous chunk has been written, so a slow client
+ * holds back the producer instead of growing the output buffer */
+static void
+obelisk_api_stream_more(struct evhttp_connection *evcon, void *arg)
+{
+    obelisk_request_t *r = (obelisk_request_t*) arg;
+    struct evhttp_request *req = (struct evhttp_request*) r->transport;
+    struct evbuffer *chunk = evbuffer_new();
+    int more = obelisk_request_stream(r, chunk);
+
+    if (more > 0) {
+        evhttp_send_reply_chunk_with_cb(req, chunk, obelisk_api_stream_more, r);
+        evbuffer_free(chunk);
+        return;
     }
 
-done:
-    return obelisk_err;
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req), NULL, NULL);
+    if (more < 0) {
+        /* no terminating chunk, the client sees a truncated reply */
+        evhttp_connection_free(evhttp_request_get_connection(req));
+    }
+    else {
+        evhttp_send_reply_chunk(req, chunk);
+        evhttp_send_reply_end(req);
+    }
+    evbuffer_free(chunk);
+    obelisk_request_stream_end(r);
+}
+
+/* Start a chunked reply with the head of a streamed result */
+static void
+obelisk_api_stream(obelisk_request_t *r, struct evbuffer *head)
+{
+    struct evhttp_request *req = (struct evhttp_request*) r->transport;
+
+    evhttp_add_header(evhttp_request_get_output_headers(req),
+                      "Content-Type", "application/json");
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req),
+                                  obelisk_api_stream_close, r);
+    evhttp_send_reply_start(req, HTTP_OK, "ej");
+    evhttp_send_reply_chunk_with_cb(req, head, obelisk_api_stream_more, r);
 }
 
-/** 
- * @brief Run the JSON-RPC handler
- * @param request The entire request object
- * @param response response object, freed by caller
- * @return obelisk_SUCCESS on success
+/**
+ * @brief Decode a request body sent with a Content-Encoding
+ * @return the decoded body to free, or NULL after failing the request
  */
-static obelisk_error_t*
-obelisk_run_handle(json_t *request, json_t **response, obelisk_baton_t *baton)
+static struct evbuffer*
+obelisk_api_decode(obelisk_request_t *r, struct evhttp_request *req, const char *header)
 {
-    obelisk_error_t *obelisk_err = OBELISK_SUCCESS;
-    int array_size = json_array_size(request);
-    if (array_size == 0) { /* Single RPC Call */
-        obelisk_err = obelisk_execute_rpc(request, response, baton);
+    obelisk_encoding_t enc = obelisk_encoding_parse(header);
+    struct evbuffer *body;
+
+    if (enc == OBELISK_ENCODING_UNKNOWN) {
+        obelisk_request_fail(r, OBELISK_ERROR_INVALID_REQUEST, "Unsupported Content-Encoding");
+        return NULL;
     }
-    else { /* Multi-RPC Call */
-        int i;
-        json_t *rsp_element;
-        json_t *req_element;
-        obelisk_error_t *rsp_err;
-
-        /* Create response array */
-        *response = json_array();
-
-        for (i=0; i<array_size; i++) {
-            req_element = json_array_get(request, i);
-            rsp_err = obelisk_execute_rpc(req_element, &rsp_element, baton);
-            if (rsp_err) {
-                /* RPC call errored out */
-                json_array_append(*response, rsp_err->json);
-                obelisk_error_destroy(rsp_err);
-            }
-            else {
-                json_array_append(*response, rsp_element);
-                json_decref(rsp_element);
-            }
-        }
+
+    body = evbuffer_new();
+    if (obelisk_decompress_evbuffer(enc, evhttp_request_get_input_buffer(req), body,
+                                    r->worker->baton->settings->max_body) < 0) {
+        evbuffer_free(body);
+        obelisk_request_fail(r, OBELISK_ERROR_INVALID_REQUEST, "Bad Compressed Request");
+        return NULL;
     }
 
-    return obelisk_err;
+    return body;
 }
 
 static void
 obelisk_api_cb(struct evhttp_request *req, void *arg)
 {
-    obelisk_error_t *obelisk_err = NULL;
-    json_error_t js_err;
-    json_t *js_rsp;
-    json_t *js_req;
-    unsigned char *json_request;
-    unsigned char *json_response;
-    struct evbuffer *evb = evbuffer_new();
-    struct evbuffer *evr = evhttp_request_get_input_buffer(req);
-    ev_ssize_t request_length = evbuffer_get_length(evr);
-    obelisk_baton_t *baton = (obelisk_baton_t*) arg;
-
-    /* Check for POST */
-    if (req->type != EVHTTP_REQ_POST) {
-        json_incref(js_rsp);
-        goto done;
+    obelisk_worker_t *worker = (obelisk_worker_t*) arg;
+    obelisk_request_t *r = obelisk_request_new(worker, obelisk_api_reply, req);
+    obelisk_settings_t *settings = worker->baton->settings;
+    struct evbuffer *decoded = NULL;
+    struct evbuffer *body;
+    const char *encoding;
+    const char *type;
+    const char *timeout;
+
+    if (r == NULL) {
+        evhttp_send_error(req, HTTP_SERVUNAVAIL, "Out Of Memory");
+        return;
     }
 
-    /* Check for an empty request */
-    if (request_length == 0) {
-        obelisk_err = obelisk_error_create(0, OBELISK_ERROR_INVALID_REQUEST, "Empty Request");
-        js_rsp = obelisk_err->json;
-        json_incref(js_rsp);
-        goto done;
-    }
-    
-    json_request = evbuffer_pullup(evr, request_length);
-    if (json_request == NULL) {
-        obelisk_err = obelisk_error_create(0, OBELISK_ERROR_INVALID_REQUEST, "Empty Request");
-        js_rsp = obelisk_err->json;
-        json_incref(js_rsp);
-        goto done;
-    }
+    snprintf(r->peer, sizeof(r->peer), "%s:%i",
+             (req->remote_host) ? req->remote_host : "0.0.0.0", 
+             req->remote_port);
 
-    json_request[request_length] = 0;
+    r->stream = obelisk_api_stream;
 
-    if (baton->settings->verbose > 1) {
-        fprintf(stderr, "Request(%s:%i) %s\n",
-                (req->remote_host) ? req->remote_host : "0.0.0.0", 
-                req->remote_port, json_request);
+    /* Content-Type picks the wire format for both directions */
+    type = evhttp_find_header(evhttp_request_get_input_headers(req), "Content-Type");
+    if (type && (strncasecmp(type, "application/msgpack", 19) == 0 ||
+                 strncasecmp(type, "application/x-msgpack", 21) == 0)) {
+        r->format = OBELISK_FORMAT_MSGPACK;
     }
 
-    /* Parse Request */
-    js_req = json_loads(json_request, &js_err);
-    if (js_req == NULL) {
-        /* Format Parse Error */
-        obelisk_err = obelisk_error_create(0, OBELISK_ERROR_PARSE, js_err.text);
-        js_rsp = obelisk_err->json;
-        json_incref(js_rsp);
-        goto done;
+    /* a client supplied budget replaces the default deadline */
+    timeout = evhttp_find_header(evhttp_request_get_input_headers(req), "X-Deadline-Ms");
+    if (timeout) {
+        obelisk_request_set_timeout(r, strtoul(timeout, NULL, 10));
     }
 
-    /* Run Handler */
-    obelisk_err = obelisk_run_handle(js_req, &js_rsp, baton);
-    if (obelisk_err) {
-        obelisk_err = obelisk_error_create(0, OBELISK_ERROR_INVALID_REQUEST, obelisk_err->msg);
-        js_rsp = obelisk_err->json;
-        json_incref(js_rsp);
-        goto done;
+    /* Check for POST */
+    if (req->type != EVHTTP_REQ_POST) {
+        obelisk_request_fail(r, OBELISK_ERROR_INVALID_REQUEST, "POST required");
+        return;
     }
 
-    /* Write data */
-done:
-    json_response = json_dumps(js_rsp, 0);
-    if (json_response) {
-        if (baton->settings->verbose > 1) {
-            fprintf(stderr, "Response(%s:%i): %s",
-                    req->remote_host,
-                    req->remote_port, 
-                    json_response);
+    encoding = evhttp_find_header(evhttp_request_get_input_headers(req), "Content-Encoding");
+    if (encoding && strcasecmp(encoding, "identity") != 0) {
+        if ((body = obelisk_api_decode(r, req, encoding)) == NULL) {
+            return;
         }
-        evbuffer_add(evb, json_response, strlen(json_response));
+        decoded = body;
+    }
+    else {
+        body = evhttp_request_get_input_buffer(req);
     }
-    free(json_response);
 
-    /* Send the reply */
-    evhttp_send_reply(req, HTTP_OK, "ej", evb);
+    /* bodies are captured decoded, replays send them as they are */
+    if (settings->capture_path && settings->capture_sample &&
+        ++worker->capture.seq % settings->capture_sample == 0) {
+        struct timeval tv;
+
+        event_base_gettimeofday_cached(worker->base, &tv);
+        obelisk_capture_add(&worker->capture, &tv,
+                            r->format == OBELISK_FORMAT_MSGPACK ? OBELISK_CAPTURE_MSGPACK : 0,
+                            body);
+    }
 
-    /* Free data */
-    json_decref(js_rsp);
-    if (obelisk_err) obelisk_error_destroy(obelisk_err);        
-    evbuffer_free(evb);
+    obelisk_request_run(r, body);
+    if (decoded) {
+        evbuffer_free(decoded);
+    }
 }
 
 static void
@@ -248,11 +285,102 @@ obelisk_daemonize(obelisk_settings_t *settings)
     freopen( "/dev/null", "w", stderr);
 }
 
+/**
+ * @brief Create a non-blocking listening socket
+ * @param address bind address, NULL for all interfaces
+ * @param port port to listen on
+ * @param reuseport set SO_REUSEPORT so every worker can bind its own socket
+ * @return the socket, or -1 on error
+ */
+static evutil_socket_t
+obelisk_listen(const char *address, unsigned short port, int reuseport)
+{
+    struct addrinfo hints;
+    struct addrinfo *res;
+    struct addrinfo *ai;
+    char portbuf[8];
+    evutil_socket_t fd = -1;
+    int on = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf(portbuf, sizeof(portbuf), "%u", port);
+
+    if (getaddrinfo(address, portbuf, &hints, &res) != 0) {
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        evutil_make_socket_nonblocking(fd);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (void*) &on, sizeof(on));
+#ifdef SO_REUSEPORT
+        if (reuseport) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (void*) &on, sizeof(on));
+        }
+#endif
+
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+            listen(fd, SOMAXCONN) == 0) {
+            break;
+        }
+
+        evutil_closesocket(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* Listening socket for the next worker: a fresh one when SO_REUSEPORT is
+ * in effect, otherwise a duplicate of the socket made for the first */
+static evutil_socket_t
+obelisk_worker_socket(evutil_socket_t *fd, const char *address,
+                      unsigned short port, int reuseport)
+{
+    if (reuseport || *fd < 0) {
+        *fd = obelisk_listen(address, port, reuseport);
+        if (*fd < 0) {
+            fprintf(stderr, "bind error %s:%i %s\n",
+                    address ? address : "0.0.0.0", port, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        return *fd;
+    }
+    return dup(*fd);
+}
+
+static void*
+obelisk_worker_run(void *arg)
+{
+    obelisk_worker_t *worker = (obelisk_worker_t*) arg;
+    event_base_dispatch(worker->base);
+    return NULL;
+}
+
 void
 obelisk_init(obelisk_settings_t *settings)
 {
     memset(settings, 0, sizeof(*settings));
+    obelisk_arena_install();
     settings->port = OBELISK_DEFAULT_PORT;
+    settings->threads = 1;
+    settings->max_body = OBELISK_DEFAULT_MAX_BODY;
+    settings->batch_parallel = OBELISK_DEFAULT_BATCH_PARALLEL;
+    settings->pool_threads = OBELISK_DEFAULT_POOL_THREADS;
+    settings->pool_queue = OBELISK_DEFAULT_POOL_QUEUE;
+    settings->trace_events = OBELISK_DEFAULT_TRACE_EVENTS;
+    settings->cache_size = OBELISK_DEFAULT_CACHE_SIZE;
+    settings->compress_min = OBELISK_DEFAULT_COMPRESS_MIN;
+    settings->log_size = OBELISK_DEFAULT_LOG_SIZE;
+    settings->capture_sample = 1;
 }
 
 void 
@@ -268,12 +396,151 @@ obelisk_run(obelisk_baton_t *baton)
     }
 
     {
-        struct event_base *base = event_base_new();
-        struct evhttp *http = evhttp_new(base);
+        unsigned int i;
+        unsigned int nthreads = settings->threads ? settings->threads : 1;
+        obelisk_worker_t *workers = calloc(nthreads, sizeof(obelisk_worker_t));
+        evutil_socket_t fd = -1;
+        evutil_socket_t stream_fd = -1;
+        evutil_socket_t unix_fd = -1;
+        evutil_socket_t shm_fd = -1;
+        int reuseport = 0;
+
+        if (baton->dispatch == NULL) {
+            baton->dispatch = calloc(1, sizeof(obelisk_dispatch_t));
+        }
+        obelisk_dispatch_build(baton->dispatch);
+
+        baton->cache = NULL;
+        if (settings->cache_size) {
+            for (i=0; i<baton->dispatch->count; i++) {
+                if (baton->dispatch->methods[i].cache_ms) {
+                    baton->cache = obelisk_cache_new(settings->cache_size);
+                    break;
+                }
+            }
+        }
 
-        evhttp_set_cb(http, "/api", obelisk_api_cb, baton);
-        evhttp_bind_socket(http, settings->bindaddr, settings->port);
+        baton->workers = workers;
+        baton->nworkers = nthreads;
+
+        baton->pool = NULL;
+        if (settings->pool_threads) {
+            baton->pool = obelisk_pool_new(settings->pool_threads,
+                                           settings->pool_queue);
+        }
 
-        event_base_dispatch(base);
+        /* -vv logs every request with its bodies to stderr */
+        if (settings->log_path == NULL && settings->verbose > 1) {
+            settings->log_sample = 1;
+        }
+        baton->logging = settings->log_path || settings->verbose > 1;
+
+#ifdef SO_REUSEPORT
+        /* let the kernel spread connections across the workers */
+        reuseport = nthreads > 1;
+#endif
+
+        for (i=0; i<nthreads; i++) {
+            obelisk_worker_t *worker = &workers[i];
+
+            worker->baton = baton;
+            worker->index = i;
+            obelisk_stats_init(&worker->stats, baton->dispatch->count);
+            obelisk_trace_init(&worker->trace,
+                               settings->trace_rate ? settings->trace_events : 0);
+            if (baton->logging && obelisk_log_ring_init(&worker->log) < 0) {
+                fprintf(stderr, "access log error %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            if (settings->capture_path) {
+                obelisk_capture_ring_init(&worker->capture);
+            }
+            worker->base = event_base_new();
+            worker->http = evhttp_new(worker->base);
+
+            if (settings->max_body) {
+                evhttp_set_max_body_size(worker->http, settings->max_body);
+            }
+            evhttp_set_cb(worker->http, "/api", obelisk_api_cb, worker);
+            evhttp_set_cb(worker->http, "/ws", obelisk_ws_cb, worker);
+            evhttp_set_cb(worker->http, "/stats", obelisk_stats_http_cb, worker);
+            evhttp_set_cb(worker->http, "/trace", obelisk_trace_http_cb, worker);
+            evhttp_accept_socket(worker->http,
+                                 obelisk_worker_socket(&fd, settings->bindaddr,
+                                                       settings->port, reuseport));
+
+            if (settings->stream_port &&
+                obelisk_stream_listen(worker,
+                                      obelisk_worker_socket(&stream_fd, settings->bindaddr,
+                                                            settings->stream_port, reuseport)) < 0) {
+                fprintf(stderr, "listen error %s:%i %s\n",
+                        settings->bindaddr ? settings->bindaddr : "0.0.0.0",
+                        settings->stream_port, strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+
+            if (settings->stream_path) {
+                if (unix_fd < 0) {
+                    unix_fd = obelisk_stream_unix_socket(settings->stream_path);
+                    if (unix_fd < 0) {
+                        fprintf(stderr, "bind error %s %s\n",
+                                settings->stream_path, strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                if (obelisk_stream_listen(worker, i ? dup(unix_fd) : unix_fd) < 0) {
+                    fprintf(stderr, "listen error %s %s\n",
+                            settings->stream_path, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            if (settings->shm_path) {
+                if (shm_fd < 0) {
+                    shm_fd = obelisk_stream_unix_socket(settings->shm_path);
+                    if (shm_fd < 0) {
+                        fprintf(stderr, "bind error %s %s\n",
+                                settings->shm_path, strerror(errno));
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                if (obelisk_shm_listen(worker, i ? dup(shm_fd) : shm_fd) < 0) {
+                    fprintf(stderr, "shm error %s %s\n",
+                            settings->shm_path, strerror(errno));
+                    exit(EXIT_FAILURE);
+                }
+            }
+
+            if (baton->pool && obelisk_pool_attach(worker) < 0) {
+                fprintf(stderr, "pool error %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        if (baton->logging &&
+            obelisk_log_start(baton, settings->log_path, settings->log_size) < 0) {
+            fprintf(stderr, "access log error %s %s\n",
+                    settings->log_path ? settings->log_path : "stderr",
+                    strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        if (settings->capture_path &&
+            obelisk_capture_start(baton, settings->capture_path) < 0) {
+            fprintf(stderr, "capture error %s %s\n",
+                    settings->capture_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        for (i=1; i<nthreads; i++) {
+            pthread_create(&workers[i].thread, NULL, obelisk_worker_run, &workers[i]);
+        }
+
+        /* The calling thread drives the first worker */
+        obelisk_worker_run(&workers[0]);
+
+        for (i=1; i<nthreads; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
     }
 }
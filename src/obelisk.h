@@ -31,11 +31,47 @@
 #include "obelisk_error.h"
 
 #define OBELISK_DEFAULT_PORT 10351
+#define OBELISK_DEFAULT_MAX_BODY (16 * 1024 * 1024)
+#define OBELISK_DEFAULT_BATCH_PARALLEL 32
 
-/* RPC Callbacks */
+struct event_base;
+
+/* Completion token for asynchronous handlers */
+typedef struct obelisk_call_s obelisk_call_t;
+
+typedef struct obelisk_pool_s obelisk_pool_t;
+
+typedef struct obelisk_dispatch_s obelisk_dispatch_t;
+
+typedef struct obelisk_cache_s obelisk_cache_t;
+
+/* WebSocket connection a call arrived on, see obelisk_session_notify() */
+typedef struct obelisk_session_s obelisk_session_t;
+
+/* Run cb on the blocking-handler pool instead of the event loop */
+#define OBELISK_RPC_BLOCKING 0x01
+
+/* Identical concurrent calls (same method and params) share one handler
+ * run, each getting the result under its own id.  Each is admitted on
+ * its own first, so counts against max_inflight while it waits. */
+#define OBELISK_RPC_COALESCE 0x02
+
+/* RPC Callbacks
+ *
+ * Handlers either produce their result inline through cb, or set async_cb
+ * and finish later from the event loop with obelisk_call_complete().  The
+ * params stay valid until the call is completed.  CPU-heavy cb handlers
+ * can be flagged OBELISK_RPC_BLOCKING to run on the worker pool, where
+ * params must be treated as read-only.  Pure methods may set cache_ms to
+ * serve repeated params from the result cache for that long.  max_inflight
+ * caps concurrent handler runs of the method (0 uses the server default). */
 typedef struct {
     const char *method;
     obelisk_error_t* (*cb)(json_t *params, json_t **response);
+    obelisk_error_t* (*async_cb)(json_t *params, obelisk_call_t *call);
+    unsigned int flags;
+    unsigned int cache_ms;
+    unsigned int max_inflight;
 } obelisk_rpc_t;
 
 typedef struct {
@@ -43,12 +79,43 @@ typedef struct {
     unsigned int daemonize;
     const char *bindaddr;
     unsigned short port;
+    unsigned short stream_port;
+    const char *stream_path;
+    const char *shm_path;
+    unsigned int threads;
+    size_t max_body;
+    unsigned int batch_parallel;
+    unsigned int pool_threads;
+    unsigned int pool_queue;
+    unsigned int trace_rate;
+    unsigned int trace_events;
+    size_t cache_size;
+    size_t compress_min;
+    unsigned int max_inflight;
+    unsigned int method_inflight;
+    unsigned int deadline_ms;
+    const char *log_path;
+    size_t log_size;
+    unsigned int log_sample;
+    const char *capture_path;
+    unsigned int capture_sample;
 } obelisk_settings_t;
 
 typedef struct {
     obelisk_settings_t *settings;
-    obelisk_rpc_t *rpc;
-    size_t rpc_size;
+    obelisk_dispatch_t *dispatch;
+    obelisk_pool_t *pool;
+    obelisk_cache_t *cache;
+
+    /* requests admitted across all workers, updated atomically */
+    volatile unsigned int inflight;
+
+    /* access log records are written to the worker rings */
+    int logging;
+
+    /* set by obelisk_run(), for reading counters across workers */
+    struct obelisk_worker_s *workers;
+    unsigned int nworkers;
 } obelisk_baton_t;
 
 void
@@ -57,4 +124,70 @@ obelisk_init(obelisk_settings_t *settings);
 void 
 obelisk_run(obelisk_baton_t *baton);
 
+/** 
+ * @brief Register a method, only valid before obelisk_run()
+ * @param baton baton the method is served from
+ * @param rpc method to add, it is copied
+ * @return 0 on success, -1 for a duplicate or invalid method, including
+ * OBELISK_RPC_BLOCKING without a cb handler
+ */
+int
+obelisk_register_method(obelisk_baton_t *baton, const obelisk_rpc_t *rpc);
+
+/** 
+ * @brief Finish an asynchronous call, must run on the call's event loop
+ * @param call token passed to async_cb
+ * @param err error to reply with, or OBELISK_SUCCESS
+ * @param result result object, the reference is stolen
+ */
+void
+obelisk_call_complete(obelisk_call_t *call, obelisk_error_t *err, json_t *result);
+
+/**
+ * @brief Finish an asynchronous call with a result streamed as an array
+ * @param next called whenever the client can take more: emits at least
+ * one element with obelisk_call_emit() and returns 1 while more remain,
+ * 0 when done, -1 on failure
+ * @param release frees arg once the stream ends or the client is gone,
+ * may be NULL
+ *
+ * Single HTTP calls are sent chunk by chunk as elements are produced.
+ * Elsewhere (batches, MessagePack, other transports, cached or coalesced
+ * methods) the elements are collected into an ordinary result.  Failing
+ * once elements were sent cuts the response short.
+ */
+void
+obelisk_call_stream(obelisk_call_t *call, int (*next)(obelisk_call_t *call, void *arg),
+                    void (*release)(void *arg), void *arg);
+
+/* Append one element to a streamed result, the reference is stolen */
+int
+obelisk_call_emit(obelisk_call_t *call, json_t *element);
+
+json_t*
+obelisk_call_id(obelisk_call_t *call);
+
+/* event loop owning the call, for scheduling timers and I/O */
+struct event_base*
+obelisk_call_base(obelisk_call_t *call);
+
+/* WebSocket session of the call, NULL on other transports */
+obelisk_session_t*
+obelisk_call_session(obelisk_call_t *call);
+
+/* Keep the session around after the call completed, until released */
+void
+obelisk_session_retain(obelisk_session_t *s);
+
+void
+obelisk_session_release(obelisk_session_t *s);
+
+/**
+ * @brief Push a JSON-RPC notification, from the session's event loop
+ * @param params notification params, the reference is stolen, may be NULL
+ * @return 0 when queued, -1 once the session is closed or too far behind
+ */
+int
+obelisk_session_notify(obelisk_session_t *s, const char *method, json_t *params);
+
 #endif
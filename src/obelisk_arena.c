@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <jansson.h> /* json */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obelisk_arena.h"
+
+/* Every allocation is preceded by a header telling obelisk_free() where
+ * it came from; the padding keeps the payload suitably aligned */
+typedef union {
+    void *arena;
+    long double align;
+} obelisk_alloc_hdr_t;
+
+#define OBELISK_ALIGN(n) (((n) + sizeof(obelisk_alloc_hdr_t) - 1) & \
+                          ~(sizeof(obelisk_alloc_hdr_t) - 1))
+#define OBELISK_CHUNK_HDR OBELISK_ALIGN(sizeof(obelisk_arena_chunk_t))
+
+static __thread obelisk_arena_t *current;
+static __thread obelisk_arena_t *freelist;
+static __thread unsigned int nfree;
+
+static obelisk_arena_chunk_t*
+obelisk_arena_chunk_new(size_t size)
+{
+    obelisk_arena_chunk_t *chunk = malloc(OBELISK_CHUNK_HDR + size);
+
+    if (chunk == NULL) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+/* NULL when out of memory, which jansson and the decoders turn into a
+ * failed parse */
+static void*
+obelisk_arena_alloc(obelisk_arena_t *arena, size_t size)
+{
+    obelisk_arena_chunk_t *chunk = arena->chunk;
+    void *ptr;
+
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+    size = OBELISK_ALIGN(size);
+
+    /* the head chunk is missing after an earlier allocation failure */
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        if (size > OBELISK_ARENA_CHUNK / 4 && chunk) {
+            /* Oversized blocks get a chunk of their own behind the head,
+             * so the head keeps serving small allocations */
+            obelisk_arena_chunk_t *big = obelisk_arena_chunk_new(size);
+            if (big == NULL) {
+                return NULL;
+            }
+            big->used = size;
+            big->next = chunk->next;
+            chunk->next = big;
+            return (char*) big + OBELISK_CHUNK_HDR;
+        }
+
+        chunk = obelisk_arena_chunk_new(size > OBELISK_ARENA_CHUNK ? size : OBELISK_ARENA_CHUNK);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = arena->chunk;
+        arena->chunk = chunk;
+    }
+
+    ptr = (char*) chunk + OBELISK_CHUNK_HDR + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+void
+obelisk_arena_install(void)
+{
+    json_set_alloc_funcs(obelisk_malloc, obelisk_free);
+}
+
+obelisk_arena_t*
+obelisk_arena_get(void)
+{
+    obelisk_arena_t *arena = freelist;
+
+    if (arena) {
+        freelist = arena->next;
+        nfree--;
+        return arena;
+    }
+
+    arena = malloc(sizeof(obelisk_arena_t));
+    if (arena == NULL) {
+        return NULL;
+    }
+    arena->next = NULL;
+    arena->chunk = obelisk_arena_chunk_new(OBELISK_ARENA_CHUNK);
+    return arena;
+}
+
+void
+obelisk_arena_put(obelisk_arena_t *arena)
+{
+    obelisk_arena_chunk_t *chunk = arena->chunk;
+    obelisk_arena_chunk_t *next;
+    obelisk_arena_chunk_t *keep = NULL;
+
+    if (current == arena) {
+        current = NULL;
+    }
+
+    /* Keep a single standard chunk for the next request */
+    while (chunk) {
+        next = chunk->next;
+        if (keep == NULL && chunk->size == OBELISK_ARENA_CHUNK) {
+            keep = chunk;
+        }
+        else {
+            free(chunk);
+        }
+        chunk = next;
+    }
+
+    if (keep == NULL) {
+        keep = obelisk_arena_chunk_new(OBELISK_ARENA_CHUNK);
+    }
+    if (keep) {
+        keep->next = NULL;
+        keep->used = 0;
+    }
+    arena->chunk = keep;
+
+    if (nfree >= OBELISK_ARENA_KEEP) {
+        free(keep);
+        free(arena);
+        return;
+    }
+
+    arena->next = freelist;
+    freelist = arena;
+    nfree++;
+}
+
+obelisk_arena_t*
+obelisk_arena_enter(obelisk_arena_t *arena)
+{
+    obelisk_arena_t *prev = current;
+    current = arena;
+    return prev;
+}
+
+void
+obelisk_arena_leave(obelisk_arena_t *prev)
+{
+    current = prev;
+}
+
+void*
+obelisk_malloc(size_t size)
+{
+    obelisk_alloc_hdr_t *hdr;
+
+    if (size > SIZE_MAX / 2) {
+        return NULL;
+    }
+
+    if (current) {
+        hdr = obelisk_arena_alloc(current, sizeof(obelisk_alloc_hdr_t) + size);
+        if (hdr == NULL) {
+            return NULL;
+        }
+        hdr->arena = current;
+    }
+    else {
+        hdr = malloc(sizeof(obelisk_alloc_hdr_t) + size);
+        if (hdr == NULL) {
+            return NULL;
+        }
+        hdr->arena = NULL;
+    }
+
+    return hdr + 1;
+}
+
+void
+obelisk_free(void *ptr)
+{
+    obelisk_alloc_hdr_t *hdr;
+
+    if (ptr == NULL) {
+        return;
+    }
+
+    hdr = (obelisk_alloc_hdr_t*) ptr - 1;
+    if (hdr->arena == NULL) {
+        free(hdr);
+    }
+}
+
+char*
+obelisk_strdup(const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *dup = obelisk_malloc(len);
+
+    if (dup) {
+        memcpy(dup, str, len);
+    }
+    return dup;
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_ARENA_H_
+#define OBELISK_ARENA_H_
+
+#include <stddef.h>
+
+#define OBELISK_ARENA_CHUNK (16 * 1024)
+#define OBELISK_ARENA_KEEP 64
+
+typedef struct obelisk_arena_chunk_s obelisk_arena_chunk_t;
+
+struct obelisk_arena_chunk_s {
+    obelisk_arena_chunk_t *next;
+    size_t size;
+    size_t used;
+};
+
+/* Request-scoped bump allocator.  Memory is only returned in one go by
+ * obelisk_arena_put(), which recycles the arena on the calling thread. */
+typedef struct obelisk_arena_s {
+    struct obelisk_arena_s *next;
+    obelisk_arena_chunk_t *chunk;
+} obelisk_arena_t;
+
+/* Route jansson allocations through obelisk_malloc()/obelisk_free() */
+void
+obelisk_arena_install(void);
+
+obelisk_arena_t*
+obelisk_arena_get(void);
+
+void
+obelisk_arena_put(obelisk_arena_t *arena);
+
+/**
+ * @brief Make arena the target of this thread's allocations
+ * @return the previously active arena, for obelisk_arena_leave()
+ */
+obelisk_arena_t*
+obelisk_arena_enter(obelisk_arena_t *arena);
+
+void
+obelisk_arena_leave(obelisk_arena_t *prev);
+
+/* Allocate from the active arena, or the heap when there is none.  The
+ * matching obelisk_free() is a no-op for arena memory. */
+void*
+obelisk_malloc(size_t size);
+
+void
+obelisk_free(void *ptr);
+
+char*
+obelisk_strdup(const char *str);
+
+#endif
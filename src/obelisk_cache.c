@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obelisk_arena.h"
+#include "obelisk_cache.h"
+#include "obelisk_stats.h"
+
+typedef struct obelisk_cache_entry_s obelisk_cache_entry_t;
+
+/* One allocation holding the entry, its key and the result bytes */
+struct obelisk_cache_entry_s {
+    obelisk_cache_entry_t *chain;
+    obelisk_cache_entry_t *prev;
+    obelisk_cache_entry_t *next;
+    uint64_t hash;
+    uint64_t expires;
+    size_t method;
+    size_t len;
+    size_t raw_len;
+    int referenced;
+    char data[];
+};
+
+/* Each shard is an independent chained hash table plus a CLOCK ring for
+ * eviction, so a hit only flips the referenced bit */
+typedef struct {
+    pthread_mutex_t lock;
+    obelisk_cache_entry_t **buckets;
+    size_t mask;
+    size_t count;
+    size_t bytes;
+    size_t cap;
+    obelisk_cache_entry_t *hand;
+} obelisk_cache_shard_t;
+
+struct obelisk_cache_s {
+    obelisk_cache_shard_t shards[OBELISK_CACHE_SHARDS];
+};
+
+#define obelisk_cache_shard(cache, hash) \
+    (&(cache)->shards[((hash) >> 32) % OBELISK_CACHE_SHARDS])
+
+#define obelisk_cache_entry_size(e) \
+    (sizeof(obelisk_cache_entry_t) + (e)->len + (e)->raw_len)
+
+obelisk_cache_t*
+obelisk_cache_new(size_t size)
+{
+    obelisk_cache_t *cache = calloc(1, sizeof(obelisk_cache_t));
+    size_t i;
+
+    for (i=0; i<OBELISK_CACHE_SHARDS; i++) {
+        obelisk_cache_shard_t *shard = &cache->shards[i];
+
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->mask = 63;
+        shard->buckets = calloc(shard->mask + 1, sizeof(obelisk_cache_entry_t*));
+        shard->cap = size / OBELISK_CACHE_SHARDS;
+    }
+
+    return cache;
+}
+
+uint64_t
+obelisk_cache_hash(size_t method, const char *key, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    hash ^= method;
+    hash *= 1099511628211ULL;
+    for (i=0; i<len; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static obelisk_cache_entry_t**
+obelisk_cache_find(obelisk_cache_shard_t *shard, uint64_t hash, size_t method,
+                   const char *key, size_t len)
+{
+    obelisk_cache_entry_t **e = &shard->buckets[hash & shard->mask];
+
+    for (; *e; e = &(*e)->chain) {
+        if ((*e)->hash == hash && (*e)->method == method && (*e)->len == len &&
+            memcmp((*e)->data, key, len) == 0) {
+            break;
+        }
+    }
+
+    return e;
+}
+
+/* Unlink from both the hash chain at link and the CLOCK ring */
+static void
+obelisk_cache_remove(obelisk_cache_shard_t *shard, obelisk_cache_entry_t **link)
+{
+    obelisk_cache_entry_t *e = *link;
+
+    *link = e->chain;
+    if (e->next == e) {
+        shard->hand = NULL;
+    }
+    else {
+        e->prev->next = e->next;
+        e->next->prev = e->prev;
+        if (shard->hand == e) {
+            shard->hand = e->next;
+        }
+    }
+
+    shard->count--;
+    shard->bytes -= obelisk_cache_entry_size(e);
+    free(e);
+}
+
+static void
+obelisk_cache_grow(obelisk_cache_shard_t *shard)
+{
+    size_t mask = shard->mask * 2 + 1;
+    obelisk_cache_entry_t **buckets = calloc(mask + 1, sizeof(obelisk_cache_entry_t*));
+    size_t i;
+
+    /* out of memory, the chains just get longer */
+    if (buckets == NULL) {
+        return;
+    }
+
+    for (i=0; i<=shard->mask; i++) {
+        obelisk_cache_entry_t *e = shard->buckets[i];
+
+        while (e) {
+            obelisk_cache_entry_t *chain = e->chain;
+            e->chain = buckets[e->hash & mask];
+            buckets[e->hash & mask] = e;
+            e = chain;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->mask = mask;
+}
+
+/* Sweep the CLOCK hand, giving referenced entries a second chance */
+static void
+obelisk_cache_evict(obelisk_cache_shard_t *shard, size_t need)
+{
+    while (shard->hand && shard->bytes + need > shard->cap) {
+        obelisk_cache_entry_t *e = shard->hand;
+
+        if (e->referenced) {
+            e->referenced = 0;
+            shard->hand = e->next;
+            continue;
+        }
+
+        obelisk_cache_remove(shard, obelisk_cache_find(shard, e->hash, e->method,
+                                                       e->data, e->len));
+    }
+}
+
+int
+obelisk_cache_get(obelisk_cache_t *cache, uint64_t hash, size_t method,
+                  const char *key, size_t len, char **raw, size_t *raw_len)
+{
+    obelisk_cache_shard_t *shard = obelisk_cache_shard(cache, hash);
+    obelisk_cache_entry_t **link;
+    int hit = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    link = obelisk_cache_find(shard, hash, method, key, len);
+    if (*link) {
+        obelisk_cache_entry_t *e = *link;
+
+        if (e->expires <= obelisk_clock_ns()) {
+            obelisk_cache_remove(shard, link);
+        }
+        else {
+            e->referenced = 1;
+            *raw_len = e->raw_len;
+            *raw = obelisk_malloc(e->raw_len);
+            /* out of memory is a miss, the handler runs instead */
+            if (*raw) {
+                memcpy(*raw, e->data + e->len, e->raw_len);
+                hit = 1;
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    return hit;
+}
+
+void
+obelisk_cache_put(obelisk_cache_t *cache, uint64_t hash, size_t method,
+                  const char *key, size_t len, const char *raw, size_t raw_len,
+                  unsigned int ttl_ms)
+{
+    obelisk_cache_shard_t *shard = obelisk_cache_shard(cache, hash);
+    obelisk_cache_entry_t *e;
+    obelisk_cache_entry_t **link;
+    size_t size = sizeof(obelisk_cache_entry_t) + len + raw_len;
+
+    if (size > shard->cap) {
+        return;
+    }
+
+    /* build the entry outside the lock */
+    e = malloc(size);
+    if (e == NULL) {
+        /* out of memory, the result is simply not cached */
+        return;
+    }
+    e->hash = hash;
+    e->method = method;
+    e->len = len;
+    e->raw_len = raw_len;
+    e->referenced = 0;
+    e->expires = obelisk_clock_ns() + (uint64_t) ttl_ms * 1000000ULL;
+    memcpy(e->data, key, len);
+    memcpy(e->data + len, raw, raw_len);
+
+    pthread_mutex_lock(&shard->lock);
+
+    link = obelisk_cache_find(shard, hash, method, key, len);
+    if (*link) {
+        obelisk_cache_remove(shard, link);
+    }
+
+    obelisk_cache_evict(shard, size);
+    if (shard->count >= shard->mask + 1) {
+        obelisk_cache_grow(shard);
+    }
+
+    e->chain = shard->buckets[hash & shard->mask];
+    shard->buckets[hash & shard->mask] = e;
+
+    /* new entries go just behind the hand, the last to be swept */
+    if (shard->hand) {
+        e->next = shard->hand;
+        e->prev = shard->hand->prev;
+        e->prev->next = e;
+        shard->hand->prev = e;
+    }
+    else {
+        e->next = e->prev = e;
+        shard->hand = e;
+    }
+
+    shard->count++;
+    shard->bytes += size;
+
+    pthread_mutex_unlock(&shard->lock);
+}
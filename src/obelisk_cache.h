@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_CACHE_H_
+#define OBELISK_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "obelisk.h"
+
+#define OBELISK_DEFAULT_CACHE_SIZE (64 * 1024 * 1024)
+#define OBELISK_CACHE_SHARDS 16
+
+/**
+ * @brief Create a result cache shared by all workers
+ * @param size memory cap in bytes, split evenly across the shards
+ */
+obelisk_cache_t*
+obelisk_cache_new(size_t size);
+
+/* FNV-1a over the method index and the canonical params */
+uint64_t
+obelisk_cache_hash(size_t method, const char *key, size_t len);
+
+/**
+ * @brief Look up a live entry
+ * @param raw set to a copy of the serialized result, from obelisk_malloc()
+ * @return 1 on a hit, 0 on a miss
+ */
+int
+obelisk_cache_get(obelisk_cache_t *cache, uint64_t hash, size_t method,
+                  const char *key, size_t len, char **raw, size_t *raw_len);
+
+/* Store a serialized result for ttl_ms, replacing any older entry */
+void
+obelisk_cache_put(obelisk_cache_t *cache, uint64_t hash, size_t method,
+                  const char *key, size_t len, const char *raw, size_t raw_len,
+                  unsigned int ttl_ms);
+
+#endif
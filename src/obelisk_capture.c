@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "obelisk.h"
+#include "obelisk_capture.h"
+#include "obelisk_worker.h"
+
+#define OBELISK_CAPTURE_IDLE_MS 20
+
+typedef struct {
+    obelisk_baton_t *baton;
+    int fd;
+    off_t size;     /* end of the last whole record written */
+} obelisk_capture_writer_t;
+
+void
+obelisk_capture_ring_init(obelisk_capture_ring_t *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->data = malloc(OBELISK_CAPTURE_RING);
+}
+
+static void
+obelisk_capture_put(obelisk_capture_ring_t *ring, uint64_t pos,
+                    const void *src, size_t len)
+{
+    size_t off = pos & (OBELISK_CAPTURE_RING - 1);
+    size_t first = OBELISK_CAPTURE_RING - off;
+
+    if (first >= len) {
+        memcpy(ring->data + off, src, len);
+    }
+    else {
+        memcpy(ring->data + off, src, first);
+        memcpy(ring->data, (const char*) src + first, len - first);
+    }
+}
+
+void
+obelisk_capture_add(obelisk_capture_ring_t *ring, const struct timeval *tv,
+                    uint32_t flags, struct evbuffer *body)
+{
+    obelisk_capture_header_t hdr;
+    size_t len = evbuffer_get_length(body);
+    uint64_t head = ring->head;
+    size_t done = 0;
+    struct evbuffer_iovec vec[8];
+    struct evbuffer_ptr ptr;
+    int i, n;
+
+    if (len > OBELISK_CAPTURE_RING - sizeof(hdr)) {
+        __atomic_store_n(&ring->oversize, ring->oversize + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) + sizeof(hdr) + len >
+        OBELISK_CAPTURE_RING) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    hdr.time_us = (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+    hdr.length = len;
+    hdr.flags = flags;
+    obelisk_capture_put(ring, head, &hdr, sizeof(hdr));
+    head += sizeof(hdr);
+
+    /* copy straight out of the body's chains, eight at a time */
+    while (done < len) {
+        evbuffer_ptr_set(body, &ptr, done, EVBUFFER_PTR_SET);
+        n = evbuffer_peek(body, -1, &ptr, vec, 8);
+        for (i=0; i<n && i<8; i++) {
+            obelisk_capture_put(ring, head + done, vec[i].iov_base, vec[i].iov_len);
+            done += vec[i].iov_len;
+        }
+    }
+
+    __atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+}
+
+/* Write [tail, head) of the ring, at most two segments */
+static int
+obelisk_capture_drain(obelisk_capture_writer_t *cw, obelisk_capture_ring_t *ring,
+                      uint64_t tail, uint64_t head)
+{
+    size_t off = tail & (OBELISK_CAPTURE_RING - 1);
+    size_t len = head - tail;
+    struct iovec iov[2];
+    int n = 1;
+
+    iov[0].iov_base = ring->data + off;
+    iov[0].iov_len = len;
+    if (off + len > OBELISK_CAPTURE_RING) {
+        iov[0].iov_len = OBELISK_CAPTURE_RING - off;
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = len - iov[0].iov_len;
+        n = 2;
+    }
+
+    while (n > 0) {
+        ssize_t w = writev(cw->fd, iov, n);
+
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            /* cut any partial record off and stop capturing, the file
+             * stays readable up to here */
+            fprintf(stderr, "capture write error %s\n", strerror(errno));
+            if (ftruncate(cw->fd, cw->size) < 0) {
+                fprintf(stderr, "capture truncate error %s\n", strerror(errno));
+            }
+            close(cw->fd);
+            return -1;
+        }
+        while (n > 0 && (size_t) w >= iov[0].iov_len) {
+            w -= iov[0].iov_len;
+            iov[0] = iov[1];
+            n--;
+        }
+        if (n > 0) {
+            iov[0].iov_base = (char*) iov[0].iov_base + w;
+            iov[0].iov_len -= w;
+        }
+    }
+    cw->size += len;
+    return 0;
+}
+
+static void*
+obelisk_capture_run(void *arg)
+{
+    obelisk_capture_writer_t *cw = (obelisk_capture_writer_t*) arg;
+    obelisk_baton_t *baton = cw->baton;
+
+    for (;;) {
+        int idle = 1;
+        unsigned int i;
+
+        for (i=0; i<baton->nworkers; i++) {
+            obelisk_capture_ring_t *ring = &baton->workers[i].capture;
+            uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            uint64_t tail = ring->tail;
+
+            if (head != tail) {
+                if (obelisk_capture_drain(cw, ring, tail, head) < 0) {
+                    /* the rings fill up and count further records as
+                     * dropped in /stats */
+                    free(cw);
+                    return NULL;
+                }
+                __atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+                idle = 0;
+            }
+        }
+
+        if (idle) {
+            struct timespec ts = {0, OBELISK_CAPTURE_IDLE_MS * 1000000L};
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int
+obelisk_capture_start(obelisk_baton_t *baton, const char *path)
+{
+    obelisk_capture_writer_t *cw;
+    pthread_t thread;
+    struct stat st;
+    int fd;
+
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    /* a new file starts with the magic, existing captures are appended to */
+    if (fstat(fd, &st) < 0 ||
+        (st.st_size == 0 &&
+         write(fd, OBELISK_CAPTURE_MAGIC, 8) != 8)) {
+        close(fd);
+        return -1;
+    }
+
+    cw = calloc(1, sizeof(obelisk_capture_writer_t));
+    if (cw == NULL) {
+        close(fd);
+        return -1;
+    }
+    cw->baton = baton;
+    cw->fd = fd;
+    cw->size = st.st_size ? st.st_size : 8;
+
+    if (pthread_create(&thread, NULL, obelisk_capture_run, cw) != 0) {
+        close(fd);
+        free(cw);
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
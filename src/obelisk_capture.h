@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_CAPTURE_H_
+#define OBELISK_CAPTURE_H_
+
+#include <stdint.h>
+#include <event2/buffer.h>
+#include "obelisk.h"
+
+/* Capture file: OBELISK_CAPTURE_MAGIC, then one header per request
+ * followed by its (decoded) body, in host byte order.  Records from
+ * different workers may be slightly out of time order. */
+#define OBELISK_CAPTURE_MAGIC "OBCAP001"
+#define OBELISK_CAPTURE_MSGPACK 0x01
+
+#define OBELISK_CAPTURE_RING (4 * 1024 * 1024)
+
+typedef struct {
+    uint64_t time_us;
+    uint32_t length;
+    uint32_t flags;
+} obelisk_capture_header_t;
+
+/* Single-producer single-consumer byte ring owned by one worker, records
+ * that do not fit are dropped.  oversize counts the ones larger than the
+ * whole ring, which can never be captured. */
+typedef struct {
+    unsigned char *data;
+    volatile uint64_t head;
+    volatile uint64_t tail;
+    uint64_t dropped;
+    uint64_t oversize;
+    uint64_t seq;
+} obelisk_capture_ring_t;
+
+void
+obelisk_capture_ring_init(obelisk_capture_ring_t *ring);
+
+/**
+ * @brief Queue one request body for the capture file
+ * @param flags OBELISK_CAPTURE_* describing the body
+ * @param body left intact
+ */
+void
+obelisk_capture_add(obelisk_capture_ring_t *ring, const struct timeval *tv,
+                    uint32_t flags, struct evbuffer *body);
+
+/* Start the thread appending every worker's ring to path */
+int
+obelisk_capture_start(obelisk_baton_t *baton, const char *path);
+
+#endif
@@ -0,0 +1,434 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <event2/buffer.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "obelisk_config.h"
+#include "obelisk_compress.h"
+
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+
+#define OBELISK_COMPRESS_CHUNK (16 * 1024)
+
+static const char *encoding_names[] = {
+    "identity",
+    "gzip",
+    "deflate",
+    "zstd"
+};
+
+/* preference between equally weighted encodings */
+static const int encoding_rank[] = {0, 2, 1, 3};
+
+const char*
+obelisk_encoding_name(obelisk_encoding_t enc)
+{
+    return enc < OBELISK_ENCODING_UNKNOWN ? encoding_names[enc] : "unknown";
+}
+
+static int
+obelisk_encoding_supported(obelisk_encoding_t enc)
+{
+    switch (enc) {
+        case OBELISK_ENCODING_IDENTITY:
+            return 1;
+#ifdef HAVE_LIBZ
+        case OBELISK_ENCODING_GZIP:
+        case OBELISK_ENCODING_DEFLATE:
+            return 1;
+#endif
+#ifdef HAVE_LIBZSTD
+        case OBELISK_ENCODING_ZSTD:
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+/* Match the token at p, of length len, against the encodings we know */
+static obelisk_encoding_t
+obelisk_encoding_token(const char *p, size_t len)
+{
+    size_t i;
+
+    if (len == 6 && strncasecmp(p, "x-gzip", 6) == 0) {
+        return OBELISK_ENCODING_GZIP;
+    }
+    for (i=0; i<OBELISK_ENCODING_UNKNOWN; i++) {
+        if (strlen(encoding_names[i]) == len && strncasecmp(p, encoding_names[i], len) == 0) {
+            return (obelisk_encoding_t) i;
+        }
+    }
+    return OBELISK_ENCODING_UNKNOWN;
+}
+
+obelisk_encoding_t
+obelisk_encoding_parse(const char *header)
+{
+    size_t len;
+    obelisk_encoding_t enc;
+
+    if (header == NULL) {
+        return OBELISK_ENCODING_IDENTITY;
+    }
+
+    header += strspn(header, " \t");
+    len = strcspn(header, " \t,;");
+    if (len == 0) {
+        return OBELISK_ENCODING_IDENTITY;
+    }
+
+    /* stacked encodings are not supported */
+    if (header[len + strspn(header + len, " \t")] == ',') {
+        return OBELISK_ENCODING_UNKNOWN;
+    }
+
+    enc = obelisk_encoding_token(header, len);
+    return obelisk_encoding_supported(enc) ? enc : OBELISK_ENCODING_UNKNOWN;
+}
+
+obelisk_encoding_t
+obelisk_encoding_negotiate(const char *header)
+{
+    obelisk_encoding_t best = OBELISK_ENCODING_IDENTITY;
+    double best_q = 0;
+    const char *p = header;
+
+    while (p && *p) {
+        size_t len;
+        double q = 1.0;
+        obelisk_encoding_t enc;
+        const char *params;
+
+        p += strspn(p, " \t,");
+        len = strcspn(p, " \t,;");
+        if (len == 0) {
+            break;
+        }
+
+        enc = obelisk_encoding_token(p, len);
+        params = p + len;
+        p = params + strcspn(params, ",");
+
+        /* only the q parameter matters */
+        for (; params < p; params++) {
+            if (*params == ';') {
+                params += strspn(params + 1, " \t") + 1;
+                if ((*params == 'q' || *params == 'Q') && params[1] == '=') {
+                    q = strtod(params + 2, NULL);
+                }
+            }
+        }
+
+        if (enc != OBELISK_ENCODING_UNKNOWN && enc != OBELISK_ENCODING_IDENTITY &&
+            obelisk_encoding_supported(enc) && q > 0 &&
+            (q > best_q || (q == best_q && encoding_rank[enc] > encoding_rank[best]))) {
+            best = enc;
+            best_q = q;
+        }
+    }
+
+    return best;
+}
+
+#ifdef HAVE_LIBZ
+static int
+obelisk_zlib_compress(int window, struct evbuffer *in, struct evbuffer *out)
+{
+    z_stream zs;
+    struct evbuffer_iovec vec;
+    int flush = Z_NO_FLUSH;
+    int rc = -1;
+
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, OBELISK_COMPRESS_LEVEL, Z_DEFLATED, window, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return -1;
+    }
+
+    do {
+        struct evbuffer_iovec chunk;
+        size_t consumed;
+
+        /* feed one input segment at a time, releasing it once consumed */
+        if (evbuffer_peek(in, -1, NULL, &chunk, 1) < 1) {
+            chunk.iov_base = NULL;
+            chunk.iov_len = 0;
+            flush = Z_FINISH;
+        }
+        zs.next_in = (Bytef*) chunk.iov_base;
+        zs.avail_in = chunk.iov_len;
+
+        do {
+            int z;
+
+            if (evbuffer_reserve_space(out, OBELISK_COMPRESS_CHUNK, &vec, 1) < 1) {
+                goto done;
+            }
+            zs.next_out = (Bytef*) vec.iov_base;
+            zs.avail_out = vec.iov_len;
+
+            z = deflate(&zs, flush);
+            if (z == Z_STREAM_ERROR) {
+                goto done;
+            }
+
+            vec.iov_len -= zs.avail_out;
+            evbuffer_commit_space(out, &vec, 1);
+        } while (zs.avail_out == 0);
+
+        consumed = chunk.iov_len - zs.avail_in;
+        evbuffer_drain(in, consumed);
+    } while (flush != Z_FINISH);
+
+    rc = 0;
+
+done:
+    deflateEnd(&zs);
+    return rc;
+}
+
+static int
+obelisk_zlib_decompress(struct evbuffer *in, struct evbuffer *out, size_t max)
+{
+    z_stream zs;
+    struct evbuffer_iovec vec;
+    size_t total = 0;
+    int z = Z_OK;
+    int rc = -1;
+
+    memset(&zs, 0, sizeof(zs));
+    /* +32 detects gzip and zlib headers */
+    if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+        return -1;
+    }
+
+    while (z != Z_STREAM_END) {
+        struct evbuffer_iovec chunk;
+
+        if (evbuffer_peek(in, -1, NULL, &chunk, 1) < 1) {
+            goto done; /* truncated */
+        }
+        zs.next_in = (Bytef*) chunk.iov_base;
+        zs.avail_in = chunk.iov_len;
+
+        do {
+            if (evbuffer_reserve_space(out, OBELISK_COMPRESS_CHUNK, &vec, 1) < 1) {
+                goto done;
+            }
+            zs.next_out = (Bytef*) vec.iov_base;
+            zs.avail_out = vec.iov_len;
+
+            z = inflate(&zs, Z_NO_FLUSH);
+            if (z != Z_OK && z != Z_STREAM_END && z != Z_BUF_ERROR) {
+                vec.iov_len = 0;
+                evbuffer_commit_space(out, &vec, 1);
+                goto done;
+            }
+
+            vec.iov_len -= zs.avail_out;
+            total += vec.iov_len;
+            evbuffer_commit_space(out, &vec, 1);
+            if (max && total > max) {
+                goto done;
+            }
+        } while (zs.avail_out == 0 && z != Z_STREAM_END);
+
+        evbuffer_drain(in, chunk.iov_len - zs.avail_in);
+    }
+
+    rc = 0;
+
+done:
+    inflateEnd(&zs);
+    return rc;
+}
+#endif
+
+#ifdef HAVE_LIBZSTD
+static int
+obelisk_zstd_compress(struct evbuffer *in, struct evbuffer *out)
+{
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+    ZSTD_EndDirective mode = ZSTD_e_continue;
+    int rc = -1;
+
+    if (cctx == NULL) {
+        return -1;
+    }
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, 3);
+
+    do {
+        struct evbuffer_iovec chunk;
+        ZSTD_inBuffer input;
+        size_t left;
+
+        if (evbuffer_peek(in, -1, NULL, &chunk, 1) < 1) {
+            chunk.iov_base = NULL;
+            chunk.iov_len = 0;
+            mode = ZSTD_e_end;
+        }
+        input.src = chunk.iov_base;
+        input.size = chunk.iov_len;
+        input.pos = 0;
+
+        do {
+            struct evbuffer_iovec vec;
+            ZSTD_outBuffer output;
+
+            if (evbuffer_reserve_space(out, OBELISK_COMPRESS_CHUNK, &vec, 1) < 1) {
+                goto done;
+            }
+            output.dst = vec.iov_base;
+            output.size = vec.iov_len;
+            output.pos = 0;
+
+            left = ZSTD_compressStream2(cctx, &output, &input, mode);
+            if (ZSTD_isError(left)) {
+                goto done;
+            }
+
+            vec.iov_len = output.pos;
+            evbuffer_commit_space(out, &vec, 1);
+        } while (mode == ZSTD_e_end ? left != 0 : input.pos < input.size);
+
+        evbuffer_drain(in, input.pos);
+    } while (mode != ZSTD_e_end);
+
+    rc = 0;
+
+done:
+    ZSTD_freeCCtx(cctx);
+    return rc;
+}
+
+static int
+obelisk_zstd_decompress(struct evbuffer *in, struct evbuffer *out, size_t max)
+{
+    ZSTD_DCtx *dctx = ZSTD_createDCtx();
+    size_t total = 0;
+    size_t left = 1;
+    int rc = -1;
+
+    if (dctx == NULL) {
+        return -1;
+    }
+
+    while (left != 0) {
+        struct evbuffer_iovec chunk;
+        ZSTD_inBuffer input;
+
+        if (evbuffer_peek(in, -1, NULL, &chunk, 1) < 1) {
+            goto done; /* truncated */
+        }
+        input.src = chunk.iov_base;
+        input.size = chunk.iov_len;
+        input.pos = 0;
+
+        while (input.pos < input.size && left != 0) {
+            struct evbuffer_iovec vec;
+            ZSTD_outBuffer output;
+
+            if (evbuffer_reserve_space(out, OBELISK_COMPRESS_CHUNK, &vec, 1) < 1) {
+                goto done;
+            }
+            output.dst = vec.iov_base;
+            output.size = vec.iov_len;
+            output.pos = 0;
+
+            left = ZSTD_decompressStream(dctx, &output, &input);
+            vec.iov_len = ZSTD_isError(left) ? 0 : output.pos;
+            evbuffer_commit_space(out, &vec, 1);
+            if (ZSTD_isError(left)) {
+                goto done;
+            }
+
+            total += output.pos;
+            if (max && total > max) {
+                goto done;
+            }
+        }
+
+        evbuffer_drain(in, input.pos);
+    }
+
+    rc = 0;
+
+done:
+    ZSTD_freeDCtx(dctx);
+    return rc;
+}
+#endif
+
+int
+obelisk_compress_evbuffer(obelisk_encoding_t enc, struct evbuffer *in,
+                          struct evbuffer *out)
+{
+    switch (enc) {
+        case OBELISK_ENCODING_IDENTITY:
+            return evbuffer_add_buffer(out, in);
+#ifdef HAVE_LIBZ
+        case OBELISK_ENCODING_GZIP:
+            return obelisk_zlib_compress(15 + 16, in, out);
+        case OBELISK_ENCODING_DEFLATE:
+            return obelisk_zlib_compress(15, in, out);
+#endif
+#ifdef HAVE_LIBZSTD
+        case OBELISK_ENCODING_ZSTD:
+            return obelisk_zstd_compress(in, out);
+#endif
+        default:
+            return -1;
+    }
+}
+
+int
+obelisk_decompress_evbuffer(obelisk_encoding_t enc, struct evbuffer *in,
+                            struct evbuffer *out, size_t max)
+{
+    switch (enc) {
+        case OBELISK_ENCODING_IDENTITY:
+            return evbuffer_add_buffer(out, in);
+#ifdef HAVE_LIBZ
+        case OBELISK_ENCODING_GZIP:
+        case OBELISK_ENCODING_DEFLATE:
+            return obelisk_zlib_decompress(in, out, max);
+#endif
+#ifdef HAVE_LIBZSTD
+        case OBELISK_ENCODING_ZSTD:
+            return obelisk_zstd_decompress(in, out, max);
+#endif
+        default:
+            return -1;
+    }
+}
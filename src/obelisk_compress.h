@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_COMPRESS_H_
+#define OBELISK_COMPRESS_H_
+
+#include <event2/buffer.h>
+
+#define OBELISK_DEFAULT_COMPRESS_MIN 4096
+#define OBELISK_COMPRESS_LEVEL 6
+
+typedef enum {
+    OBELISK_ENCODING_IDENTITY,
+    OBELISK_ENCODING_GZIP,
+    OBELISK_ENCODING_DEFLATE,
+    OBELISK_ENCODING_ZSTD,
+    OBELISK_ENCODING_UNKNOWN
+} obelisk_encoding_t;
+
+/* Content-Encoding token of enc */
+const char*
+obelisk_encoding_name(obelisk_encoding_t enc);
+
+/* Parse a Content-Encoding header, NULL is identity */
+obelisk_encoding_t
+obelisk_encoding_parse(const char *header);
+
+/* Best encoding this build supports out of an Accept-Encoding header */
+obelisk_encoding_t
+obelisk_encoding_negotiate(const char *header);
+
+/**
+ * @brief Compress in into out, draining in as it goes so the whole body
+ * never exists in both forms at once
+ * @return 0 on success
+ */
+int
+obelisk_compress_evbuffer(obelisk_encoding_t enc, struct evbuffer *in,
+                          struct evbuffer *out);
+
+/**
+ * @brief Decompress in into out
+ * @param max limit on the decompressed size, 0 is unlimited
+ * @return 0 on success, -1 on corrupt input or when max is exceeded
+ */
+int
+obelisk_decompress_evbuffer(obelisk_encoding_t enc, struct evbuffer *in,
+                            struct evbuffer *out, size_t max);
+
+#endif
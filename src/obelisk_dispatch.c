@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obelisk.h"
+#include "obelisk_dispatch.h"
+
+/* FNV-1a over all len bytes, so embedded NULs are part of the name */
+static uint64_t
+obelisk_dispatch_hash(const char *method, size_t len)
+{
+    const unsigned char *p = (const unsigned char*) method;
+    const unsigned char *end = p + len;
+    uint64_t hash = 14695981039346656037ULL;
+
+    while (p < end) {
+        hash ^= *p++;
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+int
+obelisk_register_method(obelisk_baton_t *baton, const obelisk_rpc_t *rpc)
+{
+    obelisk_dispatch_t *dispatch = baton->dispatch;
+    size_t i;
+
+    if (dispatch == NULL) {
+        dispatch = baton->dispatch = calloc(1, sizeof(obelisk_dispatch_t));
+    }
+
+    /* The table is immutable once the server runs, and the pool only
+     * runs plain cb handlers */
+    if (dispatch->slots || rpc->method == NULL ||
+        (rpc->cb == NULL && rpc->async_cb == NULL) ||
+        ((rpc->flags & OBELISK_RPC_BLOCKING) && rpc->cb == NULL)) {
+        return -1;
+    }
+
+    for (i=0; i<dispatch->count; i++) {
+        if (strcmp(dispatch->methods[i].method, rpc->method) == 0) {
+            return -1;
+        }
+    }
+
+    if (dispatch->count == dispatch->alloc) {
+        dispatch->alloc = dispatch->alloc ? dispatch->alloc * 2 : 16;
+        dispatch->methods = realloc(dispatch->methods,
+                                    dispatch->alloc * sizeof(obelisk_rpc_t));
+    }
+
+    dispatch->methods[dispatch->count++] = *rpc;
+    return 0;
+}
+
+int
+obelisk_dispatch_build(obelisk_dispatch_t *dispatch)
+{
+    size_t size = 8;
+    size_t i;
+
+    if (dispatch->slots) {
+        return 0;
+    }
+
+    /* keep the load factor at or below one half */
+    while (size < dispatch->count * 2) {
+        size <<= 1;
+    }
+
+    dispatch->slots = calloc(size, sizeof(obelisk_dispatch_slot_t));
+    dispatch->mask = size - 1;
+    dispatch->inflight = calloc(dispatch->count ? dispatch->count : 1, sizeof(unsigned int));
+
+    for (i=0; i<dispatch->count; i++) {
+        size_t len = strlen(dispatch->methods[i].method);
+        uint64_t hash = obelisk_dispatch_hash(dispatch->methods[i].method, len);
+        size_t slot = hash & dispatch->mask;
+
+        while (dispatch->slots[slot].rpc) {
+            slot = (slot + 1) & dispatch->mask;
+        }
+
+        dispatch->slots[slot].hash = hash;
+        dispatch->slots[slot].len = len;
+        dispatch->slots[slot].rpc = &dispatch->methods[i];
+    }
+
+    return 0;
+}
+
+const obelisk_rpc_t*
+obelisk_dispatch_find(const obelisk_dispatch_t *dispatch, const char *method, size_t len)
+{
+    uint64_t hash = obelisk_dispatch_hash(method, len);
+    size_t slot = hash & dispatch->mask;
+    const obelisk_dispatch_slot_t *s;
+
+    for (s = &dispatch->slots[slot]; s->rpc; s = &dispatch->slots[slot]) {
+        if (s->hash == hash && s->len == len &&
+            memcmp(s->rpc->method, method, len) == 0) {
+            return s->rpc;
+        }
+        slot = (slot + 1) & dispatch->mask;
+    }
+
+    return NULL;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_DISPATCH_H_
+#define OBELISK_DISPATCH_H_
+
+#include <stdint.h>
+#include "obelisk.h"
+
+typedef struct {
+    uint64_t hash;
+    size_t len;
+    const obelisk_rpc_t *rpc;
+} obelisk_dispatch_slot_t;
+
+/* Methods are registered at startup, then frozen into an open-addressed
+ * hash table.  Probes compare the 64 bit hash and the length, so a miss
+ * never touches the method strings. */
+struct obelisk_dispatch_s {
+    obelisk_rpc_t *methods;
+    size_t count;
+    size_t alloc;
+    obelisk_dispatch_slot_t *slots;
+    size_t mask;
+
+    /* running handlers per method, shared by all workers */
+    volatile unsigned int *inflight;
+};
+
+/**
+ * @brief Freeze the registered methods into the lookup table
+ * @return 0 on success
+ */
+int
+obelisk_dispatch_build(obelisk_dispatch_t *dispatch);
+
+/**
+ * @brief Find a method by name
+ * @param len length of the name, which may hold NUL bytes
+ * @return the registered method, or NULL
+ */
+const obelisk_rpc_t*
+obelisk_dispatch_find(const obelisk_dispatch_t *dispatch, const char *method, size_t len);
+
+/* position of a registered method, stable once the table is built */
+#define obelisk_dispatch_index(dispatch, rpc) ((size_t) ((rpc) - (dispatch)->methods))
+
+#endif
@@ -28,65 +28,119 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
+#include "obelisk_arena.h"
 #include "obelisk_error.h"
+#include "obelisk_json.h"
+
+#define OBELISK_ERROR_HEAD(code, message) \
+    "{\"jsonrpc\":\"2.0\",\"error\":{\"code\":" #code ",\"message\":\"" message "\",\"data\":"
+
+#define OBELISK_ERROR_TEMPLATE(code, message) \
+    { code, message, OBELISK_ERROR_HEAD(code, message),  \
+      sizeof(OBELISK_ERROR_HEAD(code, message)) - 1 }
+
+typedef struct {
+    int code;
+    const char *message;
+    const char *head;
+    size_t head_len;
+} obelisk_error_template_t;
+
+/* Pre-serialized error responses, indexed by obelisk_error_errno_t.  Only
+ * data and id are spliced in at write time. */
+static const obelisk_error_template_t templates[] = {
+    OBELISK_ERROR_TEMPLATE(-32700, "Parse error."),
+    OBELISK_ERROR_TEMPLATE(-32600, "Invalid request."),
+    OBELISK_ERROR_TEMPLATE(-32601, "Method not found."),
+    OBELISK_ERROR_TEMPLATE(-32602, "Invalid params."),
+    OBELISK_ERROR_TEMPLATE(-32603, "Internal error."),
+    OBELISK_ERROR_TEMPLATE(-32000, "Server error."),
+};
+
+static const obelisk_error_template_t undefined_template =
+    OBELISK_ERROR_TEMPLATE(-32001, "Error object not defined.");
+
+static const char error_id[] = "},\"id\":";
+
+/* Handed out when an error cannot be allocated.  It is shared by every
+ * thread, so nothing about it changes after the id is set and it is never
+ * destroyed; the reply carries a null id. */
+static char nomem_msg[] = "Out Of Memory";
+static obelisk_error_t nomem = {
+    OBELISK_ERROR_INTERNAL, NULL, NULL, __LINE__, __FILE__, nomem_msg
+};
+
+static obelisk_error_t*
+obelisk_error_nomem(void)
+{
+    /* json_null() is a singleton, so racing stores agree */
+    nomem.id = json_null();
+    return &nomem;
+}
+
+static const obelisk_error_template_t*
+obelisk_error_template(obelisk_error_errno_t e)
+{
+    if ((size_t) e < sizeof(templates) / sizeof(templates[0])) {
+        return &templates[e];
+    }
+    return &undefined_template;
+}
 
 static void
 obelisk_create_json_error(obelisk_error_t *err)
 {
+    const obelisk_error_template_t *tmpl = obelisk_error_template(err->err);
+    json_t *error_obj = json_object();
+
+    json_object_set_new(error_obj, "code", json_integer(tmpl->code));
+    json_object_set_new(error_obj, "message", json_string(tmpl->message));
+    json_object_set_new(error_obj, "data", json_string(err->msg));
+
     err->json = json_object();
+    json_object_set(err->json, "id", err->id ? err->id : json_null());
+    json_object_set_new(err->json, "jsonrpc", json_string("2.0"));
+    json_object_set_new(err->json, "error", error_obj);
+}
 
-    {
-        json_t *code_obj;
-        json_t *msg_obj;
-        json_t *rpc_version = json_string("2.0");
-        json_t *error_obj = json_object();
-        json_t *data_obj = json_string(err->msg);
-        json_t *id_obj = err->id ? err->id : json_null();
-
-        switch (err->err) {
-            case OBELISK_ERROR_PARSE:
-                code_obj = json_integer(-32700);
-                msg_obj = json_string("Parse error.");
-                break;
-            case OBELISK_ERROR_INVALID_REQUEST:
-                code_obj = json_integer(-32600);
-                msg_obj = json_string("Invalid request.");
-                break;
-            case OBELISK_ERROR_METHOD_NOT_FOUND:
-                code_obj = json_integer(-32601);
-                msg_obj = json_string("Method not found.");
-                break;
-            case OBELISK_ERROR_INVALID_PARAMS:
-                code_obj = json_integer(-32602);
-                msg_obj = json_string("Invalid params.");
-                break;
-            case OBELISK_ERROR_INTERNAL:
-                code_obj = json_integer(-32603);
-                msg_obj = json_string("Internal error.");
-                break;
-            case OBELISK_ERROR_SERVER:
-                code_obj = json_integer(-32000);
-                msg_obj = json_string("Server error.");
-                break;
-            default:
-                code_obj = json_integer(-32001);
-                msg_obj = json_string("Error object not defined.");
-                break;
+json_t*
+obelisk_error_json(obelisk_error_t *err)
+{
+    if (err == &nomem) {
+        obelisk_error_t tmp = nomem;
+
+        if (__atomic_load_n(&nomem.json, __ATOMIC_ACQUIRE) == NULL) {
+            obelisk_create_json_error(&tmp);
+            if (!__sync_bool_compare_and_swap(&nomem.json, NULL, tmp.json)) {
+                json_decref(tmp.json);
+            }
         }
+        return nomem.json;
+    }
+    if (err->json == NULL) {
+        obelisk_create_json_error(err);
+    }
+    return err->json;
+}
+
+int
+obelisk_error_code(obelisk_error_errno_t e)
+{
+    return obelisk_error_template(e)->code;
+}
 
-        json_object_set(err->json, "id", id_obj);
-        json_object_set(err->json, "jsonrpc", rpc_version);
-        json_object_set(err->json, "error", error_obj);
-        json_object_set(error_obj, "code", code_obj);
-        json_object_set(error_obj, "message", msg_obj);
-        json_object_set(error_obj, "data", data_obj);
-
-        json_decref(code_obj);
-        json_decref(msg_obj);
-        json_decref(error_obj);
-        json_decref(rpc_version);
-        json_decref(id_obj);
+int
+obelisk_error_write(obelisk_error_t *err, obelisk_writer_t *w)
+{
+    const obelisk_error_template_t *tmpl = obelisk_error_template(err->err);
+
+    if (obelisk_writer_add(w, tmpl->head, tmpl->head_len) < 0 ||
+        obelisk_writer_string(w, err->msg ? err->msg : "") < 0 ||
+        obelisk_writer_add(w, error_id, sizeof(error_id) - 1) < 0 ||
+        obelisk_writer_json(w, err->id ? err->id : json_null()) < 0) {
+        return -1;
     }
+    return obelisk_writer_add(w, "}", 1);
 }
 
 obelisk_error_t*
@@ -96,13 +150,17 @@ obelisk_error_create_impl(json_t *id,
                      unsigned int line,
                      const char *file)
 {
-    obelisk_error_t *err = malloc(sizeof(obelisk_error_t));
+    obelisk_error_t *err = obelisk_malloc(sizeof(obelisk_error_t));
+
+    if (err == NULL) {
+        return obelisk_error_nomem();
+    }
     err->err = e;
     err->line = line;
     err->file = file;
     err->id = id;
-    err->msg = strdup(msg);
-    obelisk_create_json_error(err);
+    err->msg = obelisk_strdup(msg);
+    err->json = NULL;
     return err;
 }
 
@@ -116,18 +174,29 @@ obelisk_error_createf_impl(json_t *id,
 {
     va_list args;
     obelisk_error_t *err;
+    int len;
 
-    err = malloc(sizeof(*err));
+    err = obelisk_malloc(sizeof(*err));
+    if (err == NULL) {
+        return obelisk_error_nomem();
+    }
     err->err = e;
     err->line = line;
     err->file = file;
     err->id = id;
 
     va_start(args, fmt);
-    vasprintf(&err->msg, fmt, args);
+    len = vsnprintf(NULL, 0, fmt, args);
     va_end(args);
 
-    obelisk_create_json_error(err);
+    err->msg = obelisk_malloc(len + 1);
+    if (err->msg) {
+        va_start(args, fmt);
+        vsnprintf(err->msg, len + 1, fmt, args);
+        va_end(args);
+    }
+
+    err->json = NULL;
 
     return err;
 }
@@ -135,12 +204,15 @@ obelisk_error_createf_impl(json_t *id,
 void
 obelisk_error_destroy(obelisk_error_t *err)
 {
+    if (err == &nomem) {
+        return;
+    }
     if (err && err->json) {
         json_decref(err->json);
     }
     if (err && err->msg) {
-        free(err->msg);
+        obelisk_free(err->msg);
     }
-    free(err);
+    obelisk_free(err);
 }
 
@@ -26,6 +26,8 @@
 #ifndef OBELISK_ERROR_H_
 #define OBELISK_ERROR_H_
 
+#include "obelisk_json.h"
+
 struct json_t;
 
 typedef enum {
@@ -37,6 +39,8 @@ typedef enum {
     OBELISK_ERROR_SERVER,
 } obelisk_error_errno_t;
 
+/* The JSON form of an error is only built when obelisk_error_json() asks
+ * for it; replies are written from pre-serialized templates */
 typedef struct {
     obelisk_error_errno_t err;
     json_t *json; 
@@ -77,4 +81,18 @@ obelisk_error_createf_impl(json_t *id,
 void
 obelisk_error_destroy(obelisk_error_t *err);
 
+json_t*
+obelisk_error_json(obelisk_error_t *err);
+
+/* The JSON-RPC error code sent for e */
+int
+obelisk_error_code(obelisk_error_errno_t e);
+
+/**
+ * @brief Write the error response, splicing msg and id into its template
+ * @return 0 on success
+ */
+int
+obelisk_error_write(obelisk_error_t *err, obelisk_writer_t *w);
+
 #endif
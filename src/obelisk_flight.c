@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <string.h>
+#include "obelisk_flight.h"
+#include "obelisk_request.h"
+
+static obelisk_call_t**
+obelisk_flight_find(obelisk_flight_t *flight, obelisk_call_t *call)
+{
+    obelisk_call_t **c = &flight->buckets[call->cache_hash % OBELISK_FLIGHT_BUCKETS];
+
+    for (; *c; c = &(*c)->flight_chain) {
+        if ((*c)->cache_hash == call->cache_hash && (*c)->rpc == call->rpc &&
+            (*c)->cache_len == call->cache_len &&
+            memcmp((*c)->cache_key, call->cache_key, call->cache_len) == 0) {
+            break;
+        }
+    }
+
+    return c;
+}
+
+int
+obelisk_flight_join(obelisk_flight_t *flight, obelisk_call_t *call)
+{
+    obelisk_call_t **c = obelisk_flight_find(flight, call);
+
+    if (*c) {
+        uint64_t deadline = (*c)->deadline;
+
+        /* a queued leader must not expire while a waiter still has time,
+         * 0 being no deadline at all */
+        if (deadline && (call->deadline == 0 || call->deadline > deadline)) {
+            __atomic_store_n(&(*c)->deadline, call->deadline, __ATOMIC_RELAXED);
+        }
+        call->flight_next = (*c)->flight_next;
+        (*c)->flight_next = call;
+        return 1;
+    }
+
+    call->flight_chain = NULL;
+    call->flight_next = NULL;
+    call->flight_leader = 1;
+    *c = call;
+    return 0;
+}
+
+obelisk_call_t*
+obelisk_flight_leave(obelisk_flight_t *flight, obelisk_call_t *leader)
+{
+    obelisk_call_t **c = &flight->buckets[leader->cache_hash % OBELISK_FLIGHT_BUCKETS];
+    obelisk_call_t *waiters = leader->flight_next;
+
+    while (*c != leader) {
+        c = &(*c)->flight_chain;
+    }
+    *c = leader->flight_chain;
+
+    leader->flight_leader = 0;
+    leader->flight_next = NULL;
+    return waiters;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_FLIGHT_H_
+#define OBELISK_FLIGHT_H_
+
+#include <stddef.h>
+#include "obelisk.h"
+
+#define OBELISK_FLIGHT_BUCKETS 256
+
+/* Per-worker table of the coalescable calls currently running, keyed
+ * like the result cache.  Only touched from the worker's own loop. */
+typedef struct {
+    obelisk_call_t *buckets[OBELISK_FLIGHT_BUCKETS];
+} obelisk_flight_t;
+
+/**
+ * @brief Attach call to an identical call already in flight
+ * @return 1 if call now waits on a leader, 0 if it became the leader
+ */
+int
+obelisk_flight_join(obelisk_flight_t *flight, obelisk_call_t *call);
+
+/**
+ * @brief Take a finished leader out of the table
+ * @return its waiters, linked through flight_next
+ */
+obelisk_call_t*
+obelisk_flight_leave(obelisk_flight_t *flight, obelisk_call_t *leader);
+
+#endif
@@ -23,8 +23,91 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#include <event2/buffer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "obelisk.h"
 
+#if !defined(JANSSON_VERSION_HEX) || JANSSON_VERSION_HEX < 0x020700
+#error "obelisk requires jansson 2.7 or later"
+#endif
+
+#define OBELISK_JSON_IOVECS 16
+#define OBELISK_WRITER_RESERVE 4096
+
+/* Pre-serialized response envelope */
+static const char result_head[] = "{\"jsonrpc\":\"2.0\",\"result\":";
+static const char result_id[] = ",\"id\":";
+
+typedef struct {
+    struct evbuffer_iovec *vec;
+    int n;
+    int i;
+    size_t off;
+} obelisk_json_reader_t;
+
+/* Feed jansson one evbuffer segment at a time */
+static size_t
+obelisk_json_read_cb(void *buffer, size_t buflen, void *data)
+{
+    obelisk_json_reader_t *reader = (obelisk_json_reader_t*) data;
+    char *out = (char*) buffer;
+    size_t copied = 0;
+
+    while (copied < buflen && reader->i < reader->n) {
+        struct evbuffer_iovec *v = &reader->vec[reader->i];
+        size_t len = v->iov_len - reader->off;
+
+        if (len > buflen - copied) {
+            len = buflen - copied;
+        }
+
+        memcpy(out + copied, (char*) v->iov_base + reader->off, len);
+        copied += len;
+        reader->off += len;
+
+        if (reader->off == v->iov_len) {
+            reader->i++;
+            reader->off = 0;
+        }
+    }
+
+    return copied;
+}
+
+json_t*
+obelisk_json_load_evbuffer(struct evbuffer *buf, json_error_t *error)
+{
+    struct evbuffer_iovec stack_vec[OBELISK_JSON_IOVECS];
+    obelisk_json_reader_t reader;
+    json_t *json;
+
+    reader.vec = stack_vec;
+    reader.n = evbuffer_peek(buf, -1, NULL, NULL, 0);
+    reader.i = 0;
+    reader.off = 0;
+
+    if (reader.n > OBELISK_JSON_IOVECS) {
+        reader.vec = malloc(reader.n * sizeof(struct evbuffer_iovec));
+        if (reader.vec == NULL) {
+            if (error) {
+                memset(error, 0, sizeof(*error));
+                snprintf(error->text, sizeof(error->text), "out of memory");
+            }
+            return NULL;
+        }
+    }
+    evbuffer_peek(buf, -1, NULL, reader.vec, reader.n);
+
+    json = json_load_callback(obelisk_json_read_cb, &reader, 0, error);
+
+    if (reader.vec != stack_vec) {
+        free(reader.vec);
+    }
+    return json;
+}
+
 json_t*
 obelisk_json_response(json_t *result, json_t *id)
 {
@@ -42,3 +125,202 @@ obelisk_json_response(json_t *result, json_t *id)
     return response;
 }
 
+
+void
+obelisk_writer_init(obelisk_writer_t *w, struct evbuffer *buf)
+{
+    w->buf = buf;
+    w->vec.iov_base = NULL;
+    w->vec.iov_len = 0;
+    w->used = 0;
+}
+
+void
+obelisk_writer_finish(obelisk_writer_t *w)
+{
+    if (w->vec.iov_base) {
+        w->vec.iov_len = w->used;
+        evbuffer_commit_space(w->buf, &w->vec, 1);
+        w->vec.iov_base = NULL;
+        w->vec.iov_len = 0;
+        w->used = 0;
+    }
+}
+
+int
+obelisk_writer_add(obelisk_writer_t *w, const void *data, size_t len)
+{
+    if (w->used + len > w->vec.iov_len) {
+        size_t want = len > OBELISK_WRITER_RESERVE ? len : OBELISK_WRITER_RESERVE;
+
+        obelisk_writer_finish(w);
+        if (evbuffer_reserve_space(w->buf, want, &w->vec, 1) < 1) {
+            w->vec.iov_base = NULL;
+            w->vec.iov_len = 0;
+            return -1;
+        }
+    }
+
+    memcpy((char*) w->vec.iov_base + w->used, data, len);
+    w->used += len;
+    return 0;
+}
+
+size_t
+obelisk_utf8_len(const unsigned char *p, size_t avail)
+{
+    size_t len;
+    size_t i;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+
+    if (*p >= 0xC2 && *p <= 0xDF) {
+        len = 2;
+    }
+    else if (*p >= 0xE0 && *p <= 0xEF) {
+        len = 3;
+        if (*p == 0xE0) lo = 0xA0;
+        if (*p == 0xED) hi = 0x9F;
+    }
+    else if (*p >= 0xF0 && *p <= 0xF4) {
+        len = 4;
+        if (*p == 0xF0) lo = 0x90;
+        if (*p == 0xF4) hi = 0x8F;
+    }
+    else {
+        return 0;
+    }
+
+    if (len > avail) {
+        return 0;
+    }
+    for (i=1; i<len; i++) {
+        if (p[i] < lo || p[i] > hi) {
+            return 0;
+        }
+        lo = 0x80;
+        hi = 0xBF;
+    }
+
+    return len;
+}
+
+int
+obelisk_writer_string(obelisk_writer_t *w, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char*) str;
+    const unsigned char *run = p;
+
+    if (obelisk_writer_add(w, "\"", 1) < 0) {
+        return -1;
+    }
+
+    while (*p) {
+        char esc[6];
+        size_t esc_len = 2;
+        size_t len;
+
+        if (*p >= 0x20 && *p < 0x80 && *p != '"' && *p != '\\') {
+            p++;
+            continue;
+        }
+
+        /* the terminating NUL fails a truncated sequence */
+        if (*p >= 0x80 && (len = obelisk_utf8_len(p, 4)) > 0) {
+            p += len;
+            continue;
+        }
+
+        esc[0] = '\\';
+        switch (*p) {
+            case '"': esc[1] = '"'; break;
+            case '\\': esc[1] = '\\'; break;
+            case '\b': esc[1] = 'b'; break;
+            case '\f': esc[1] = 'f'; break;
+            case '\n': esc[1] = 'n'; break;
+            case '\r': esc[1] = 'r'; break;
+            case '\t': esc[1] = 't'; break;
+            default:
+                esc_len = 6;
+                if (*p >= 0x80) {
+                    memcpy(esc, "\\ufffd", 6);
+                }
+                else {
+                    memcpy(esc, "\\u00", 4);
+                    esc[4] = hex[*p >> 4];
+                    esc[5] = hex[*p & 0xF];
+                }
+                break;
+        }
+
+        if (obelisk_writer_add(w, run, p - run) < 0 ||
+            obelisk_writer_add(w, esc, esc_len) < 0) {
+            return -1;
+        }
+        run = ++p;
+    }
+
+    if (obelisk_writer_add(w, run, p - run) < 0) {
+        return -1;
+    }
+    return obelisk_writer_add(w, "\"", 1);
+}
+
+static int
+obelisk_json_write_cb(const char *buffer, size_t size, void *data)
+{
+    return obelisk_writer_add((obelisk_writer_t*) data, buffer, size);
+}
+
+int
+obelisk_writer_json(obelisk_writer_t *w, json_t *json)
+{
+    return json_dump_callback(json, obelisk_json_write_cb, w,
+                              JSON_COMPACT | JSON_ENCODE_ANY);
+}
+
+int
+obelisk_json_write_response(obelisk_writer_t *w, json_t *result, json_t *id)
+{
+    if (obelisk_writer_add(w, result_head, sizeof(result_head) - 1) < 0 ||
+        obelisk_writer_json(w, result ? result : json_null()) < 0 ||
+        obelisk_writer_add(w, result_id, sizeof(result_id) - 1) < 0 ||
+        obelisk_writer_json(w, id ? id : json_null()) < 0) {
+        return -1;
+    }
+    return obelisk_writer_add(w, "}", 1);
+}
+
+int
+obelisk_json_write_stream_head(obelisk_writer_t *w)
+{
+    if (obelisk_writer_add(w, result_head, sizeof(result_head) - 1) < 0) {
+        return -1;
+    }
+    return obelisk_writer_add(w, "[", 1);
+}
+
+int
+obelisk_json_write_stream_tail(obelisk_writer_t *w, json_t *id)
+{
+    if (obelisk_writer_add(w, "]", 1) < 0 ||
+        obelisk_writer_add(w, result_id, sizeof(result_id) - 1) < 0 ||
+        obelisk_writer_json(w, id ? id : json_null()) < 0) {
+        return -1;
+    }
+    return obelisk_writer_add(w, "}", 1);
+}
+
+int
+obelisk_json_write_raw_response(obelisk_writer_t *w, const char *raw, size_t len,
+                                json_t *id)
+{
+    if (obelisk_writer_add(w, result_head, sizeof(result_head) - 1) < 0 ||
+        obelisk_writer_add(w, raw, len) < 0 ||
+        obelisk_writer_add(w, result_id, sizeof(result_id) - 1) < 0 ||
+        obelisk_writer_json(w, id ? id : json_null()) < 0) {
+        return -1;
+    }
+    return obelisk_writer_add(w, "}", 1);
+}
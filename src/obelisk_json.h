@@ -26,9 +26,71 @@
 #ifndef OBELISK_JSON_H_
 #define OBELISK_JSON_H_
 
+#include <event2/buffer.h>
+
 struct json_t;
 
+/* Serializes into space reserved at the tail of an evbuffer, committed
+ * by obelisk_writer_finish() */
+typedef struct {
+    struct evbuffer *buf;
+    struct evbuffer_iovec vec;
+    size_t used;
+} obelisk_writer_t;
+
 json_t*
 obelisk_json_response(json_t *result, json_t *id);
 
+/**
+ * @brief Parse JSON straight from the evbuffer chain, without linearizing
+ * @param buf input, left intact
+ * @param error parse error details
+ * @return the parsed value, or NULL on error
+ */
+json_t*
+obelisk_json_load_evbuffer(struct evbuffer *buf, json_error_t *error);
+
+void
+obelisk_writer_init(obelisk_writer_t *w, struct evbuffer *buf);
+
+int
+obelisk_writer_add(obelisk_writer_t *w, const void *data, size_t len);
+
+int
+obelisk_writer_json(obelisk_writer_t *w, json_t *json);
+
+/* Length of the valid UTF-8 sequence at p, 0 if it is malformed or
+ * longer than avail */
+size_t
+obelisk_utf8_len(const unsigned char *p, size_t avail);
+
+/* Write str as an escaped JSON string, invalid UTF-8 becomes U+FFFD */
+int
+obelisk_writer_string(obelisk_writer_t *w, const char *str);
+
+void
+obelisk_writer_finish(obelisk_writer_t *w);
+
+/**
+ * @brief Write a success response without building a response object
+ * @param w destination
+ * @param result handler result
+ * @param id request id
+ * @return 0 on success
+ */
+int
+obelisk_json_write_response(obelisk_writer_t *w, json_t *result, json_t *id);
+
+/* Opening and closing of a result array written element by element */
+int
+obelisk_json_write_stream_head(obelisk_writer_t *w);
+
+int
+obelisk_json_write_stream_tail(obelisk_writer_t *w, json_t *id);
+
+/* Same, with a result that is already serialized */
+int
+obelisk_json_write_raw_response(obelisk_writer_t *w, const char *raw, size_t len,
+                                json_t *id);
+
 #endif
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "obelisk.h"
+#include "obelisk_json.h"
+#include "obelisk_log.h"
+#include "obelisk_worker.h"
+
+#define OBELISK_LOG_BUFFER (256 * 1024)
+#define OBELISK_LOG_IDLE_S 1
+
+typedef struct {
+    obelisk_baton_t *baton;
+    obelisk_log_wakeup_t wakeup;
+    const char *path;
+    size_t max_size;
+    int fd;
+    size_t size;
+    char *buf;
+    size_t used;
+    uint64_t dropped;
+    int failed;
+} obelisk_log_writer_t;
+
+int
+obelisk_log_ring_init(obelisk_log_ring_t *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->records = calloc(OBELISK_LOG_RING, sizeof(obelisk_log_record_t));
+    return ring->records ? 0 : -1;
+}
+
+void
+obelisk_log_wake(obelisk_log_wakeup_t *wakeup)
+{
+    pthread_mutex_lock(&wakeup->lock);
+    wakeup->sleeping = 0;
+    pthread_cond_signal(&wakeup->cond);
+    pthread_mutex_unlock(&wakeup->lock);
+}
+
+/* Has any worker committed a record the writer has not read */
+static int
+obelisk_log_pending(obelisk_baton_t *baton)
+{
+    unsigned int i;
+
+    for (i=0; i<baton->nworkers; i++) {
+        obelisk_log_ring_t *ring = &baton->workers[i].log;
+
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Sleep until a worker commits into an empty ring.  The flag is raised
+ * before the rings are checked again, so a worker that commits after the
+ * check sees it and signals; the timeout only bounds how late a dropped
+ * count is reported. */
+static void
+obelisk_log_idle(obelisk_log_writer_t *lw)
+{
+    obelisk_log_wakeup_t *wakeup = &lw->wakeup;
+    struct timespec ts;
+
+    pthread_mutex_lock(&wakeup->lock);
+    __atomic_store_n(&wakeup->sleeping, 1, __ATOMIC_SEQ_CST);
+    if (!obelisk_log_pending(lw->baton)) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += OBELISK_LOG_IDLE_S;
+        while (wakeup->sleeping &&
+               pthread_cond_timedwait(&wakeup->cond, &wakeup->lock, &ts) == 0);
+    }
+    wakeup->sleeping = 0;
+    pthread_mutex_unlock(&wakeup->lock);
+}
+
+static int
+obelisk_log_open(obelisk_log_writer_t *lw)
+{
+    struct stat st;
+
+    if (lw->path == NULL) {
+        lw->fd = STDERR_FILENO;
+        return 0;
+    }
+
+    lw->fd = open(lw->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (lw->fd < 0) {
+        return -1;
+    }
+    lw->size = fstat(lw->fd, &st) == 0 ? st.st_size : 0;
+    return 0;
+}
+
+/* path -> path.1 -> ... -> path.OBELISK_LOG_KEEP, then reopen */
+static void
+obelisk_log_rotate(obelisk_log_writer_t *lw)
+{
+    char from[1024];
+    char to[1024];
+    int i;
+
+    close(lw->fd);
+    for (i=OBELISK_LOG_KEEP - 1; i>=0; i--) {
+        if (i) {
+            snprintf(from, sizeof(from), "%s.%d", lw->path, i);
+        }
+        else {
+            snprintf(from, sizeof(from), "%s", lw->path);
+        }
+        snprintf(to, sizeof(to), "%s.%d", lw->path, i + 1);
+        rename(from, to);
+    }
+
+    if (obelisk_log_open(lw) < 0) {
+        /* keep going on stderr rather than losing the log */
+        lw->path = NULL;
+        lw->fd = STDERR_FILENO;
+    }
+}
+
+static void
+obelisk_log_flush(obelisk_log_writer_t *lw)
+{
+    size_t off = 0;
+
+    while (off < lw->used) {
+        ssize_t n = write(lw->fd, lw->buf + off, lw->used - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            /* the lines are lost either way, say so once */
+            if (!lw->failed) {
+                fprintf(stderr, "access log write error %s\n", strerror(errno));
+                lw->failed = 1;
+            }
+            break;
+        }
+        off += n;
+    }
+
+    lw->size += off;
+    lw->used = 0;
+
+    if (lw->path && lw->max_size && lw->size >= lw->max_size) {
+        obelisk_log_rotate(lw);
+    }
+}
+
+static void
+obelisk_log_add(obelisk_log_writer_t *lw, const char *data, size_t len)
+{
+    if (lw->used + len > OBELISK_LOG_BUFFER) {
+        obelisk_log_flush(lw);
+    }
+    memcpy(lw->buf + lw->used, data, len);
+    lw->used += len;
+}
+
+/* Append len bytes of str as a JSON string, bytes that are not valid
+ * UTF-8 are written as \u00XX so the line still parses */
+static void
+obelisk_log_string(obelisk_log_writer_t *lw, const char *str, size_t len)
+{
+    const unsigned char *p = (const unsigned char*) str;
+    char esc[8];
+    size_t i = 0;
+
+    obelisk_log_add(lw, "\"", 1);
+    while (i < len) {
+        unsigned char c = p[i];
+        size_t n;
+
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            obelisk_log_add(lw, esc, 2);
+            i++;
+        }
+        else if (c >= 0x80 && (n = obelisk_utf8_len(p + i, len - i)) > 0) {
+            obelisk_log_add(lw, str + i, n);
+            i += n;
+        }
+        else if (c < 0x20 || c >= 0x80) {
+            snprintf(esc, sizeof(esc), "\\u%04x", c);
+            obelisk_log_add(lw, esc, 6);
+            i++;
+        }
+        else {
+            obelisk_log_add(lw, (const char*) &c, 1);
+            i++;
+        }
+    }
+    obelisk_log_add(lw, "\"", 1);
+}
+
+static void
+obelisk_log_format(obelisk_log_writer_t *lw, const obelisk_log_record_t *rec)
+{
+    char line[256];
+    int n;
+
+    n = snprintf(line, sizeof(line), "{\"time\":%llu.%03u,\"peer\":",
+                 (unsigned long long) (rec->time_ms / 1000),
+                 (unsigned int) (rec->time_ms % 1000));
+    obelisk_log_add(lw, line, n);
+    obelisk_log_string(lw, rec->peer, strlen(rec->peer));
+    obelisk_log_add(lw, ",\"method\":", 10);
+    obelisk_log_string(lw, rec->method, strlen(rec->method));
+    obelisk_log_add(lw, ",\"id\":", 6);
+    if (rec->id_string) {
+        obelisk_log_string(lw, rec->id, strlen(rec->id));
+    }
+    else if (rec->id[0]) {
+        obelisk_log_add(lw, rec->id, strlen(rec->id));
+    }
+    else {
+        obelisk_log_add(lw, "null", 4);
+    }
+
+    n = snprintf(line, sizeof(line),
+                 ",\"calls\":%u,\"error\":%d,\"in\":%llu,\"out\":%llu,\"us\":%llu",
+                 rec->calls, rec->error,
+                 (unsigned long long) rec->bytes_in,
+                 (unsigned long long) rec->bytes_out,
+                 (unsigned long long) (rec->latency_ns / 1000));
+    obelisk_log_add(lw, line, n);
+
+    if (rec->req_len || rec->rsp_len) {
+        obelisk_log_add(lw, ",\"request\":", 11);
+        obelisk_log_string(lw, rec->req, rec->req_len);
+        obelisk_log_add(lw, ",\"response\":", 12);
+        obelisk_log_string(lw, rec->rsp, rec->rsp_len);
+    }
+    obelisk_log_add(lw, "}\n", 2);
+}
+
+static void*
+obelisk_log_run(void *arg)
+{
+    obelisk_log_writer_t *lw = (obelisk_log_writer_t*) arg;
+    obelisk_baton_t *baton = lw->baton;
+
+    for (;;) {
+        size_t records = 0;
+        uint64_t dropped = 0;
+        unsigned int i;
+
+        for (i=0; i<baton->nworkers; i++) {
+            obelisk_log_ring_t *ring = &baton->workers[i].log;
+            uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            uint64_t tail = ring->tail;
+
+            for (; tail != head; tail++) {
+                obelisk_log_format(lw, &ring->records[tail & (OBELISK_LOG_RING - 1)]);
+                records++;
+            }
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+            dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        }
+
+        if (dropped != lw->dropped) {
+            char line[64];
+            int n = snprintf(line, sizeof(line), "{\"dropped\":%llu}\n",
+                             (unsigned long long) (dropped - lw->dropped));
+            obelisk_log_add(lw, line, n);
+            lw->dropped = dropped;
+        }
+
+        if (lw->used) {
+            obelisk_log_flush(lw);
+        }
+
+        if (records == 0) {
+            obelisk_log_idle(lw);
+        }
+    }
+
+    return NULL;
+}
+
+int
+obelisk_log_start(obelisk_baton_t *baton, const char *path, size_t max_size)
+{
+    obelisk_log_writer_t *lw = calloc(1, sizeof(obelisk_log_writer_t));
+    pthread_t thread;
+    unsigned int i;
+    int rc;
+
+    if (lw == NULL) {
+        return -1;
+    }
+    lw->baton = baton;
+    lw->path = path;
+    lw->max_size = max_size;
+    lw->buf = malloc(OBELISK_LOG_BUFFER);
+
+    if (lw->buf == NULL || obelisk_log_open(lw) < 0) {
+        free(lw->buf);
+        free(lw);
+        return -1;
+    }
+
+    pthread_mutex_init(&lw->wakeup.lock, NULL);
+    pthread_cond_init(&lw->wakeup.cond, NULL);
+    for (i=0; i<baton->nworkers; i++) {
+        baton->workers[i].log.wakeup = &lw->wakeup;
+    }
+
+    if ((rc = pthread_create(&thread, NULL, obelisk_log_run, lw)) != 0) {
+        for (i=0; i<baton->nworkers; i++) {
+            baton->workers[i].log.wakeup = NULL;
+        }
+        if (lw->path) {
+            close(lw->fd);
+        }
+        pthread_cond_destroy(&lw->wakeup.cond);
+        pthread_mutex_destroy(&lw->wakeup.lock);
+        free(lw->buf);
+        free(lw);
+        errno = rc;
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_LOG_H_
+#define OBELISK_LOG_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include "obelisk.h"
+
+#define OBELISK_LOG_RING 4096
+#define OBELISK_LOG_SAMPLE 256
+#define OBELISK_LOG_KEEP 5
+#define OBELISK_DEFAULT_LOG_SIZE (64 * 1024 * 1024)
+
+/* One access log line, filled in by the event loop and formatted by the
+ * writer thread */
+typedef struct {
+    uint64_t time_ms;
+    uint64_t latency_ns;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    unsigned int calls;
+    int error;
+    char peer[64];
+    char method[48];
+    char id[32];
+    int id_string;
+    unsigned short req_len;
+    unsigned short rsp_len;
+    char req[OBELISK_LOG_SAMPLE];
+    char rsp[OBELISK_LOG_SAMPLE];
+} obelisk_log_record_t;
+
+/* Lets the writer thread sleep until a worker has something for it */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    volatile int sleeping;
+} obelisk_log_wakeup_t;
+
+/* Single-producer single-consumer ring owned by one worker.  The loop
+ * never waits: when the writer falls behind, records are dropped and
+ * counted. */
+typedef struct {
+    obelisk_log_record_t *records;
+    obelisk_log_wakeup_t *wakeup;
+    volatile uint64_t head;
+    volatile uint64_t tail;
+    uint64_t dropped;
+    uint64_t seq;
+} obelisk_log_ring_t;
+
+/**
+ * @brief Allocate the ring's records
+ * @return 0, or -1 when they cannot be allocated
+ */
+int
+obelisk_log_ring_init(obelisk_log_ring_t *ring);
+
+/**
+ * @brief Claim the next free record
+ * @return the record to fill, or NULL when the ring is full
+ */
+static inline obelisk_log_record_t*
+obelisk_log_claim(obelisk_log_ring_t *ring)
+{
+    uint64_t head = ring->head;
+
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= OBELISK_LOG_RING) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return &ring->records[head & (OBELISK_LOG_RING - 1)];
+}
+
+void
+obelisk_log_wake(obelisk_log_wakeup_t *wakeup);
+
+/* Hand the claimed record to the writer, waking it if it sleeps */
+static inline void
+obelisk_log_commit(obelisk_log_ring_t *ring)
+{
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    /* pairs with the writer raising sleeping before it rechecks the rings */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->wakeup->sleeping, __ATOMIC_RELAXED)) {
+        obelisk_log_wake(ring->wakeup);
+    }
+}
+
+/* Should the next request have its bodies captured */
+static inline int
+obelisk_log_sample(obelisk_log_ring_t *ring, unsigned int rate)
+{
+    return rate && (++ring->seq % rate) == 0;
+}
+
+/**
+ * @brief Start the thread draining every worker's ring
+ * @param path log file, NULL writes to stderr
+ * @param max_size rotate once the file reaches this size, 0 never
+ */
+int
+obelisk_log_start(obelisk_baton_t *baton, const char *path, size_t max_size);
+
+#endif
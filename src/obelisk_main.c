@@ -30,6 +30,10 @@
 #include <string.h>
 #include <unistd.h>
 #include "obelisk.h"
+#include "obelisk_cache.h"
+#include "obelisk_compress.h"
+#include "obelisk_log.h"
+#include "obelisk_pool.h"
 #include "obelisk_config.h"
 
 obelisk_error_t* 
@@ -40,8 +44,201 @@ time_cb(json_t *params, json_t **result)
     return OBELISK_SUCCESS;
 }
 
+/* Replies with its params, handy for payload size benchmarks */
+obelisk_error_t*
+echo_cb(json_t *params, json_t **result)
+{
+    *result = json_incref(params);
+    return OBELISK_SUCCESS;
+}
+
+typedef struct {
+    struct event *ev;
+    obelisk_call_t *call;
+    json_int_t ms;
+} delay_t;
+
+static void
+delay_fire(evutil_socket_t fd, short what, void *arg)
+{
+    delay_t *delay = (delay_t*) arg;
+    obelisk_call_complete(delay->call, OBELISK_SUCCESS, json_integer(delay->ms));
+    event_free(delay->ev);
+    free(delay);
+}
+
+/* Replies with its argument after that many milliseconds */
+obelisk_error_t*
+delay_cb(json_t *params, obelisk_call_t *call)
+{
+    json_t *ms = json_array_get(params, 0);
+    struct timeval tv;
+    delay_t *delay;
+
+    if (!json_is_integer(ms) || json_integer_value(ms) < 0) {
+        return obelisk_error_create(obelisk_call_id(call),
+                                    OBELISK_ERROR_INVALID_PARAMS,
+                                    "expected [milliseconds]");
+    }
+
+    delay = malloc(sizeof(delay_t));
+    delay->call = call;
+    delay->ms = json_integer_value(ms);
+    delay->ev = evtimer_new(obelisk_call_base(call), delay_fire, delay);
+
+    tv.tv_sec = delay->ms / 1000;
+    tv.tv_usec = (delay->ms % 1000) * 1000;
+    evtimer_add(delay->ev, &tv);
+
+    return OBELISK_SUCCESS;
+}
+
+typedef struct {
+    struct event *ev;
+    obelisk_session_t *session;
+    json_int_t sent;
+    json_int_t count;
+} ticker_t;
+
+static json_t*
+tick_params(json_int_t n)
+{
+    json_t *params = json_array();
+
+    json_array_append_new(params, json_integer(n));
+    return params;
+}
+
+static void
+ticker_fire(evutil_socket_t fd, short what, void *arg)
+{
+    ticker_t *ticker = (ticker_t*) arg;
+
+    if (obelisk_session_notify(ticker->session, "tick",
+                               tick_params(ticker->sent)) == 0 &&
+        ++ticker->sent < ticker->count) {
+        return;
+    }
+
+    event_free(ticker->ev);
+    obelisk_session_release(ticker->session);
+    free(ticker);
+}
+
+/* WebSocket only: replies true, then pushes count "tick" notifications
+ * every interval milliseconds */
+obelisk_error_t*
+subscribe_cb(json_t *params, obelisk_call_t *call)
+{
+    json_t *interval = json_array_get(params, 0);
+    json_t *count = json_array_get(params, 1);
+    obelisk_session_t *session = obelisk_call_session(call);
+    struct timeval tv;
+    ticker_t *ticker;
+
+    if (session == NULL) {
+        return obelisk_error_create(obelisk_call_id(call), OBELISK_ERROR_SERVER,
+                                    "requires a WebSocket session");
+    }
+    if (!json_is_integer(interval) || json_integer_value(interval) < 1 ||
+        !json_is_integer(count) || json_integer_value(count) < 1) {
+        return obelisk_error_create(obelisk_call_id(call),
+                                    OBELISK_ERROR_INVALID_PARAMS,
+                                    "expected [milliseconds, count]");
+    }
+
+    ticker = malloc(sizeof(ticker_t));
+    ticker->session = session;
+    ticker->sent = 0;
+    ticker->count = json_integer_value(count);
+    ticker->ev = event_new(obelisk_call_base(call), -1, EV_PERSIST, ticker_fire, ticker);
+    obelisk_session_retain(session);
+
+    tv.tv_sec = json_integer_value(interval) / 1000;
+    tv.tv_usec = (json_integer_value(interval) % 1000) * 1000;
+    event_add(ticker->ev, &tv);
+
+    obelisk_call_complete(call, OBELISK_SUCCESS, json_true());
+    return OBELISK_SUCCESS;
+}
+
+typedef struct {
+    json_int_t next;
+    json_int_t end;
+} range_t;
+
+static int
+range_next(obelisk_call_t *call, void *arg)
+{
+    range_t *range = (range_t*) arg;
+    int i;
+
+    for (i=0; i<256 && range->next < range->end; i++, range->next++) {
+        json_t *row = json_object();
+
+        json_object_set_new(row, "n", json_integer(range->next));
+        json_object_set_new(row, "square", json_integer(range->next * range->next));
+
+        if (obelisk_call_emit(call, row) < 0) {
+            return -1;
+        }
+    }
+    return range->next < range->end;
+}
+
+/* Streams [{"n":0,"square":0}, ...] for n up to its argument, an example
+ * of bulk results that never sit in memory as a whole */
+obelisk_error_t*
+range_cb(json_t *params, obelisk_call_t *call)
+{
+    json_t *n = json_array_get(params, 0);
+    range_t *range;
+
+    if (!json_is_integer(n) || json_integer_value(n) < 0 ||
+        json_integer_value(n) > 100000000) {
+        return obelisk_error_create(obelisk_call_id(call),
+                                    OBELISK_ERROR_INVALID_PARAMS,
+                                    "expected [0..100000000]");
+    }
+
+    range = malloc(sizeof(range_t));
+    range->next = 0;
+    range->end = json_integer_value(n);
+    obelisk_call_stream(call, range_next, free, range);
+
+    return OBELISK_SUCCESS;
+}
+
+static json_int_t
+fib(json_int_t n)
+{
+    return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+/* CPU-bound, runs on the blocking-handler pool.  Pure, so its results
+ * are cached and concurrent identical calls are coalesced. */
+obelisk_error_t*
+fib_cb(json_t *params, json_t **result)
+{
+    json_t *n = json_array_get(params, 0);
+
+    if (!json_is_integer(n) || json_integer_value(n) < 0 ||
+        json_integer_value(n) > 40) {
+        return obelisk_error_create(NULL, OBELISK_ERROR_INVALID_PARAMS,
+                                    "expected [0..40]");
+    }
+
+    *result = json_integer(fib(json_integer_value(n)));
+    return OBELISK_SUCCESS;
+}
+
 obelisk_rpc_t rpc_callbacks[] = {
-    {"time", time_cb}
+    {"delay", NULL, delay_cb, 0, 0, 0},
+    {"echo", echo_cb, NULL, 0, 0, 0},
+    {"fib", fib_cb, NULL, OBELISK_RPC_BLOCKING | OBELISK_RPC_COALESCE, 60000, 0},
+    {"range", NULL, range_cb, 0, 0, 0},
+    {"subscribe", NULL, subscribe_cb, 0, 0, 0},
+    {"time", time_cb, NULL, 0, 0, 0}
 };
 
 void
@@ -51,17 +248,43 @@ int
 main(int argc, char **argv)
 {
     int ch;
+    size_t i;
     obelisk_settings_t settings;
     obelisk_baton_t baton;
 
     obelisk_init(&settings);
+    memset(&baton, 0, sizeof(baton));
     baton.settings = &settings;
-    baton.rpc = &rpc_callbacks;
-    baton.rpc_size = sizeof(rpc_callbacks);
+
+    for (i=0; i<sizeof(rpc_callbacks) / sizeof(obelisk_rpc_t); i++) {
+        if (obelisk_register_method(&baton, &rpc_callbacks[i]) < 0) {
+            fprintf(stderr, "unable to register %s\n", rpc_callbacks[i].method);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     while (-1 != (ch = getopt(argc, argv,
                               "p:"
+                              "P:"
+                              "s:"
+                              "S:"
                               "l:"
+                              "t:"
+                              "b:"
+                              "c:"
+                              "w:"
+                              "q:"
+                              "T:"
+                              "C:"
+                              "z:"
+                              "m:"
+                              "M:"
+                              "D:"
+                              "a:"
+                              "A:"
+                              "L:"
+                              "r:"
+                              "R:"
                               "v"
                               "d"
                               "h"
@@ -70,9 +293,66 @@ main(int argc, char **argv)
             case 'p':
                 settings.port = atoi(optarg);
                 break;
+            case 'P':
+                settings.stream_port = atoi(optarg);
+                break;
+            case 's':
+                settings.stream_path = optarg;
+                break;
+            case 'S':
+                settings.shm_path = optarg;
+                break;
             case 'l':
                 settings.bindaddr = optarg;
                 break;
+            case 't':
+                settings.threads = atoi(optarg);
+                break;
+            case 'b':
+                settings.max_body = strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                settings.batch_parallel = atoi(optarg);
+                break;
+            case 'w':
+                settings.pool_threads = atoi(optarg);
+                break;
+            case 'q':
+                settings.pool_queue = atoi(optarg);
+                break;
+            case 'T':
+                settings.trace_rate = atoi(optarg);
+                break;
+            case 'C':
+                settings.cache_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'z':
+                settings.compress_min = strtoul(optarg, NULL, 10);
+                break;
+            case 'm':
+                settings.max_inflight = atoi(optarg);
+                break;
+            case 'M':
+                settings.method_inflight = atoi(optarg);
+                break;
+            case 'D':
+                settings.deadline_ms = atoi(optarg);
+                break;
+            case 'a':
+                settings.log_path = optarg;
+                break;
+            case 'A':
+                settings.log_sample = atoi(optarg);
+                break;
+            case 'L':
+                settings.log_size = strtoul(optarg, NULL, 10);
+                break;
+            case 'r':
+                settings.capture_path = optarg;
+                break;
+            case 'R':
+                settings.capture_sample = atoi(optarg);
+                break;
             case 'v':
                 settings.verbose++;
                 break;
@@ -90,9 +370,9 @@ main(int argc, char **argv)
 
     if (settings.verbose) {
         fprintf(stderr, "%s\n", "obelisk");
-        fprintf(stderr, "Listening on %s:%i\n", 
+        fprintf(stderr, "Listening on %s:%i (%u threads)\n", 
                 settings.bindaddr ? settings.bindaddr : "0.0.0.0", 
-                settings.port);
+                settings.port, settings.threads);
     }
 
     obelisk_run(&baton);
@@ -105,10 +385,36 @@ usage(const char *name)
 {
     fprintf(stderr, "%s : JSON-RPC Server\n", PACKAGE_STRING);
     fprintf(stderr, "-p <num>      port (default:%i)\n", OBELISK_DEFAULT_PORT);
+    fprintf(stderr, "-P <num>      newline-delimited JSON-RPC port (default:off)\n");
+    fprintf(stderr, "-s <path>     newline-delimited JSON-RPC unix socket (default:off)\n");
+    fprintf(stderr, "-S <path>     shared-memory ring handshake socket (default:off)\n");
     fprintf(stderr, "-l <address>  bind address (default:all interfaces)\n");
+    fprintf(stderr, "-t <num>      worker threads, one event loop each (default:1)\n");
+    fprintf(stderr, "-b <bytes>    maximum request body, 0 is unlimited (default:%i)\n",
+            OBELISK_DEFAULT_MAX_BODY);
+    fprintf(stderr, "-c <num>      calls of one batch in flight, 0 is unlimited (default:%i)\n",
+            OBELISK_DEFAULT_BATCH_PARALLEL);
+    fprintf(stderr, "-w <num>      blocking-handler pool threads, 0 runs inline (default:%i)\n",
+            OBELISK_DEFAULT_POOL_THREADS);
+    fprintf(stderr, "-q <num>      blocking-handler queue depth, 0 is unbounded (default:%i)\n",
+            OBELISK_DEFAULT_POOL_QUEUE);
+    fprintf(stderr, "-C <bytes>    result cache size, 0 disables it (default:%i)\n",
+            OBELISK_DEFAULT_CACHE_SIZE);
+    fprintf(stderr, "-z <bytes>    compress responses from this size, 0 never (default:%i)\n",
+            OBELISK_DEFAULT_COMPRESS_MIN);
+    fprintf(stderr, "-m <num>      requests in flight before rejecting, 0 is unlimited (default:0)\n");
+    fprintf(stderr, "-M <num>      default calls in flight per method, 0 is unlimited (default:0)\n");
+    fprintf(stderr, "-D <ms>       default request deadline, X-Deadline-Ms overrides (default:none)\n");
+    fprintf(stderr, "-T <num>      trace one request in <num>, dump at /trace (default:off)\n");
+    fprintf(stderr, "-a <path>     access log file (default:off)\n");
+    fprintf(stderr, "-A <num>      log the bodies of one request in <num> (default:off)\n");
+    fprintf(stderr, "-L <bytes>    rotate the access log at this size, 0 never (default:%i)\n",
+            OBELISK_DEFAULT_LOG_SIZE);
+    fprintf(stderr, "-r <path>     capture /api request bodies for obelisk-replay (default:off)\n");
+    fprintf(stderr, "-R <num>      capture one request in <num> (default:1)\n");
     fprintf(stderr, "-d            run as a daemon (default: foreground)\n");
     fprintf(stderr, "-v            verbose\n");
-    fprintf(stderr, "-vv           more verbosity\n");
+    fprintf(stderr, "-vv           more verbosity, access log with bodies to stderr\n");
     exit(0);
 }
 
@@ -0,0 +1,518 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <event2/buffer.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obelisk.h"
+#include "obelisk_arena.h"
+#include "obelisk_msgpack.h"
+
+#define OBELISK_MSGPACK_IOVECS 16
+#define OBELISK_MSGPACK_DEPTH 512
+
+/* {"jsonrpc":"2.0","result": as a 3 entry fixmap */
+static const unsigned char result_head[] = {
+    0x83,
+    0xa7, 'j', 's', 'o', 'n', 'r', 'p', 'c',
+    0xa3, '2', '.', '0',
+    0xa6, 'r', 'e', 's', 'u', 'l', 't'
+};
+static const unsigned char result_id[] = {0xa2, 'i', 'd'};
+
+/* Lengths and counts are checked against remaining before anything is
+ * sized from them, so a short body can't ask for more than it holds */
+typedef struct {
+    struct evbuffer_iovec *vec;
+    int n;
+    int i;
+    size_t off;
+    size_t remaining;
+    json_error_t *error;
+} obelisk_msgpack_reader_t;
+
+static void
+obelisk_msgpack_error(obelisk_msgpack_reader_t *r, const char *msg)
+{
+    if (r->error && r->error->text[0] == '\0') {
+        snprintf(r->error->text, sizeof(r->error->text), "%s", msg);
+    }
+}
+
+/* Copy the next len bytes, which may span several segments */
+static int
+obelisk_msgpack_read(obelisk_msgpack_reader_t *r, void *dst, size_t len)
+{
+    char *out = (char*) dst;
+
+    if (len > r->remaining) {
+        obelisk_msgpack_error(r, "unexpected end of input");
+        return -1;
+    }
+    r->remaining -= len;
+
+    while (len) {
+        struct evbuffer_iovec *v;
+        size_t n;
+
+        if (r->i >= r->n) {
+            obelisk_msgpack_error(r, "unexpected end of input");
+            return -1;
+        }
+
+        v = &r->vec[r->i];
+        n = v->iov_len - r->off;
+        if (n > len) {
+            n = len;
+        }
+
+        memcpy(out, (char*) v->iov_base + r->off, n);
+        out += n;
+        len -= n;
+        r->off += n;
+
+        if (r->off == v->iov_len) {
+            r->i++;
+            r->off = 0;
+        }
+    }
+
+    return 0;
+}
+
+static int
+obelisk_msgpack_read_uint(obelisk_msgpack_reader_t *r, size_t bytes, uint64_t *value)
+{
+    unsigned char b[8];
+    size_t i;
+
+    if (obelisk_msgpack_read(r, b, bytes) < 0) {
+        return -1;
+    }
+
+    *value = 0;
+    for (i=0; i<bytes; i++) {
+        *value = (*value << 8) | b[i];
+    }
+    return 0;
+}
+
+static json_t*
+obelisk_msgpack_string(obelisk_msgpack_reader_t *r, uint64_t len)
+{
+    char *str;
+    json_t *json = NULL;
+
+    if (len > r->remaining) {
+        obelisk_msgpack_error(r, "unexpected end of input");
+        return NULL;
+    }
+
+    /* jansson wants NUL termination, the copy lives in the request arena */
+    str = obelisk_malloc(len + 1);
+    if (str == NULL) {
+        obelisk_msgpack_error(r, "out of memory");
+        return NULL;
+    }
+    if (obelisk_msgpack_read(r, str, len) == 0) {
+        str[len] = '\0';
+        if (memchr(str, '\0', len)) {
+            obelisk_msgpack_error(r, "string contains NUL");
+        }
+        else if ((json = json_string(str)) == NULL) {
+            obelisk_msgpack_error(r, "string is not valid UTF-8");
+        }
+    }
+    obelisk_free(str);
+
+    return json;
+}
+
+static json_t*
+obelisk_msgpack_value(obelisk_msgpack_reader_t *r, int depth);
+
+static json_t*
+obelisk_msgpack_array(obelisk_msgpack_reader_t *r, uint64_t count, int depth)
+{
+    json_t *array;
+    uint64_t i;
+
+    /* every element takes at least one byte */
+    if (count > r->remaining) {
+        obelisk_msgpack_error(r, "unexpected end of input");
+        return NULL;
+    }
+    if ((array = json_array()) == NULL) {
+        obelisk_msgpack_error(r, "out of memory");
+        return NULL;
+    }
+
+    for (i=0; i<count; i++) {
+        json_t *value = obelisk_msgpack_value(r, depth + 1);
+
+        if (value == NULL || json_array_append_new(array, value) < 0) {
+            if (value) obelisk_msgpack_error(r, "out of memory");
+            json_decref(array);
+            return NULL;
+        }
+    }
+
+    return array;
+}
+
+static json_t*
+obelisk_msgpack_map(obelisk_msgpack_reader_t *r, uint64_t count, int depth)
+{
+    json_t *object;
+    uint64_t i;
+
+    /* and every entry at least two */
+    if (count > r->remaining / 2) {
+        obelisk_msgpack_error(r, "unexpected end of input");
+        return NULL;
+    }
+    if ((object = json_object()) == NULL) {
+        obelisk_msgpack_error(r, "out of memory");
+        return NULL;
+    }
+
+    for (i=0; i<count; i++) {
+        json_t *key = obelisk_msgpack_value(r, depth + 1);
+        json_t *value;
+
+        if (key == NULL || !json_is_string(key)) {
+            if (key) obelisk_msgpack_error(r, "map key is not a string");
+            json_decref(key);
+            json_decref(object);
+            return NULL;
+        }
+
+        value = obelisk_msgpack_value(r, depth + 1);
+        if (value == NULL) {
+            json_decref(key);
+            json_decref(object);
+            return NULL;
+        }
+
+        if (json_object_set_new(object, json_string_value(key), value) < 0) {
+            obelisk_msgpack_error(r, "out of memory");
+            json_decref(key);
+            json_decref(object);
+            return NULL;
+        }
+        json_decref(key);
+    }
+
+    return object;
+}
+
+static json_t*
+obelisk_msgpack_value(obelisk_msgpack_reader_t *r, int depth)
+{
+    unsigned char type;
+    uint64_t u;
+
+    if (depth > OBELISK_MSGPACK_DEPTH) {
+        obelisk_msgpack_error(r, "nesting too deep");
+        return NULL;
+    }
+
+    if (obelisk_msgpack_read(r, &type, 1) < 0) {
+        return NULL;
+    }
+
+    if (type <= 0x7f) {
+        return json_integer(type);
+    }
+    if (type >= 0xe0) {
+        return json_integer((signed char) type);
+    }
+    if ((type & 0xf0) == 0x80) {
+        return obelisk_msgpack_map(r, type & 0x0f, depth);
+    }
+    if ((type & 0xf0) == 0x90) {
+        return obelisk_msgpack_array(r, type & 0x0f, depth);
+    }
+    if ((type & 0xe0) == 0xa0) {
+        return obelisk_msgpack_string(r, type & 0x1f);
+    }
+
+    switch (type) {
+        case 0xc0:
+            return json_null();
+        case 0xc2:
+            return json_false();
+        case 0xc3:
+            return json_true();
+
+        /* bin is accepted as a string when it is valid UTF-8 */
+        case 0xc4: case 0xd9:
+            return obelisk_msgpack_read_uint(r, 1, &u) < 0 ? NULL : obelisk_msgpack_string(r, u);
+        case 0xc5: case 0xda:
+            return obelisk_msgpack_read_uint(r, 2, &u) < 0 ? NULL : obelisk_msgpack_string(r, u);
+        case 0xc6: case 0xdb:
+            return obelisk_msgpack_read_uint(r, 4, &u) < 0 ? NULL : obelisk_msgpack_string(r, u);
+
+        case 0xca: {
+            uint32_t bits;
+            float f;
+
+            if (obelisk_msgpack_read_uint(r, 4, &u) < 0) return NULL;
+            bits = (uint32_t) u;
+            memcpy(&f, &bits, sizeof(f));
+            return json_real(f);
+        }
+        case 0xcb: {
+            double d;
+
+            if (obelisk_msgpack_read_uint(r, 8, &u) < 0) return NULL;
+            memcpy(&d, &u, sizeof(d));
+            return json_real(d);
+        }
+
+        case 0xcc:
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+            if (obelisk_msgpack_read_uint(r, 1 << (type - 0xcc), &u) < 0) return NULL;
+            if (u > INT64_MAX) {
+                obelisk_msgpack_error(r, "integer out of range");
+                return NULL;
+            }
+            return json_integer((json_int_t) u);
+
+        case 0xd0:
+            if (obelisk_msgpack_read_uint(r, 1, &u) < 0) return NULL;
+            return json_integer((int8_t) u);
+        case 0xd1:
+            if (obelisk_msgpack_read_uint(r, 2, &u) < 0) return NULL;
+            return json_integer((int16_t) u);
+        case 0xd2:
+            if (obelisk_msgpack_read_uint(r, 4, &u) < 0) return NULL;
+            return json_integer((int32_t) u);
+        case 0xd3:
+            if (obelisk_msgpack_read_uint(r, 8, &u) < 0) return NULL;
+            return json_integer((json_int_t) (int64_t) u);
+
+        case 0xdc:
+            return obelisk_msgpack_read_uint(r, 2, &u) < 0 ? NULL : obelisk_msgpack_array(r, u, depth);
+        case 0xdd:
+            return obelisk_msgpack_read_uint(r, 4, &u) < 0 ? NULL : obelisk_msgpack_array(r, u, depth);
+        case 0xde:
+            return obelisk_msgpack_read_uint(r, 2, &u) < 0 ? NULL : obelisk_msgpack_map(r, u, depth);
+        case 0xdf:
+            return obelisk_msgpack_read_uint(r, 4, &u) < 0 ? NULL : obelisk_msgpack_map(r, u, depth);
+
+        default:
+            obelisk_msgpack_error(r, "unsupported type");
+            return NULL;
+    }
+}
+
+json_t*
+obelisk_msgpack_load_evbuffer(struct evbuffer *buf, json_error_t *error)
+{
+    struct evbuffer_iovec stack_vec[OBELISK_MSGPACK_IOVECS];
+    obelisk_msgpack_reader_t reader;
+    json_t *json;
+
+    memset(error, 0, sizeof(*error));
+    reader.vec = stack_vec;
+    reader.n = evbuffer_peek(buf, -1, NULL, NULL, 0);
+    reader.i = 0;
+    reader.off = 0;
+    reader.remaining = evbuffer_get_length(buf);
+    reader.error = error;
+
+    if (reader.n > OBELISK_MSGPACK_IOVECS) {
+        reader.vec = malloc(reader.n * sizeof(struct evbuffer_iovec));
+        if (reader.vec == NULL) {
+            obelisk_msgpack_error(&reader, "out of memory");
+            return NULL;
+        }
+    }
+    evbuffer_peek(buf, -1, NULL, reader.vec, reader.n);
+
+    json = obelisk_msgpack_value(&reader, 0);
+    if (json && reader.remaining) {
+        obelisk_msgpack_error(&reader, "trailing data after value");
+        json_decref(json);
+        json = NULL;
+    }
+
+    if (reader.vec != stack_vec) {
+        free(reader.vec);
+    }
+    return json;
+}
+
+/* Write a type byte followed by a big-endian value of bytes length */
+static int
+obelisk_msgpack_write_head(obelisk_writer_t *w, unsigned char type, uint64_t value,
+                           size_t bytes)
+{
+    unsigned char b[9];
+    size_t i;
+
+    b[0] = type;
+    for (i=0; i<bytes; i++) {
+        b[bytes - i] = (unsigned char) (value >> (8 * i));
+    }
+    return obelisk_writer_add(w, b, bytes + 1);
+}
+
+/* Header of a str, array or map of count items */
+static int
+obelisk_msgpack_write_count(obelisk_writer_t *w, unsigned char fix, size_t fix_max,
+                            unsigned char type8, unsigned char type16, size_t count)
+{
+    if (count <= fix_max) {
+        unsigned char b = fix | (unsigned char) count;
+        return obelisk_writer_add(w, &b, 1);
+    }
+    if (type8 && count <= 0xff) {
+        return obelisk_msgpack_write_head(w, type8, count, 1);
+    }
+    if (count <= 0xffff) {
+        return obelisk_msgpack_write_head(w, type16, count, 2);
+    }
+    return obelisk_msgpack_write_head(w, type16 + 1, count, 4);
+}
+
+static int
+obelisk_msgpack_write_string(obelisk_writer_t *w, const char *str)
+{
+    size_t len = strlen(str);
+
+    if (obelisk_msgpack_write_count(w, 0xa0, 31, 0xd9, 0xda, len) < 0) {
+        return -1;
+    }
+    return obelisk_writer_add(w, str, len);
+}
+
+int
+obelisk_msgpack_write_array(obelisk_writer_t *w, size_t count)
+{
+    return obelisk_msgpack_write_count(w, 0x90, 15, 0, 0xdc, count);
+}
+
+static int
+obelisk_msgpack_write_integer(obelisk_writer_t *w, json_int_t v)
+{
+    unsigned char b;
+
+    if (v >= 0) {
+        if (v <= 0x7f) {
+            b = (unsigned char) v;
+            return obelisk_writer_add(w, &b, 1);
+        }
+        if (v <= 0xff) return obelisk_msgpack_write_head(w, 0xcc, v, 1);
+        if (v <= 0xffff) return obelisk_msgpack_write_head(w, 0xcd, v, 2);
+        if (v <= 0xffffffffLL) return obelisk_msgpack_write_head(w, 0xce, v, 4);
+        return obelisk_msgpack_write_head(w, 0xcf, v, 8);
+    }
+
+    if (v >= -32) {
+        b = (unsigned char) (signed char) v;
+        return obelisk_writer_add(w, &b, 1);
+    }
+    if (v >= INT8_MIN) return obelisk_msgpack_write_head(w, 0xd0, (uint8_t) v, 1);
+    if (v >= INT16_MIN) return obelisk_msgpack_write_head(w, 0xd1, (uint16_t) v, 2);
+    if (v >= INT32_MIN) return obelisk_msgpack_write_head(w, 0xd2, (uint32_t) v, 4);
+    return obelisk_msgpack_write_head(w, 0xd3, (uint64_t) v, 8);
+}
+
+int
+obelisk_msgpack_write(obelisk_writer_t *w, json_t *json)
+{
+    unsigned char b;
+
+    switch (json_typeof(json)) {
+        case JSON_NULL:
+            b = 0xc0;
+            return obelisk_writer_add(w, &b, 1);
+        case JSON_FALSE:
+            b = 0xc2;
+            return obelisk_writer_add(w, &b, 1);
+        case JSON_TRUE:
+            b = 0xc3;
+            return obelisk_writer_add(w, &b, 1);
+        case JSON_INTEGER:
+            return obelisk_msgpack_write_integer(w, json_integer_value(json));
+        case JSON_REAL: {
+            double d = json_real_value(json);
+            uint64_t bits;
+
+            memcpy(&bits, &d, sizeof(bits));
+            return obelisk_msgpack_write_head(w, 0xcb, bits, 8);
+        }
+        case JSON_STRING:
+            return obelisk_msgpack_write_string(w, json_string_value(json));
+        case JSON_ARRAY: {
+            size_t i;
+
+            if (obelisk_msgpack_write_array(w, json_array_size(json)) < 0) {
+                return -1;
+            }
+            for (i=0; i<json_array_size(json); i++) {
+                if (obelisk_msgpack_write(w, json_array_get(json, i)) < 0) {
+                    return -1;
+                }
+            }
+            return 0;
+        }
+        case JSON_OBJECT: {
+            void *iter;
+
+            if (obelisk_msgpack_write_count(w, 0x80, 15, 0, 0xde,
+                                            json_object_size(json)) < 0) {
+                return -1;
+            }
+            for (iter = json_object_iter(json); iter;
+                 iter = json_object_iter_next(json, iter)) {
+                if (obelisk_msgpack_write_string(w, json_object_iter_key(iter)) < 0 ||
+                    obelisk_msgpack_write(w, json_object_iter_value(iter)) < 0) {
+                    return -1;
+                }
+            }
+            return 0;
+        }
+        default:
+            return -1;
+    }
+}
+
+int
+obelisk_msgpack_write_response(obelisk_writer_t *w, json_t *result, json_t *id)
+{
+    if (obelisk_writer_add(w, result_head, sizeof(result_head)) < 0 ||
+        obelisk_msgpack_write(w, result ? result : json_null()) < 0 ||
+        obelisk_writer_add(w, result_id, sizeof(result_id)) < 0) {
+        return -1;
+    }
+    return obelisk_msgpack_write(w, id ? id : json_null());
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_MSGPACK_H_
+#define OBELISK_MSGPACK_H_
+
+#include <event2/buffer.h>
+#include "obelisk.h"
+
+/* MessagePack mapped onto the jansson model, so handlers see the same
+ * json_t values whatever the wire format.  Map keys must be strings and
+ * extension types are rejected. */
+
+/**
+ * @brief Decode one MessagePack value spanning the whole buffer
+ * @param buf input, left intact
+ * @param error decode error details
+ * @return the decoded value, or NULL on error
+ */
+json_t*
+obelisk_msgpack_load_evbuffer(struct evbuffer *buf, json_error_t *error);
+
+int
+obelisk_msgpack_write(obelisk_writer_t *w, json_t *json);
+
+int
+obelisk_msgpack_write_array(obelisk_writer_t *w, size_t count);
+
+/* MessagePack counterpart of obelisk_json_write_response() */
+int
+obelisk_msgpack_write_response(obelisk_writer_t *w, json_t *result, json_t *id);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <event2/event.h>
+#include <event2/util.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "obelisk.h"
+#include "obelisk_pool.h"
+#include "obelisk_request.h"
+#include "obelisk_stats.h"
+
+/* Pool threads push finished jobs onto the worker's lock-free stack and
+ * only write to the notify pipe when the stack was empty */
+static void
+obelisk_pool_complete(obelisk_job_t *job)
+{
+    obelisk_worker_t *worker = job->worker;
+    obelisk_job_t *head;
+
+    do {
+        head = worker->completed;
+        job->next = head;
+    } while (!__sync_bool_compare_and_swap(&worker->completed, head, job));
+
+    if (head == NULL) {
+        char c = 0;
+        /* a full pipe already guarantees a wakeup */
+        if (write(worker->notify[1], &c, 1) < 0 && errno != EAGAIN) {
+            fprintf(stderr, "pool notify error %s\n", strerror(errno));
+        }
+    }
+}
+
+static void
+obelisk_pool_notify_cb(evutil_socket_t fd, short what, void *arg)
+{
+    obelisk_worker_t *worker = (obelisk_worker_t*) arg;
+    obelisk_job_t *job;
+    obelisk_job_t *next;
+    obelisk_job_t *fifo = NULL;
+    char buf[64];
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    job = __sync_lock_test_and_set(&worker->completed, NULL);
+
+    /* The stack is newest first, complete in submission order */
+    while (job) {
+        next = job->next;
+        job->next = fifo;
+        fifo = job;
+        job = next;
+    }
+
+    for (job = fifo; job; job = next) {
+        next = job->next;
+        obelisk_call_complete(job->call, job->err, job->result);
+        free(job);
+    }
+}
+
+static void*
+obelisk_pool_run(void *arg)
+{
+    obelisk_pool_t *pool = (obelisk_pool_t*) arg;
+    obelisk_job_t *job;
+    uint64_t deadline;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == NULL) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pool->depth--;
+        pthread_mutex_unlock(&pool->lock);
+
+        /* coalesced calls joining on the loop may push it out meanwhile */
+        deadline = __atomic_load_n(&job->call->deadline, __ATOMIC_RELAXED);
+        job->result = NULL;
+        if (deadline && obelisk_clock_ns() > deadline) {
+            job->err = obelisk_error_create(NULL, OBELISK_ERROR_SERVER, "deadline exceeded");
+        }
+        else {
+            job->err = (*job->rpc->cb)(job->params, &job->result);
+        }
+        obelisk_pool_complete(job);
+    }
+
+    return NULL;
+}
+
+obelisk_pool_t*
+obelisk_pool_new(unsigned int nthreads, size_t max_depth)
+{
+    unsigned int i;
+    obelisk_pool_t *pool = calloc(1, sizeof(obelisk_pool_t));
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    pool->max_depth = max_depth;
+    pool->nthreads = nthreads;
+    pool->threads = calloc(nthreads, sizeof(pthread_t));
+
+    for (i=0; i<nthreads; i++) {
+        pthread_create(&pool->threads[i], NULL, obelisk_pool_run, pool);
+    }
+
+    return pool;
+}
+
+int
+obelisk_pool_attach(obelisk_worker_t *worker)
+{
+    if (pipe(worker->notify) < 0) {
+        return -1;
+    }
+
+    evutil_make_socket_nonblocking(worker->notify[0]);
+    evutil_make_socket_nonblocking(worker->notify[1]);
+
+    worker->completed = NULL;
+    worker->notify_ev = event_new(worker->base, worker->notify[0],
+                                  EV_READ | EV_PERSIST,
+                                  obelisk_pool_notify_cb, worker);
+    return event_add(worker->notify_ev, NULL);
+}
+
+obelisk_error_t*
+obelisk_pool_submit(obelisk_pool_t *pool,
+                    obelisk_worker_t *worker,
+                    obelisk_call_t *call,
+                    const obelisk_rpc_t *rpc,
+                    json_t *params)
+{
+    obelisk_job_t *job;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->max_depth && pool->depth >= pool->max_depth) {
+        pthread_mutex_unlock(&pool->lock);
+        return obelisk_error_create(obelisk_call_id(call), OBELISK_ERROR_SERVER,
+                                    "server busy");
+    }
+
+    job = calloc(1, sizeof(obelisk_job_t));
+    job->worker = worker;
+    job->call = call;
+    job->rpc = rpc;
+    job->params = params;
+
+    if (pool->tail) {
+        pool->tail->next = job;
+    }
+    else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pool->depth++;
+
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return OBELISK_SUCCESS;
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_POOL_H_
+#define OBELISK_POOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include "obelisk.h"
+#include "obelisk_worker.h"
+
+#define OBELISK_DEFAULT_POOL_THREADS 4
+#define OBELISK_DEFAULT_POOL_QUEUE 1024
+
+typedef struct obelisk_job_s obelisk_job_t;
+
+/* A blocking handler invocation, handed back to the owning worker once
+ * the pool has run it */
+struct obelisk_job_s {
+    obelisk_job_t *next;
+    obelisk_worker_t *worker;
+    obelisk_call_t *call;
+    const obelisk_rpc_t *rpc;
+    json_t *params;
+    json_t *result;
+    obelisk_error_t *err;
+};
+
+struct obelisk_pool_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    obelisk_job_t *head;
+    obelisk_job_t *tail;
+    size_t depth;
+    size_t max_depth;
+    pthread_t *threads;
+    unsigned int nthreads;
+};
+
+obelisk_pool_t*
+obelisk_pool_new(unsigned int nthreads, size_t max_depth);
+
+/**
+ * @brief Prepare a worker to receive completed jobs from the pool
+ * @return 0 on success, -1 on error
+ */
+int
+obelisk_pool_attach(obelisk_worker_t *worker);
+
+/**
+ * @brief Queue a blocking handler, the call completes on worker's loop.
+ * The job is dropped unrun once the call's deadline has passed.
+ * @return OBELISK_SUCCESS, or an error when the queue is full
+ */
+obelisk_error_t*
+obelisk_pool_submit(obelisk_pool_t *pool,
+                    obelisk_worker_t *worker,
+                    obelisk_call_t *call,
+                    const obelisk_rpc_t *rpc,
+                    json_t *params);
+
+#endif
@@ -0,0 +1,942 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obelisk.h"
+#include "obelisk_arena.h"
+#include "obelisk_cache.h"
+#include "obelisk_dispatch.h"
+#include "obelisk_error.h"
+#include "obelisk_flight.h"
+#include "obelisk_log.h"
+#include "obelisk_msgpack.h"
+#include "obelisk_pool.h"
+#include "obelisk_request.h"
+#include "obelisk_stats.h"
+#include "obelisk_trace.h"
+#include "obelisk_worker.h"
+
+static void
+obelisk_request_dispatch(obelisk_request_t *r);
+
+static void
+obelisk_request_free(obelisk_request_t *r)
+{
+    size_t i;
+
+    for (i=0; i<r->ncalls; i++) {
+        json_decref(r->calls[i].result);
+        if (r->calls[i].err) obelisk_error_destroy(r->calls[i].err);
+    }
+
+    json_decref(r->js_req);
+    if (r->err) obelisk_error_destroy(r->err);
+
+    OBELISK_STAT_ADD(r->worker->stats.inflight, -1);
+    if (r->admitted) {
+        __sync_fetch_and_sub(&r->worker->baton->inflight, 1);
+    }
+
+    /* r and its calls live in the arena */
+    obelisk_arena_put(r->arena);
+}
+
+/* Copy the head of buf for the access log, cut on a UTF-8 boundary */
+static size_t
+obelisk_log_copy(obelisk_request_t *r, struct evbuffer *buf, char *out)
+{
+    ev_ssize_t n;
+
+    if (r->format == OBELISK_FORMAT_MSGPACK) {
+        n = snprintf(out, OBELISK_LOG_SAMPLE, "<%zu bytes of msgpack>",
+                     evbuffer_get_length(buf));
+        return n < OBELISK_LOG_SAMPLE ? n : OBELISK_LOG_SAMPLE - 1;
+    }
+
+    n = evbuffer_copyout(buf, out, OBELISK_LOG_SAMPLE);
+    if (n <= 0) {
+        return 0;
+    }
+    if ((size_t) n < evbuffer_get_length(buf)) {
+        while (n > 0 && ((unsigned char) out[n] & 0xC0) == 0x80) {
+            n--;
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Fill in one access log record, dropped when the writer is behind
+ * @param evb reply body to sample, NULL when it was streamed
+ */
+static void
+obelisk_request_log(obelisk_request_t *r, size_t bytes_out, struct evbuffer *evb)
+{
+    obelisk_log_ring_t *ring = &r->worker->log;
+    obelisk_log_record_t *rec = obelisk_log_claim(ring);
+    obelisk_call_t *call = r->ncalls ? &r->calls[0] : NULL;
+    obelisk_error_t *err = r->err;
+    struct timeval tv;
+    size_t i;
+
+    if (rec == NULL) {
+        return;
+    }
+
+    event_base_gettimeofday_cached(r->worker->base, &tv);
+    rec->time_ms = (uint64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    rec->latency_ns = obelisk_clock_ns() - r->start;
+    rec->bytes_in = r->bytes_in;
+    rec->bytes_out = bytes_out;
+    rec->calls = r->ncalls;
+    memcpy(rec->peer, r->peer, sizeof(rec->peer));
+
+    for (i=0; err == NULL && i<r->ncalls; i++) {
+        err = r->calls[i].err;
+    }
+    rec->error = err ? obelisk_error_code(err->err) : 0;
+
+    rec->method[0] = '\0';
+    if (call && call->rpc) {
+        snprintf(rec->method, sizeof(rec->method), "%s", call->rpc->method);
+    }
+
+    rec->id[0] = '\0';
+    rec->id_string = 0;
+    if (call && json_is_string(call->id)) {
+        snprintf(rec->id, sizeof(rec->id), "%s", json_string_value(call->id));
+        rec->id_string = 1;
+    }
+    else if (call && json_is_integer(call->id)) {
+        snprintf(rec->id, sizeof(rec->id), "%" JSON_INTEGER_FORMAT,
+                 json_integer_value(call->id));
+    }
+
+    rec->req_len = 0;
+    rec->rsp_len = 0;
+    if (r->log_body) {
+        if (r->log_req_len) {
+            memcpy(rec->req, r->log_req, r->log_req_len);
+        }
+        rec->req_len = r->log_req_len;
+        rec->rsp_len = evb ? obelisk_log_copy(r, evb, rec->rsp) : 0;
+    }
+
+    obelisk_log_commit(ring);
+}
+
+static void
+obelisk_call_write_msgpack(obelisk_writer_t *w, obelisk_call_t *call)
+{
+    if (call->err) {
+        obelisk_msgpack_write(w, obelisk_error_json(call->err));
+    }
+    else if (call->raw) {
+        json_t *result = json_loadb(call->raw, call->raw_len, JSON_DECODE_ANY, NULL);
+
+        obelisk_msgpack_write_response(w, result, call->id);
+        json_decref(result);
+    }
+    else {
+        obelisk_msgpack_write_response(w, call->result, call->id);
+    }
+}
+
+static void
+obelisk_call_write(obelisk_writer_t *w, obelisk_call_t *call)
+{
+    if (call->request->format == OBELISK_FORMAT_MSGPACK) {
+        obelisk_call_write_msgpack(w, call);
+    }
+    else if (call->err) {
+        obelisk_error_write(call->err, w);
+    }
+    else if (call->raw) {
+        obelisk_json_write_raw_response(w, call->raw, call->raw_len, call->id);
+    }
+    else {
+        obelisk_json_write_response(w, call->result, call->id);
+    }
+}
+
+/**
+ * @brief Serialize the reply and hand it to the transport, notifications
+ * are left out and an empty body means there is nothing to answer
+ */
+static void
+obelisk_request_send(obelisk_request_t *r)
+{
+    struct evbuffer *evb = evbuffer_new();
+    obelisk_writer_t w;
+    uint64_t t0 = r->trace ? obelisk_clock_ns() : 0;
+    uint64_t t1 = 0;
+
+    /* Write data */
+    obelisk_writer_init(&w, evb);
+    if (r->err && r->format == OBELISK_FORMAT_MSGPACK) {
+        obelisk_msgpack_write(&w, obelisk_error_json(r->err));
+    }
+    else if (r->err) {
+        obelisk_error_write(r->err, &w);
+    }
+    else if (!r->batch && r->calls[0].stream_next) {
+        /* the elements follow as the transport asks for them */
+        obelisk_json_write_stream_head(&w);
+        r->streaming = 1;
+    }
+    else if (!r->batch) {
+        if (!r->calls[0].notification) {
+            obelisk_call_write(&w, &r->calls[0]);
+        }
+    }
+    else if (r->nreplies && r->format == OBELISK_FORMAT_MSGPACK) {
+        size_t i;
+
+        obelisk_msgpack_write_array(&w, r->nreplies);
+        for (i=0; i<r->ncalls; i++) {
+            if (!r->calls[i].notification) {
+                obelisk_call_write(&w, &r->calls[i]);
+            }
+        }
+    }
+    else if (r->nreplies) {
+        size_t i;
+        int first = 1;
+
+        obelisk_writer_add(&w, "[", 1);
+        for (i=0; i<r->ncalls; i++) {
+            if (r->calls[i].notification) {
+                continue;
+            }
+            if (!first) obelisk_writer_add(&w, ",", 1);
+            obelisk_call_write(&w, &r->calls[i]);
+            first = 0;
+        }
+        obelisk_writer_add(&w, "]", 1);
+    }
+    obelisk_writer_finish(&w);
+
+    if (r->trace) {
+        t1 = obelisk_clock_ns();
+        obelisk_trace_add(&r->worker->trace, r->trace, "stage", "serialize", t0, t1);
+    }
+
+    if (r->err) {
+        obelisk_stats_error(&r->worker->stats, r->err->err);
+    }
+    OBELISK_STAT_ADD(r->worker->stats.bytes_out, evbuffer_get_length(evb));
+
+    if (r->streaming) {
+        r->stream_bytes = evbuffer_get_length(evb);
+        (*r->stream)(r, evb);
+    }
+    else {
+        if (r->worker->baton->logging) {
+            obelisk_request_log(r, evbuffer_get_length(evb), evb);
+        }
+        (*r->reply)(r, evb);
+    }
+
+    if (r->trace) {
+        uint64_t t2 = obelisk_clock_ns();
+        obelisk_trace_add(&r->worker->trace, r->trace, "stage", "send", t1, t2);
+        obelisk_trace_add(&r->worker->trace, r->trace, "request", "request", r->start, t2);
+    }
+
+    evbuffer_free(evb);
+}
+
+/* Reply, unless that already happened, once every call has completed */
+static void
+obelisk_request_reply(obelisk_request_t *r)
+{
+    if (!r->replied) {
+        obelisk_request_send(r);
+    }
+    /* a streamed reply is freed by obelisk_request_stream_end() */
+    if (!r->streaming) {
+        obelisk_request_free(r);
+    }
+}
+
+static void
+obelisk_request_release(obelisk_request_t *r)
+{
+    if (--r->pending == 0) {
+        obelisk_request_reply(r);
+    }
+}
+
+/* Serialize a fresh result once, for the cache, waiters and the reply */
+static void
+obelisk_call_serialize(obelisk_call_t *call)
+{
+    obelisk_arena_t *prev = obelisk_arena_enter(call->request->arena);
+
+    call->raw = json_dumps(call->result, JSON_COMPACT | JSON_ENCODE_ANY);
+    if (call->raw) {
+        call->raw_len = strlen(call->raw);
+        json_decref(call->result);
+        call->result = NULL;
+    }
+
+    obelisk_arena_leave(prev);
+}
+
+/**
+ * @brief Complete the calls coalesced onto leader with its outcome
+ * @param waiters calls linked through flight_next, each with its own id
+ */
+static void
+obelisk_call_share(obelisk_call_t *leader, obelisk_call_t *waiters)
+{
+    obelisk_error_t *lerr = leader->err;
+
+    if (lerr == NULL && leader->raw == NULL) {
+        obelisk_call_serialize(leader);
+    }
+
+    while (waiters) {
+        obelisk_call_t *call = waiters;
+        obelisk_arena_t *prev = obelisk_arena_enter(call->request->arena);
+        obelisk_error_t *err = OBELISK_SUCCESS;
+
+        waiters = call->flight_next;
+        if (lerr) {
+            err = obelisk_error_create_impl(call->id, lerr->err, lerr->msg,
+                                            lerr->line, lerr->file);
+        }
+        else if (leader->raw) {
+            call->raw = obelisk_malloc(leader->raw_len);
+            if (call->raw) {
+                call->raw_len = leader->raw_len;
+                memcpy(call->raw, leader->raw, leader->raw_len);
+            }
+            else {
+                err = obelisk_error_create(call->id, OBELISK_ERROR_INTERNAL, "Out Of Memory");
+            }
+        }
+        else {
+            err = obelisk_error_create(call->id, OBELISK_ERROR_INTERNAL,
+                                       "unable to serialize result");
+        }
+        obelisk_arena_leave(prev);
+
+        OBELISK_STAT_ADD(call->request->worker->stats.coalesced, 1);
+        obelisk_call_complete(call, err, NULL);
+    }
+}
+
+void
+obelisk_call_complete(obelisk_call_t *call, obelisk_error_t *err, json_t *result)
+{
+    obelisk_request_t *r = call->request;
+    obelisk_baton_t *baton = r->worker->baton;
+    obelisk_stats_t *stats = &r->worker->stats;
+    obelisk_call_t *waiters = NULL;
+
+    if (call->flight_leader) {
+        waiters = obelisk_flight_leave(&r->worker->flight, call);
+    }
+    if (call->admitted) {
+        __sync_fetch_and_sub(&baton->dispatch->inflight[obelisk_dispatch_index(baton->dispatch,
+                                                                               call->rpc)], 1);
+        call->admitted = 0;
+    }
+
+    call->err = err;
+    call->result = err ? NULL : result;
+    if (call->notification) {
+        /* nobody is waiting for the result */
+        json_decref(call->result);
+        call->result = NULL;
+        if (err) obelisk_stats_error(stats, err->err);
+    }
+    else if (err) {
+        json_decref(result);
+        /* handlers do not always know the id */
+        if (err->id == NULL && err->json == NULL) {
+            err->id = call->id;
+        }
+        obelisk_stats_error(stats, err->err);
+    }
+    else if (result && call->rpc->cache_ms && baton->cache && call->cache_key) {
+        obelisk_call_serialize(call);
+        if (call->raw) {
+            obelisk_cache_put(baton->cache, call->cache_hash,
+                              obelisk_dispatch_index(baton->dispatch, call->rpc),
+                              call->cache_key, call->cache_len,
+                              call->raw, call->raw_len, call->rpc->cache_ms);
+        }
+    }
+
+    OBELISK_STAT_ADD(stats->calls, 1);
+    if (call->rpc) {
+        uint64_t now = obelisk_clock_ns();
+
+        obelisk_stats_record(stats, obelisk_dispatch_index(baton->dispatch, call->rpc),
+                             now - call->start);
+        if (r->trace) {
+            obelisk_trace_add(&r->worker->trace, r->trace, "handler",
+                              call->rpc->method, call->dispatched, now);
+        }
+    }
+
+    /* while the leader's request, and its result, are still alive */
+    if (waiters) {
+        obelisk_call_share(call, waiters);
+    }
+
+    r->inflight--;
+    if (r->next < r->ncalls) {
+        obelisk_request_dispatch(r);
+    }
+    obelisk_request_release(r);
+}
+
+/**
+ * @brief Compute the canonical key of the call's params, shared by the
+ * result cache and coalescing
+ * @return 0 on success
+ */
+static int
+obelisk_call_key(obelisk_call_t *call, json_t *params)
+{
+    obelisk_dispatch_t *dispatch = call->request->worker->baton->dispatch;
+
+    /* sorted keys make equal params produce equal keys */
+    call->cache_key = json_dumps(params, JSON_COMPACT | JSON_SORT_KEYS | JSON_ENCODE_ANY);
+    if (call->cache_key == NULL) {
+        return -1;
+    }
+    call->cache_len = strlen(call->cache_key);
+    call->cache_hash = obelisk_cache_hash(obelisk_dispatch_index(dispatch, call->rpc),
+                                          call->cache_key, call->cache_len);
+    return 0;
+}
+
+/**
+ * @brief Look the call up in the result cache
+ * @return 1 if call->raw now holds the cached result
+ */
+static int
+obelisk_call_cache_get(obelisk_call_t *call)
+{
+    obelisk_baton_t *baton = call->request->worker->baton;
+    obelisk_stats_t *stats = &call->request->worker->stats;
+
+    if (obelisk_cache_get(baton->cache, call->cache_hash,
+                          obelisk_dispatch_index(baton->dispatch, call->rpc),
+                          call->cache_key, call->cache_len,
+                          &call->raw, &call->raw_len)) {
+        OBELISK_STAT_ADD(stats->cache_hits, 1);
+        return 1;
+    }
+
+    OBELISK_STAT_ADD(stats->cache_misses, 1);
+    return 0;
+}
+
+/* Can the call's result go out in chunks as it is produced */
+static int
+obelisk_call_streamable(obelisk_call_t *call)
+{
+    obelisk_request_t *r = call->request;
+
+    return r->stream && !r->batch && !call->notification &&
+           r->format == OBELISK_FORMAT_JSON && call->cache_key == NULL;
+}
+
+void
+obelisk_call_stream(obelisk_call_t *call, int (*next)(obelisk_call_t *call, void *arg),
+                    void (*release)(void *arg), void *arg)
+{
+    obelisk_error_t *err = OBELISK_SUCCESS;
+    json_t *result;
+    int more;
+
+    if (obelisk_call_streamable(call)) {
+        call->stream_next = next;
+        call->stream_release = release;
+        call->stream_arg = arg;
+        obelisk_call_complete(call, OBELISK_SUCCESS, NULL);
+        return;
+    }
+
+    /* collect everything into a plain result */
+    result = json_array();
+    call->stream_array = result;
+    while ((more = (*next)(call, arg)) > 0);
+    call->stream_array = NULL;
+
+    if (more < 0) {
+        json_decref(result);
+        result = NULL;
+        err = obelisk_error_create(call->id, OBELISK_ERROR_INTERNAL, "stream failed");
+    }
+    if (release) {
+        (*release)(arg);
+    }
+    obelisk_call_complete(call, err, result);
+}
+
+int
+obelisk_call_emit(obelisk_call_t *call, json_t *element)
+{
+    int rc;
+
+    if (call->stream_w == NULL) {
+        return json_array_append_new(call->stream_array, element);
+    }
+
+    rc = 0;
+    if (call->stream_count++ && obelisk_writer_add(call->stream_w, ",", 1) < 0) {
+        rc = -1;
+    }
+    else if (obelisk_writer_json(call->stream_w, element) < 0) {
+        rc = -1;
+    }
+    json_decref(element);
+    return rc;
+}
+
+int
+obelisk_request_stream(obelisk_request_t *r, struct evbuffer *out)
+{
+    /* outside the arena, so emitted elements are freed as they go */
+    obelisk_arena_t *prev = obelisk_arena_enter(NULL);
+    obelisk_call_t *call = &r->calls[0];
+    size_t len = evbuffer_get_length(out);
+    obelisk_writer_t w;
+    int more = 1;
+
+    obelisk_writer_init(&w, out);
+    call->stream_w = &w;
+    while (more > 0 && evbuffer_get_length(out) + w.used < len + OBELISK_STREAM_CHUNK) {
+        more = (*call->stream_next)(call, call->stream_arg);
+    }
+    call->stream_w = NULL;
+
+    if (more == 0) {
+        obelisk_json_write_stream_tail(&w, call->id);
+    }
+    obelisk_writer_finish(&w);
+    obelisk_arena_leave(prev);
+
+    len = evbuffer_get_length(out) - len;
+    r->stream_bytes += len;
+    OBELISK_STAT_ADD(r->worker->stats.bytes_out, len);
+
+    if (more < 0) {
+        obelisk_stats_error(&r->worker->stats, OBELISK_ERROR_INTERNAL);
+    }
+    return more;
+}
+
+void
+obelisk_request_stream_end(obelisk_request_t *r)
+{
+    obelisk_call_t *call = &r->calls[0];
+
+    if (call->stream_release) {
+        (*call->stream_release)(call->stream_arg);
+    }
+    if (r->worker->baton->logging) {
+        obelisk_request_log(r, r->stream_bytes, NULL);
+    }
+    obelisk_request_free(r);
+}
+
+json_t*
+obelisk_call_id(obelisk_call_t *call)
+{
+    return call->id;
+}
+
+struct event_base*
+obelisk_call_base(obelisk_call_t *call)
+{
+    return call->request->worker->base;
+}
+
+obelisk_session_t*
+obelisk_call_session(obelisk_call_t *call)
+{
+    return call->request->session;
+}
+
+static void
+obelisk_execute_rpc(obelisk_call_t *call, json_t *request, obelisk_baton_t *baton)
+{
+    obelisk_error_t *obelisk_err = OBELISK_SUCCESS;
+    json_t *method; 
+    json_t *params;
+    json_t *result = NULL;
+    const char *method_string;
+    const obelisk_rpc_t *rpc;
+    unsigned int limit;
+
+    call->start = obelisk_clock_ns();
+    
+    /* fetch the ID first and make sure we have it, because we need it later,
+     * only notifications go without */
+    if ((call->id = json_object_get(request, "id")) == NULL && !call->notification) {
+        obelisk_err = obelisk_error_create(NULL, OBELISK_ERROR_INVALID_REQUEST, 
+                                 "id missing");
+        goto done;
+    }
+
+    /* Check the method and params parameters */
+    if ((method = json_object_get(request, "method")) == NULL ||
+        (method_string = json_string_value(method)) == NULL) {
+        obelisk_err = obelisk_error_create(call->id, OBELISK_ERROR_INVALID_REQUEST, 
+                                 "method missing");
+        goto done;
+    }
+
+    if ((params = json_object_get(request, "params")) == NULL) {
+        obelisk_err = obelisk_error_create(call->id, OBELISK_ERROR_INVALID_REQUEST, 
+                                 "params missing");
+        goto done;
+    }
+
+    rpc = obelisk_dispatch_find(baton->dispatch, method_string,
+                                json_string_length(method));
+    if (!rpc) {
+        obelisk_err = obelisk_error_create(call->id, OBELISK_ERROR_METHOD_NOT_FOUND, "");
+        goto done;
+    }
+    call->rpc = rpc;
+
+    if (call->request->trace) {
+        call->dispatched = obelisk_clock_ns();
+        obelisk_trace_add(&call->request->worker->trace, call->request->trace,
+                          "stage", "dispatch", call->start, call->dispatched);
+    }
+
+    if (!call->notification &&
+        ((rpc->cache_ms && baton->cache) || (rpc->flags & OBELISK_RPC_COALESCE)) &&
+        obelisk_call_key(call, params) == 0) {
+        /* a hit skips the handler and serialization */
+        if (rpc->cache_ms && baton->cache && obelisk_call_cache_get(call)) {
+            goto done;
+        }
+    }
+
+    /* Shed load before any handler work: expired requests, then methods
+     * at their concurrency cap */
+    if (call->request->deadline && obelisk_clock_ns() > call->request->deadline) {
+        OBELISK_STAT_ADD(call->request->worker->stats.expired, 1);
+        obelisk_err = obelisk_error_create(call->id, OBELISK_ERROR_SERVER, "deadline exceeded");
+        goto done;
+    }
+
+    limit = rpc->max_inflight ? rpc->max_inflight : baton->settings->method_inflight;
+    if (limit) {
+        volatile unsigned int *inflight =
+            &baton->dispatch->inflight[obelisk_dispatch_index(baton->dispatch, rpc)];
+
+        if (__sync_add_and_fetch(inflight, 1) > limit) {
+            __sync_fetch_and_sub(inflight, 1);
+            OBELISK_STAT_ADD(call->request->worker->stats.rejected, 1);
+            obelisk_err = obelisk_error_create(call->id, OBELISK_ERROR_SERVER, "method overloaded");
+            goto done;
+        }
+        call->admitted = 1;
+    }
+
+    /* An identical call already running completes this one too.  Both
+     * passed their own deadline and admission checks, so a leader only
+     * shares what its handler produced. */
+    call->deadline = call->request->deadline;
+    if (call->cache_key && (rpc->flags & OBELISK_RPC_COALESCE) &&
+        obelisk_flight_join(&call->request->worker->flight, call)) {
+        return;
+    }
+
+    if ((rpc->flags & OBELISK_RPC_BLOCKING) && baton->pool) {
+        obelisk_err = obelisk_pool_submit(baton->pool, call->request->worker,
+                                          call, rpc, params);
+        if (obelisk_err) {
+            goto done;
+        }
+        return;
+    }
+
+    if (rpc->async_cb) {
+        obelisk_err = (*rpc->async_cb)(params, call);
+        if (obelisk_err) {
+            goto done;
+        }
+        /* the handler finishes the call with obelisk_call_complete() */
+        return;
+    }
+
+    obelisk_err = (*rpc->cb)(params, &result);
+
+done:
+    obelisk_call_complete(call, obelisk_err, result);
+}
+
+/**
+ * @brief Start calls until the batch parallelism cap is reached
+ * @param r the request, re-entered as calls complete
+ */
+static void
+obelisk_request_dispatch(obelisk_request_t *r)
+{
+    obelisk_baton_t *baton = r->worker->baton;
+    size_t cap = baton->settings->batch_parallel;
+    obelisk_arena_t *prev;
+
+    /* calls completing synchronously come back through here */
+    if (r->dispatching) {
+        return;
+    }
+
+    /* Hold the request open while dispatching, so a handler completing
+     * synchronously can not reply early */
+    r->dispatching = 1;
+    r->pending++;
+
+    /* completions re-enter from outside the request's arena */
+    prev = obelisk_arena_enter(r->arena);
+
+    while (r->next < r->ncalls && (cap == 0 || r->inflight < cap)) {
+        size_t i = r->next++;
+        json_t *element = r->batch ? json_array_get(r->js_req, i) : r->js_req;
+
+        r->inflight++;
+        obelisk_execute_rpc(&r->calls[i], element, baton);
+    }
+
+    obelisk_arena_leave(prev);
+
+    r->dispatching = 0;
+    obelisk_request_release(r);
+}
+
+
+obelisk_request_t*
+obelisk_request_new(obelisk_worker_t *worker, obelisk_reply_t reply, void *transport)
+{
+    obelisk_arena_t *arena = obelisk_arena_get();
+    obelisk_arena_t *prev;
+    obelisk_request_t *r;
+
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    prev = obelisk_arena_enter(arena);
+    r = obelisk_malloc(sizeof(obelisk_request_t));
+    if (r == NULL) {
+        obelisk_arena_leave(prev);
+        obelisk_arena_put(arena);
+        return NULL;
+    }
+
+    memset(r, 0, sizeof(obelisk_request_t));
+    r->arena = arena;
+    r->worker = worker;
+    r->reply = reply;
+    r->transport = transport;
+    strcpy(r->peer, "0.0.0.0");
+
+    OBELISK_STAT_ADD(worker->stats.requests, 1);
+    OBELISK_STAT_ADD(worker->stats.inflight, 1);
+
+    r->trace = obelisk_trace_sample(&worker->trace, worker->baton->settings->trace_rate);
+    if (worker->baton->logging) {
+        r->log_body = obelisk_log_sample(&worker->log, worker->baton->settings->log_sample);
+    }
+    if (r->trace || worker->baton->logging || worker->baton->settings->deadline_ms) {
+        r->start = obelisk_clock_ns();
+        obelisk_request_set_timeout(r, worker->baton->settings->deadline_ms);
+    }
+
+    obelisk_arena_leave(prev);
+    return r;
+}
+
+static json_t*
+obelisk_request_load(obelisk_request_t *r, struct evbuffer *body, json_error_t *err)
+{
+    if (r->format == OBELISK_FORMAT_MSGPACK) {
+        return obelisk_msgpack_load_evbuffer(body, err);
+    }
+    return obelisk_json_load_evbuffer(body, err);
+}
+
+void
+obelisk_request_set_timeout(obelisk_request_t *r, unsigned int ms)
+{
+    if (ms) {
+        if (r->start == 0) {
+            r->start = obelisk_clock_ns();
+        }
+        r->deadline = r->start + (uint64_t) ms * 1000000ULL;
+    }
+}
+
+void
+obelisk_request_fail(obelisk_request_t *r, obelisk_error_errno_t e, const char *msg)
+{
+    obelisk_arena_t *prev = obelisk_arena_enter(r->arena);
+
+    r->err = obelisk_error_create(0, e, msg);
+    obelisk_request_reply(r);
+
+    obelisk_arena_leave(prev);
+}
+
+/** 
+ * @brief Run the JSON-RPC handler for every call in the request
+ * @param r the request, replied to and freed once all calls complete
+ * @param body request body, only read before this returns
+ *
+ * Asynchronous and blocking calls of a batch run concurrently, the
+ * response array is assembled in request order once the last finishes.
+ */
+void
+obelisk_request_run(obelisk_request_t *r, struct evbuffer *body)
+{
+    obelisk_arena_t *prev = obelisk_arena_enter(r->arena);
+    obelisk_settings_t *settings = r->worker->baton->settings;
+    json_error_t js_err;
+    json_t *js_req;
+    size_t i;
+
+    r->bytes_in = evbuffer_get_length(body);
+    OBELISK_STAT_ADD(r->worker->stats.bytes_in, r->bytes_in);
+    if (r->log_body) {
+        r->log_req = obelisk_malloc(OBELISK_LOG_SAMPLE);
+        if (r->log_req) {
+            r->log_req_len = obelisk_log_copy(r, body, r->log_req);
+        }
+    }
+
+    /* Admission: reject before parsing anything when over capacity */
+    if (settings->max_inflight) {
+        if (__sync_add_and_fetch(&r->worker->baton->inflight, 1) > settings->max_inflight) {
+            __sync_fetch_and_sub(&r->worker->baton->inflight, 1);
+            OBELISK_STAT_ADD(r->worker->stats.rejected, 1);
+            r->err = obelisk_error_create(0, OBELISK_ERROR_SERVER, "server overloaded");
+            goto error;
+        }
+        r->admitted = 1;
+    }
+
+    if (r->deadline && obelisk_clock_ns() > r->deadline) {
+        OBELISK_STAT_ADD(r->worker->stats.expired, 1);
+        r->err = obelisk_error_create(0, OBELISK_ERROR_SERVER, "deadline exceeded");
+        goto error;
+    }
+
+    /* Check for an empty request */
+    if (evbuffer_get_length(body) == 0) {
+        r->err = obelisk_error_create(0, OBELISK_ERROR_INVALID_REQUEST, "Empty Request");
+        goto error;
+    }
+
+    if (settings->max_body && evbuffer_get_length(body) > settings->max_body) {
+        r->err = obelisk_error_create(0, OBELISK_ERROR_INVALID_REQUEST, "Request Too Large");
+        goto error;
+    }
+
+
+    /* Parse Request */
+    if (r->trace) {
+        uint64_t t0 = obelisk_clock_ns();
+        js_req = obelisk_request_load(r, body, &js_err);
+        obelisk_trace_add(&r->worker->trace, r->trace, "stage", "parse",
+                          t0, obelisk_clock_ns());
+    }
+    else {
+        js_req = obelisk_request_load(r, body, &js_err);
+    }
+    if (js_req == NULL) {
+        /* Format Parse Error */
+        r->err = obelisk_error_create(0, OBELISK_ERROR_PARSE, js_err.text);
+        goto error;
+    }
+
+    if (json_is_array(js_req)) { /* Multi-RPC Call */
+        if (json_array_size(js_req) == 0) {
+            json_decref(js_req);
+            r->err = obelisk_error_create(0, OBELISK_ERROR_INVALID_REQUEST, "Empty Batch");
+            goto error;
+        }
+        r->ncalls = json_array_size(js_req);
+        r->batch = 1;
+    }
+    else { /* Single RPC Call */
+        r->ncalls = 1;
+    }
+
+    r->calls = obelisk_malloc(r->ncalls * sizeof(obelisk_call_t));
+    if (r->calls == NULL) {
+        json_decref(js_req);
+        r->ncalls = 0;
+        r->err = obelisk_error_create(0, OBELISK_ERROR_INTERNAL, "Out Of Memory");
+        goto error;
+    }
+    r->js_req = js_req;
+    memset(r->calls, 0, r->ncalls * sizeof(obelisk_call_t));
+    for (i=0; i<r->ncalls; i++) {
+        json_t *element = r->batch ? json_array_get(js_req, i) : js_req;
+
+        r->calls[i].request = r;
+        /* a well-formed call without an id is a notification */
+        if (json_is_object(element) && json_object_get(element, "id") == NULL) {
+            r->calls[i].notification = 1;
+        }
+        else {
+            r->nreplies++;
+        }
+    }
+
+    /* Nothing to answer, let the transport go before running anything */
+    if (r->nreplies == 0) {
+        obelisk_request_send(r);
+        r->replied = 1;
+    }
+
+    /* Run Handler */
+    r->pending = r->ncalls;
+    obelisk_request_dispatch(r);
+    goto done;
+
+error:
+    obelisk_request_reply(r);
+
+done:
+    /* Handlers completing later allocate from the heap */
+    obelisk_arena_leave(prev);
+}
@@ -0,0 +1,179 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_REQUEST_H_
+#define OBELISK_REQUEST_H_
+
+#include <event2/buffer.h>
+#include "obelisk.h"
+#include "obelisk_arena.h"
+#include "obelisk_worker.h"
+
+typedef struct obelisk_request_s obelisk_request_t;
+
+/* Wire format of a request body and its reply */
+typedef enum {
+    OBELISK_FORMAT_JSON,
+    OBELISK_FORMAT_MSGPACK
+} obelisk_format_t;
+
+/* Transport hook, called once with the serialized reply.  An empty body
+ * means there is nothing to answer (notifications only), and the call may
+ * then come before the handlers have run. */
+typedef void (*obelisk_reply_t)(obelisk_request_t *r, struct evbuffer *body);
+
+/* Chunk size a streamed result is produced in */
+#define OBELISK_STREAM_CHUNK (64 * 1024)
+
+/* A single JSON-RPC call; doubles as the completion token handed to
+ * asynchronous handlers */
+struct obelisk_call_s {
+    obelisk_request_t *request;
+    json_t *id;
+    json_t *result;
+    obelisk_error_t *err;
+    const obelisk_rpc_t *rpc;
+    uint64_t start;
+    uint64_t dispatched;
+
+    /* canonical params of a cacheable or coalescable call, and the
+     * serialized result when it is shared */
+    char *cache_key;
+    size_t cache_len;
+    uint64_t cache_hash;
+    char *raw;
+    size_t raw_len;
+
+    /* single-flight links, see obelisk_flight.h */
+    obelisk_call_t *flight_chain;
+    obelisk_call_t *flight_next;
+    int flight_leader;
+
+    /* request deadline, for a leader the latest of its waiters' too */
+    uint64_t deadline;
+
+    /* no id: the handler runs, nothing is written back */
+    int notification;
+
+    /* holds one of the method's in-flight slots */
+    int admitted;
+
+    /* streamed result producer, see obelisk_call_stream(), writing to
+     * stream_w when sent in chunks or into stream_array otherwise */
+    int (*stream_next)(obelisk_call_t *call, void *arg);
+    void (*stream_release)(void *arg);
+    void *stream_arg;
+    obelisk_writer_t *stream_w;
+    json_t *stream_array;
+    size_t stream_count;
+};
+
+/* A request carrying one call, or a batch of them, independent of the
+ * transport it arrived on */
+struct obelisk_request_s {
+    obelisk_arena_t *arena;
+    obelisk_worker_t *worker;
+    obelisk_reply_t reply;
+    void *transport;
+    char peer[64];
+    obelisk_format_t format;
+    json_t *js_req;
+    obelisk_error_t *err;
+    obelisk_call_t *calls;
+    size_t ncalls;
+    size_t pending;
+    size_t next;
+    size_t inflight;
+    int batch;
+    int dispatching;
+
+    /* calls that are not notifications, the transport is released early
+     * when there are none */
+    size_t nreplies;
+    int replied;
+
+    /* non-zero when sampled for tracing, with the arrival time */
+    uint64_t trace;
+    uint64_t start;
+
+    /* monotonic ns after which calls are no longer started, 0 for none */
+    uint64_t deadline;
+    int admitted;
+
+    /* access log: body size, and the head of it when sampled */
+    size_t bytes_in;
+    int log_body;
+    char *log_req;
+    size_t log_req_len;
+
+    /* optional transport hook taking the head of a streamed result in
+     * place of reply; the transport pulls the rest with
+     * obelisk_request_stream() and finishes with obelisk_request_stream_end() */
+    obelisk_reply_t stream;
+    int streaming;
+    size_t stream_bytes;
+
+    /* set by the WebSocket transport */
+    obelisk_session_t *session;
+};
+
+/**
+ * @brief Create a request owned by worker, in its own arena
+ * @param reply called with the serialized response
+ * @param transport transport state, available as r->transport
+ * @return the request, or NULL when out of memory
+ */
+obelisk_request_t*
+obelisk_request_new(obelisk_worker_t *worker, obelisk_reply_t reply, void *transport);
+
+/* Give the request a deadline of ms from now, 0 keeps the default */
+void
+obelisk_request_set_timeout(obelisk_request_t *r, unsigned int ms);
+
+/**
+ * @brief Parse and dispatch the body, the request frees itself after reply
+ * @param body request body, only read before this returns
+ */
+void
+obelisk_request_run(obelisk_request_t *r, struct evbuffer *body);
+
+/**
+ * @brief Produce the next chunk of a streamed result
+ * @param out chunk destination
+ * @return 1 while more remain, 0 once the reply is complete, -1 if the
+ * producer failed and the reply must be cut short
+ */
+int
+obelisk_request_stream(obelisk_request_t *r, struct evbuffer *out);
+
+/* Release the producer and the request, when done or the client is gone */
+void
+obelisk_request_stream_end(obelisk_request_t *r);
+
+/* Reply with a request-level error without running anything */
+void
+obelisk_request_fail(obelisk_request_t *r, obelisk_error_errno_t e, const char *msg);
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_SHM_H_
+#define OBELISK_SHM_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/* Shared-memory transport for clients on the same host.  A client
+ * connects to the handshake unix socket and receives, over SCM_RIGHTS, a
+ * memory fd holding an obelisk_shm_region_t plus two eventfds: one the
+ * server waits on, one the client waits on.
+ *
+ * The region holds two single-producer single-consumer byte rings, one
+ * for requests and one for replies.  Each carries JSON-RPC texts framed
+ * by a 32-bit length in host order; a frame may be larger than the ring
+ * and is then copied through it in pieces.  Replies come in completion
+ * order, notifications get none.
+ *
+ * A side about to block sets consumer_sleeping (or producer_waiting, when
+ * the ring is full), then looks at the ring once more; the other side
+ * only writes the eventfd when it sees the flag, so busy peers exchange
+ * messages without a syscall.  Flags are cleared by the side that set
+ * them. */
+
+#define OBELISK_SHM_MAGIC 0x4f42534dU
+#define OBELISK_SHM_RING (1024 * 1024)
+
+typedef struct {
+    /* written by the producer */
+    volatile uint64_t head;
+    volatile uint32_t producer_waiting;
+    char pad0[52];
+    /* written by the consumer */
+    volatile uint64_t tail;
+    volatile uint32_t consumer_sleeping;
+    char pad1[52];
+} obelisk_shm_ring_t;
+
+/* Mapped by both sides, the ring data follows: requests, then replies.
+ * size is read once, by the client at connect time. */
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    char pad[56];
+    obelisk_shm_ring_t requests;
+    obelisk_shm_ring_t replies;
+} obelisk_shm_region_t;
+
+#define OBELISK_SHM_REGION_SIZE(size) (sizeof(obelisk_shm_region_t) + 2 * (size_t) (size))
+
+/* One side's view of a ring.  The peer can write anything into the
+ * region, so the ring size, where its data lives and the position this
+ * side owns (head for the producer, tail for the consumer) are kept in
+ * private memory and only ever copied out to the ring. */
+typedef struct {
+    obelisk_shm_ring_t *ring;
+    unsigned char *data;
+    size_t size;
+    uint64_t pos;
+} obelisk_shm_view_t;
+
+/* size is the power of two the region was created with */
+static inline void
+obelisk_shm_view_init(obelisk_shm_view_t *view, obelisk_shm_region_t *region,
+                      obelisk_shm_ring_t *ring, size_t size)
+{
+    view->ring = ring;
+    view->data = (unsigned char*) (region + 1);
+    if (ring == &region->replies) {
+        view->data += size;
+    }
+    view->size = size;
+    view->pos = 0;
+}
+
+/* Bytes the consumer may read, more than size when the producer is lying */
+static inline uint64_t
+obelisk_shm_readable(obelisk_shm_view_t *view)
+{
+    return __atomic_load_n(&view->ring->head, __ATOMIC_ACQUIRE) - view->pos;
+}
+
+/* Bytes the producer may write, none while the consumer's tail is bogus */
+static inline size_t
+obelisk_shm_writable(obelisk_shm_view_t *view)
+{
+    uint64_t used = view->pos - __atomic_load_n(&view->ring->tail, __ATOMIC_ACQUIRE);
+
+    return used > view->size ? 0 : view->size - used;
+}
+
+/**
+ * @brief Copy up to len bytes into the ring, without publishing them
+ * @return bytes copied, pos is advanced by as many
+ */
+static inline size_t
+obelisk_shm_copyin(obelisk_shm_view_t *view, const void *src, size_t len)
+{
+    size_t space = obelisk_shm_writable(view);
+    size_t off = view->pos & (view->size - 1);
+    size_t first = view->size - off;
+
+    if (len > space) {
+        len = space;
+    }
+    if (first >= len) {
+        memcpy(view->data + off, src, len);
+    }
+    else {
+        memcpy(view->data + off, src, first);
+        memcpy(view->data, (const char*) src + first, len - first);
+    }
+    view->pos += len;
+    return len;
+}
+
+/**
+ * @brief Copy up to len readable bytes out of the ring and release them,
+ * the caller then looks at the producer's flag
+ * @return bytes copied, never more than the ring holds
+ */
+static inline size_t
+obelisk_shm_copyout(obelisk_shm_view_t *view, void *dst, size_t len)
+{
+    uint64_t avail = obelisk_shm_readable(view);
+    size_t off = view->pos & (view->size - 1);
+    size_t first = view->size - off;
+
+    if (avail > view->size) {
+        avail = view->size;
+    }
+    if (len > avail) {
+        len = avail;
+    }
+    if (first >= len) {
+        memcpy(dst, view->data + off, len);
+    }
+    else {
+        memcpy(dst, view->data + off, first);
+        memcpy((char*) dst + first, view->data, len - first);
+    }
+    view->pos += len;
+    __atomic_store_n(&view->ring->tail, view->pos, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return len;
+}
+
+/* Make the bytes copied in visible, then look at the consumer's flag */
+static inline void
+obelisk_shm_publish(obelisk_shm_view_t *view)
+{
+    __atomic_store_n(&view->ring->head, view->pos, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Set a wait flag and order it before the ring is looked at again */
+static inline void
+obelisk_shm_flag(volatile uint32_t *flag, uint32_t value)
+{
+    *flag = value;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#endif
@@ -0,0 +1,332 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "obelisk_shm.h"
+#include "obelisk_shm_client.h"
+
+/* Ring checks before sleeping in poll(), a reply from a fast handler
+ * usually shows up well within them.  On a single CPU spinning only
+ * keeps the server from running. */
+#define OBELISK_SHM_SPIN 4096
+
+struct obelisk_shm_client_s {
+    int fd;
+    int server_efd;
+    int efd;
+    obelisk_shm_region_t *region;
+    obelisk_shm_view_t requests;
+    obelisk_shm_view_t replies;
+    size_t size;
+    unsigned int spin;
+};
+
+static void
+obelisk_shm_wake(int efd)
+{
+    uint64_t one = 1;
+    ssize_t n = write(efd, &one, sizeof(one));
+    (void) n;
+}
+
+/* Spin for a while, then sleep until the server writes our eventfd or
+ * closes the handshake socket; *flag tells it we are asleep */
+static int
+obelisk_shm_wait(obelisk_shm_client_t *c, volatile uint32_t *flag,
+                 int (*ready)(obelisk_shm_client_t *c))
+{
+    struct pollfd pfd[2];
+    unsigned int i;
+
+    for (i=0; i<c->spin; i++) {
+        if (ready(c)) {
+            return 0;
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    pfd[0].fd = c->efd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = c->fd;
+    pfd[1].events = POLLIN;
+
+    for (;;) {
+        uint64_t count;
+
+        obelisk_shm_flag(flag, 1);
+        if (ready(c)) {
+            break;
+        }
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR) {
+            obelisk_shm_flag(flag, 0);
+            return -1;
+        }
+        if (pfd[1].revents) {
+            obelisk_shm_flag(flag, 0);
+            errno = EPIPE;
+            return -1;
+        }
+        if (pfd[0].revents && read(c->efd, &count, sizeof(count)) < 0 &&
+            errno != EAGAIN) {
+            obelisk_shm_flag(flag, 0);
+            return -1;
+        }
+    }
+    obelisk_shm_flag(flag, 0);
+    return 0;
+}
+
+static int
+obelisk_shm_can_write(obelisk_shm_client_t *c)
+{
+    return obelisk_shm_writable(&c->requests) > 0;
+}
+
+static int
+obelisk_shm_can_read(obelisk_shm_client_t *c)
+{
+    return obelisk_shm_readable(&c->replies) > 0;
+}
+
+/* Copy len bytes into the request ring, publishing as it fills up */
+static int
+obelisk_shm_write(obelisk_shm_client_t *c, const void *src, size_t len)
+{
+    obelisk_shm_ring_t *ring = c->requests.ring;
+
+    for (;;) {
+        size_t n = obelisk_shm_copyin(&c->requests, src, len);
+
+        src = (const char*) src + n;
+        len -= n;
+        if (len == 0) {
+            return 0;
+        }
+
+        obelisk_shm_publish(&c->requests);
+        if (ring->consumer_sleeping) {
+            obelisk_shm_wake(c->server_efd);
+        }
+        if (obelisk_shm_wait(c, &ring->producer_waiting, obelisk_shm_can_write) < 0) {
+            return -1;
+        }
+    }
+}
+
+/* Copy len bytes out of the reply ring, waiting for the server */
+static int
+obelisk_shm_read(obelisk_shm_client_t *c, void *dst, size_t len)
+{
+    obelisk_shm_ring_t *ring = c->replies.ring;
+
+    for (;;) {
+        size_t n = obelisk_shm_copyout(&c->replies, dst, len);
+
+        if (n && ring->producer_waiting) {
+            obelisk_shm_wake(c->server_efd);
+        }
+
+        dst = (char*) dst + n;
+        len -= n;
+        if (len == 0) {
+            return 0;
+        }
+        if (obelisk_shm_wait(c, &ring->consumer_sleeping, obelisk_shm_can_read) < 0) {
+            return -1;
+        }
+    }
+}
+
+/* Take the memory fd and both eventfds from the server */
+static int
+obelisk_shm_recv_fds(int fd, int *fds, int nfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    char ok;
+    size_t size = nfds * sizeof(int);
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &ok;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        if (errno == 0) {
+            errno = ECONNRESET;
+        }
+        return -1;
+    }
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(size)) {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), size);
+    return 0;
+}
+
+obelisk_shm_client_t*
+obelisk_shm_connect(const char *path)
+{
+    struct sockaddr_un sun;
+    obelisk_shm_client_t *c;
+    obelisk_shm_region_t header;
+    int fds[3];
+    void *region;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    c = calloc(1, sizeof(obelisk_shm_client_t));
+    c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) {
+        free(c);
+        return NULL;
+    }
+
+    errno = 0;
+    if (connect(c->fd, (struct sockaddr*) &sun, sizeof(sun)) < 0 ||
+        obelisk_shm_recv_fds(c->fd, fds, 3) < 0) {
+        close(c->fd);
+        free(c);
+        return NULL;
+    }
+    c->server_efd = fds[1];
+    c->efd = fds[2];
+
+    /* the ring size comes from the server, a power of two */
+    if (pread(fds[0], &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != OBELISK_SHM_MAGIC || header.size == 0 ||
+        (header.size & (header.size - 1))) {
+        errno = EPROTO;
+        region = MAP_FAILED;
+    }
+    else {
+        c->size = OBELISK_SHM_REGION_SIZE(header.size);
+        region = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    }
+    close(fds[0]);
+
+    if (region == MAP_FAILED) {
+        close(c->server_efd);
+        close(c->efd);
+        close(c->fd);
+        free(c);
+        return NULL;
+    }
+
+    c->region = (obelisk_shm_region_t*) region;
+    obelisk_shm_view_init(&c->requests, c->region, &c->region->requests, header.size);
+    obelisk_shm_view_init(&c->replies, c->region, &c->region->replies, header.size);
+    c->spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? OBELISK_SHM_SPIN : 0;
+    return c;
+}
+
+int
+obelisk_shm_send(obelisk_shm_client_t *c, const char *body, size_t len)
+{
+    obelisk_shm_ring_t *ring = c->requests.ring;
+    uint32_t frame = len;
+
+    if (len > UINT32_MAX) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (obelisk_shm_write(c, &frame, sizeof(frame)) < 0 ||
+        obelisk_shm_write(c, body, len) < 0) {
+        return -1;
+    }
+
+    obelisk_shm_publish(&c->requests);
+    if (ring->consumer_sleeping) {
+        obelisk_shm_wake(c->server_efd);
+    }
+    return 0;
+}
+
+char*
+obelisk_shm_recv(obelisk_shm_client_t *c, size_t *len)
+{
+    uint32_t frame;
+    char *body;
+
+    if (obelisk_shm_read(c, &frame, sizeof(frame)) < 0) {
+        return NULL;
+    }
+
+    body = malloc((size_t) frame + 1);
+    if (body == NULL || obelisk_shm_read(c, body, frame) < 0) {
+        free(body);
+        return NULL;
+    }
+    body[frame] = '\0';
+    *len = frame;
+    return body;
+}
+
+char*
+obelisk_shm_call(obelisk_shm_client_t *c, const char *body, size_t len, size_t *rsp_len)
+{
+    if (obelisk_shm_send(c, body, len) < 0) {
+        return NULL;
+    }
+    return obelisk_shm_recv(c, rsp_len);
+}
+
+void
+obelisk_shm_close(obelisk_shm_client_t *c)
+{
+    munmap(c->region, c->size);
+    close(c->server_efd);
+    close(c->efd);
+    close(c->fd);
+    free(c);
+}
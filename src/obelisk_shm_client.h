@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_SHM_CLIENT_H_
+#define OBELISK_SHM_CLIENT_H_
+
+#include <stddef.h>
+
+/* Client side of the shared-memory transport, for programs on the same
+ * host as the server.  A connection is used from one thread at a time.
+ * Requests may be pipelined with obelisk_shm_send(); replies come back
+ * in completion order, so match them up by id.  Notifications get no
+ * reply. */
+
+typedef struct obelisk_shm_client_s obelisk_shm_client_t;
+
+/**
+ * @brief Connect to the handshake socket of "obelisk -S <path>"
+ * @return the connection, or NULL with errno set
+ */
+obelisk_shm_client_t*
+obelisk_shm_connect(const char *path);
+
+/**
+ * @brief Queue one JSON-RPC request, waiting while the ring is full
+ * @return 0 on success, -1 with errno set once the server went away
+ */
+int
+obelisk_shm_send(obelisk_shm_client_t *c, const char *body, size_t len);
+
+/**
+ * @brief Wait for the next reply
+ * @param len set to the reply length
+ * @return the reply, NUL terminated, to be freed with free(), or NULL
+ * with errno set once the server went away
+ */
+char*
+obelisk_shm_recv(obelisk_shm_client_t *c, size_t *len);
+
+/**
+ * @brief Send one request and wait for its reply, with nothing else in
+ * flight
+ */
+char*
+obelisk_shm_call(obelisk_shm_client_t *c, const char *body, size_t len, size_t *rsp_len);
+
+void
+obelisk_shm_close(obelisk_shm_client_t *c);
+
+#endif
@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "obelisk_config.h"
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/listener.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include "obelisk.h"
+#include "obelisk_request.h"
+#include "obelisk_shm.h"
+#include "obelisk_shm_server.h"
+
+#ifdef HAVE_SYS_EVENTFD_H
+
+/* Requests are left in the ring, where they block the client, while this
+ * much of its replies waits for it to read or this many calls run */
+#define OBELISK_SHM_MAX_BACKLOG (4 * OBELISK_SHM_RING)
+#define OBELISK_SHM_MAX_PENDING 4096
+#define OBELISK_SHM_COPY 1024
+
+/* The connection outlives its client until every request has replied */
+typedef struct {
+    obelisk_worker_t *worker;
+    evutil_socket_t fd;
+    int efd;
+    int client_efd;
+    struct event *efd_ev;
+    struct event *fd_ev;
+
+    /* the client can write the whole region, so the ring sizes and
+     * positions are only trusted from these private copies */
+    obelisk_shm_region_t *region;
+    obelisk_shm_view_t requests;
+    obelisk_shm_view_t replies;
+    uint64_t published;
+
+    /* request bytes taken off the ring, and framed replies that did not
+     * fit in it yet */
+    struct evbuffer *input;
+    struct evbuffer *backlog;
+
+    /* what is left of a refused request, dropped as it comes in */
+    uint64_t skip;
+
+    size_t pending;
+    int paused;
+    int eof;
+} obelisk_shm_conn_t;
+
+static void
+obelisk_shm_wake(int efd)
+{
+    uint64_t one = 1;
+    ssize_t n = write(efd, &one, sizeof(one));
+    (void) n;
+}
+
+static void
+obelisk_shm_maybe_close(obelisk_shm_conn_t *conn)
+{
+    if (!conn->eof || conn->pending) {
+        return;
+    }
+
+    event_free(conn->efd_ev);
+    event_free(conn->fd_ev);
+    evutil_closesocket(conn->fd);
+    close(conn->efd);
+    close(conn->client_efd);
+    munmap(conn->region, OBELISK_SHM_REGION_SIZE(conn->requests.size));
+    evbuffer_free(conn->input);
+    evbuffer_free(conn->backlog);
+    free(conn);
+}
+
+/* Stop serving the client, pending requests still finish */
+static void
+obelisk_shm_drop(obelisk_shm_conn_t *conn)
+{
+    conn->eof = 1;
+    event_del(conn->efd_ev);
+    event_del(conn->fd_ev);
+    evbuffer_drain(conn->backlog, evbuffer_get_length(conn->backlog));
+}
+
+/* Make the replies copied so far visible to the client */
+static void
+obelisk_shm_publish_replies(obelisk_shm_conn_t *conn)
+{
+    obelisk_shm_ring_t *ring = conn->replies.ring;
+
+    if (conn->replies.pos != conn->published) {
+        obelisk_shm_publish(&conn->replies);
+        conn->published = conn->replies.pos;
+        if (ring->consumer_sleeping) {
+            obelisk_shm_wake(conn->client_efd);
+        }
+    }
+}
+
+/* Move as much of the backlog into the reply ring as fits */
+static void
+obelisk_shm_flush(obelisk_shm_conn_t *conn)
+{
+    obelisk_shm_ring_t *ring = conn->replies.ring;
+
+    while (evbuffer_get_length(conn->backlog)) {
+        struct evbuffer_iovec vec[8];
+        int i, n = evbuffer_peek(conn->backlog, -1, NULL, vec, 8);
+        size_t copied = 0;
+
+        for (i=0; i<n && i<8; i++) {
+            size_t len = obelisk_shm_copyin(&conn->replies, vec[i].iov_base,
+                                            vec[i].iov_len);
+            copied += len;
+            if (len < vec[i].iov_len) {
+                break;
+            }
+        }
+        evbuffer_drain(conn->backlog, copied);
+
+        if (copied == 0) {
+            /* full: have the client wake us once it has read, unless it
+             * already did in the meantime */
+            obelisk_shm_publish_replies(conn);
+            obelisk_shm_flag(&ring->producer_waiting, 1);
+            if (obelisk_shm_writable(&conn->replies) == 0) {
+                return;
+            }
+            obelisk_shm_flag(&ring->producer_waiting, 0);
+        }
+    }
+
+    obelisk_shm_publish_replies(conn);
+}
+
+/* Has the client sent more than it reads */
+static int
+obelisk_shm_throttled(obelisk_shm_conn_t *conn)
+{
+    return evbuffer_get_length(conn->backlog) > OBELISK_SHM_MAX_BACKLOG ||
+           conn->pending > OBELISK_SHM_MAX_PENDING;
+}
+
+static void
+obelisk_shm_reply(obelisk_request_t *r, struct evbuffer *body)
+{
+    obelisk_shm_conn_t *conn = (obelisk_shm_conn_t*) r->transport;
+    uint32_t len = evbuffer_get_length(body);
+
+    conn->pending--;
+    if (!conn->eof && len) {
+        evbuffer_add(conn->backlog, &len, sizeof(len));
+        /* small replies are copied, a backlog of them would otherwise
+         * keep a whole writer chain each */
+        if (len < OBELISK_SHM_COPY) {
+            evbuffer_add(conn->backlog, evbuffer_pullup(body, -1), len);
+        }
+        else {
+            evbuffer_add_buffer(conn->backlog, body);
+        }
+        obelisk_shm_flush(conn);
+    }
+
+    /* go back to the requests left in the ring */
+    if (conn->paused && !conn->eof && !obelisk_shm_throttled(conn)) {
+        conn->paused = 0;
+        event_active(conn->efd_ev, EV_READ, 1);
+    }
+    obelisk_shm_maybe_close(conn);
+}
+
+/* Run every complete frame taken off the request ring */
+static void
+obelisk_shm_process(obelisk_shm_conn_t *conn)
+{
+    size_t max_body = conn->worker->baton->settings->max_body;
+
+    while (!conn->eof) {
+        size_t have = evbuffer_get_length(conn->input);
+        uint32_t len;
+        obelisk_request_t *r;
+        struct evbuffer *body;
+
+        if (conn->skip) {
+            size_t n = conn->skip < have ? conn->skip : have;
+
+            evbuffer_drain(conn->input, n);
+            conn->skip -= n;
+            if (conn->skip) {
+                break;
+            }
+            continue;
+        }
+
+        if (have < sizeof(len)) {
+            break;
+        }
+        evbuffer_copyout(conn->input, &len, sizeof(len));
+
+        /* the client may still be writing a request that can never fit,
+         * answer it straight away and drop the rest of it */
+        if (max_body && len > max_body) {
+            r = obelisk_request_new(conn->worker, obelisk_shm_reply, conn);
+            if (r == NULL) {
+                obelisk_shm_drop(conn);
+                return;
+            }
+            evbuffer_drain(conn->input, sizeof(len));
+            conn->skip = len;
+
+            conn->pending++;
+            strcpy(r->peer, "shm");
+            obelisk_request_fail(r, OBELISK_ERROR_INVALID_REQUEST, "Request Too Large");
+            continue;
+        }
+
+        if (len > have - sizeof(len)) {
+            break;
+        }
+        evbuffer_drain(conn->input, sizeof(len));
+        if (len == 0) {
+            continue;
+        }
+
+        /* out of memory, the client sees the handshake socket close */
+        r = obelisk_request_new(conn->worker, obelisk_shm_reply, conn);
+        if (r == NULL) {
+            obelisk_shm_drop(conn);
+            return;
+        }
+
+        body = evbuffer_new();
+        evbuffer_remove_buffer(conn->input, body, len);
+
+        conn->pending++;
+        strcpy(r->peer, "shm");
+        obelisk_request_run(r, body);
+        evbuffer_free(body);
+    }
+}
+
+/**
+ * @brief Take everything off the request ring and hand the space back
+ * @return bytes taken, 0 when the ring is empty or the client was dropped
+ */
+static size_t
+obelisk_shm_drain(obelisk_shm_conn_t *conn)
+{
+    obelisk_shm_ring_t *ring = conn->requests.ring;
+    uint64_t avail = obelisk_shm_readable(&conn->requests);
+    struct evbuffer_iovec vec;
+
+    if (avail == 0) {
+        return 0;
+    }
+
+    /* a head more than a ring ahead of us was not written by a client
+     * following the protocol */
+    if (avail > conn->requests.size ||
+        evbuffer_reserve_space(conn->input, avail, &vec, 1) < 1) {
+        obelisk_shm_drop(conn);
+        return 0;
+    }
+    vec.iov_len = obelisk_shm_copyout(&conn->requests, vec.iov_base, avail);
+    evbuffer_commit_space(conn->input, &vec, 1);
+
+    if (ring->producer_waiting) {
+        obelisk_shm_wake(conn->client_efd);
+    }
+    return vec.iov_len;
+}
+
+static void
+obelisk_shm_efd_cb(evutil_socket_t efd, short what, void *arg)
+{
+    obelisk_shm_conn_t *conn = (obelisk_shm_conn_t*) arg;
+    obelisk_shm_ring_t *ring = conn->requests.ring;
+    size_t drained = 0;
+    size_t n;
+    uint64_t count;
+
+    if (read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        return;
+    }
+
+    /* the client sees we are awake and skips the eventfd */
+    obelisk_shm_flag(&ring->consumer_sleeping, 0);
+
+    /* the client read replies, make room for the rest */
+    if (evbuffer_get_length(conn->backlog)) {
+        obelisk_shm_flag(&conn->replies.ring->producer_waiting, 0);
+        obelisk_shm_flush(conn);
+    }
+    conn->paused = 0;
+
+    /* Stopping while awake leaves the client to wait for ring space,
+     * obelisk_shm_reply() or the next pass carries on */
+    conn->pending++;
+    while (!conn->eof) {
+        if (obelisk_shm_throttled(conn)) {
+            conn->paused = 1;
+            break;
+        }
+        if (drained >= conn->requests.size) {
+            /* a ring's worth, let the worker's other clients run */
+            event_active(conn->efd_ev, EV_READ, 1);
+            break;
+        }
+        if ((n = obelisk_shm_drain(conn)) > 0) {
+            drained += n;
+            obelisk_shm_process(conn);
+            continue;
+        }
+        obelisk_shm_flag(&ring->consumer_sleeping, 1);
+        if (obelisk_shm_readable(&conn->requests) == 0) {
+            break;
+        }
+        obelisk_shm_flag(&ring->consumer_sleeping, 0);
+    }
+    conn->pending--;
+    obelisk_shm_maybe_close(conn);
+}
+
+/* The handshake socket only carries the client going away */
+static void
+obelisk_shm_fd_cb(evutil_socket_t fd, short what, void *arg)
+{
+    obelisk_shm_conn_t *conn = (obelisk_shm_conn_t*) arg;
+    char buf[64];
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+    if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EINTR))) {
+        return;
+    }
+
+    obelisk_shm_drop(conn);
+    obelisk_shm_maybe_close(conn);
+}
+
+static int
+obelisk_shm_memfd(size_t size)
+{
+    int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("obelisk-shm", MFD_CLOEXEC);
+#else
+    char name[64];
+
+    snprintf(name, sizeof(name), "/obelisk-shm-%d-%p", (int) getpid(), (void*) &name);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        shm_unlink(name);
+    }
+#endif
+    if (fd >= 0 && ftruncate(fd, size) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Pass the memory fd and both eventfds to the client */
+static int
+obelisk_shm_send_fds(evutil_socket_t fd, int *fds, int nfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    char ok = 'o';
+    size_t size = nfds * sizeof(int);
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &ok;
+    iov.iov_len = 1;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(size);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(size);
+    memcpy(CMSG_DATA(cmsg), fds, size);
+
+    return sendmsg(fd, &msg, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+static void
+obelisk_shm_accept_cb(struct evconnlistener *listener,
+                      evutil_socket_t fd,
+                      struct sockaddr *sa,
+                      int socklen,
+                      void *arg)
+{
+    obelisk_worker_t *worker = (obelisk_worker_t*) arg;
+    obelisk_shm_conn_t *conn;
+    size_t size = OBELISK_SHM_REGION_SIZE(OBELISK_SHM_RING);
+    int fds[3];
+    void *region;
+
+    fds[0] = obelisk_shm_memfd(size);
+    if (fds[0] < 0) {
+        evutil_closesocket(fd);
+        return;
+    }
+
+    region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if (region == MAP_FAILED || fds[1] < 0 || fds[2] < 0) {
+        goto error;
+    }
+
+    conn = calloc(1, sizeof(obelisk_shm_conn_t));
+    conn->worker = worker;
+    conn->fd = fd;
+    conn->efd = fds[1];
+    conn->client_efd = fds[2];
+    conn->region = (obelisk_shm_region_t*) region;
+    conn->region->magic = OBELISK_SHM_MAGIC;
+    conn->region->size = OBELISK_SHM_RING;
+    obelisk_shm_view_init(&conn->requests, conn->region, &conn->region->requests,
+                          OBELISK_SHM_RING);
+    obelisk_shm_view_init(&conn->replies, conn->region, &conn->region->replies,
+                          OBELISK_SHM_RING);
+    /* nothing is running yet, so the first request has to wake us */
+    conn->region->requests.consumer_sleeping = 1;
+
+    if (obelisk_shm_send_fds(fd, fds, 3) < 0) {
+        free(conn);
+        goto error;
+    }
+    close(fds[0]);
+
+    conn->input = evbuffer_new();
+    conn->backlog = evbuffer_new();
+    conn->efd_ev = event_new(worker->base, conn->efd, EV_READ | EV_PERSIST,
+                             obelisk_shm_efd_cb, conn);
+    conn->fd_ev = event_new(worker->base, fd, EV_READ | EV_PERSIST,
+                            obelisk_shm_fd_cb, conn);
+    event_add(conn->efd_ev, NULL);
+    event_add(conn->fd_ev, NULL);
+    return;
+
+error:
+    if (region != MAP_FAILED) {
+        munmap(region, size);
+    }
+    if (fds[1] >= 0) {
+        close(fds[1]);
+    }
+    if (fds[2] >= 0) {
+        close(fds[2]);
+    }
+    close(fds[0]);
+    evutil_closesocket(fd);
+}
+
+int
+obelisk_shm_listen(obelisk_worker_t *worker, evutil_socket_t fd)
+{
+    struct evconnlistener *listener;
+
+    /* the socket is already listening, hence a backlog of 0 */
+    listener = evconnlistener_new(worker->base, obelisk_shm_accept_cb, worker,
+                                  LEV_OPT_CLOSE_ON_FREE, 0, fd);
+    return listener ? 0 : -1;
+}
+
+#else
+
+int
+obelisk_shm_listen(obelisk_worker_t *worker, evutil_socket_t fd)
+{
+    evutil_closesocket(fd);
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
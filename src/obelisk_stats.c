@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obelisk.h"
+#include "obelisk_dispatch.h"
+#include "obelisk_json.h"
+#include "obelisk_stats.h"
+#include "obelisk_worker.h"
+
+static const char *error_names[OBELISK_STATS_ERRORS] = {
+    "parse",
+    "invalid_request",
+    "method_not_found",
+    "invalid_params",
+    "internal",
+    "server",
+    "other"
+};
+
+static size_t
+obelisk_hist_bucket(uint64_t ns)
+{
+    unsigned int e;
+
+    if (ns < OBELISK_HIST_SUB) {
+        return ns;
+    }
+    if (ns >> (OBELISK_HIST_MAX_EXP + 1)) {
+        ns = (1ULL << (OBELISK_HIST_MAX_EXP + 1)) - 1;
+    }
+
+    e = 63 - __builtin_clzll(ns);
+    return (e - OBELISK_HIST_SUB_BITS + 1) * OBELISK_HIST_SUB +
+           ((ns >> (e - OBELISK_HIST_SUB_BITS)) & (OBELISK_HIST_SUB - 1));
+}
+
+/* Highest value that lands in bucket b */
+static uint64_t
+obelisk_hist_value(size_t b)
+{
+    unsigned int e;
+    uint64_t lower;
+
+    if (b < OBELISK_HIST_SUB) {
+        return b;
+    }
+
+    e = b / OBELISK_HIST_SUB + OBELISK_HIST_SUB_BITS - 1;
+    lower = (uint64_t) (OBELISK_HIST_SUB + b % OBELISK_HIST_SUB) << (e - OBELISK_HIST_SUB_BITS);
+    return lower + (1ULL << (e - OBELISK_HIST_SUB_BITS)) - 1;
+}
+
+void
+obelisk_stats_init(obelisk_stats_t *stats, size_t nmethods)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->methods = calloc(nmethods ? nmethods : 1, sizeof(obelisk_histogram_t));
+}
+
+void
+obelisk_stats_error(obelisk_stats_t *stats, obelisk_error_errno_t e)
+{
+    size_t i = (size_t) e < OBELISK_STATS_ERRORS - 1 ? (size_t) e : OBELISK_STATS_ERRORS - 1;
+    OBELISK_STAT_ADD(stats->errors[i], 1);
+}
+
+void
+obelisk_stats_record(obelisk_stats_t *stats, size_t m, uint64_t ns)
+{
+    obelisk_histogram_t *hist = &stats->methods[m];
+    size_t b = obelisk_hist_bucket(ns);
+
+    OBELISK_STAT_ADD(hist->buckets[b], 1);
+    OBELISK_STAT_ADD(hist->count, 1);
+    OBELISK_STAT_ADD(hist->sum, ns);
+    if (ns > hist->max) {
+        OBELISK_STAT_ADD(hist->max, ns - hist->max);
+    }
+}
+
+static json_t*
+obelisk_stats_method(obelisk_baton_t *baton, size_t m)
+{
+    static const struct {
+        const char *name;
+        double quantile;
+    } quantiles[] = {
+        {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}, {"p999", 0.999}
+    };
+    uint64_t buckets[OBELISK_HIST_BUCKETS];
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    unsigned int i;
+    size_t b;
+    size_t q;
+    uint64_t seen;
+    uint64_t value;
+    json_t *js;
+
+    memset(buckets, 0, sizeof(buckets));
+    for (i=0; i<baton->nworkers; i++) {
+        obelisk_histogram_t *hist = &baton->workers[i].stats.methods[m];
+        uint64_t hmax = OBELISK_STAT_GET(hist->max);
+
+        count += OBELISK_STAT_GET(hist->count);
+        sum += OBELISK_STAT_GET(hist->sum);
+        if (hmax > max) max = hmax;
+        for (b=0; b<OBELISK_HIST_BUCKETS; b++) {
+            buckets[b] += OBELISK_STAT_GET(hist->buckets[b]);
+        }
+    }
+
+    js = json_object();
+    json_object_set_new(js, "count", json_integer(count));
+    json_object_set_new(js, "mean_ns", json_integer(count ? sum / count : 0));
+    json_object_set_new(js, "max_ns", json_integer(max));
+
+    /* the bucket counts may be slightly ahead of count, walk their total */
+    for (count=0, b=0; b<OBELISK_HIST_BUCKETS; b++) {
+        count += buckets[b];
+    }
+
+    for (q=0, b=0, seen=0; q<sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        uint64_t rank = (uint64_t) (quantiles[q].quantile * count + 0.5);
+        char key[16];
+
+        while (b < OBELISK_HIST_BUCKETS - 1 && (seen + buckets[b] < rank || buckets[b] == 0)) {
+            seen += buckets[b++];
+        }
+
+        /* report the bucket's upper bound, never above the observed max */
+        value = count ? obelisk_hist_value(b) : 0;
+        snprintf(key, sizeof(key), "%s_ns", quantiles[q].name);
+        json_object_set_new(js, key, json_integer(value < max ? value : max));
+    }
+
+    return js;
+}
+
+void
+obelisk_stats_http_cb(struct evhttp_request *req, void *arg)
+{
+    obelisk_worker_t *worker = (obelisk_worker_t*) arg;
+    obelisk_baton_t *baton = worker->baton;
+    obelisk_dispatch_t *dispatch = baton->dispatch;
+    uint64_t totals[10] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+    uint64_t errors[OBELISK_STATS_ERRORS];
+    struct evbuffer *evb = evbuffer_new();
+    obelisk_writer_t w;
+    json_t *js;
+    json_t *js_errors;
+    json_t *js_methods;
+    unsigned int i;
+    size_t e;
+
+    memset(errors, 0, sizeof(errors));
+    for (i=0; i<baton->nworkers; i++) {
+        obelisk_stats_t *stats = &baton->workers[i].stats;
+
+        totals[0] += OBELISK_STAT_GET(stats->requests);
+        totals[1] += OBELISK_STAT_GET(stats->calls);
+        totals[2] += OBELISK_STAT_GET(stats->inflight);
+        totals[3] += OBELISK_STAT_GET(stats->bytes_in);
+        totals[4] += OBELISK_STAT_GET(stats->bytes_out);
+        totals[5] += OBELISK_STAT_GET(stats->cache_hits);
+        totals[6] += OBELISK_STAT_GET(stats->cache_misses);
+        totals[7] += OBELISK_STAT_GET(stats->coalesced);
+        totals[8] += OBELISK_STAT_GET(stats->rejected);
+        totals[9] += OBELISK_STAT_GET(stats->expired);
+        for (e=0; e<OBELISK_STATS_ERRORS; e++) {
+            errors[e] += OBELISK_STAT_GET(stats->errors[e]);
+        }
+    }
+
+    js = json_object();
+    json_object_set_new(js, "requests", json_integer(totals[0]));
+    json_object_set_new(js, "calls", json_integer(totals[1]));
+    json_object_set_new(js, "inflight", json_integer(totals[2]));
+    json_object_set_new(js, "bytes_in", json_integer(totals[3]));
+    json_object_set_new(js, "bytes_out", json_integer(totals[4]));
+    json_object_set_new(js, "cache_hits", json_integer(totals[5]));
+    json_object_set_new(js, "cache_misses", json_integer(totals[6]));
+    json_object_set_new(js, "coalesced", json_integer(totals[7]));
+    json_object_set_new(js, "rejected", json_integer(totals[8]));
+    json_object_set_new(js, "expired", json_integer(totals[9]));
+
+    js_errors = json_object();
+    for (e=0; e<OBELISK_STATS_ERRORS; e++) {
+        json_object_set_new(js_errors, error_names[e], json_integer(errors[e]));
+    }
+    json_object_set_new(js, "errors", js_errors);
+
+    js_methods = json_object();
+    for (e=0; e<dispatch->count; e++) {
+        json_object_set_new(js_methods, dispatch->methods[e].method,
+                            obelisk_stats_method(baton, e));
+    }
+    json_object_set_new(js, "methods", js_methods);
+
+    if (baton->workers[0].capture.data) {
+        uint64_t dropped = 0;
+        uint64_t oversize = 0;
+        json_t *js_capture = json_object();
+
+        for (i=0; i<baton->nworkers; i++) {
+            obelisk_capture_ring_t *ring = &baton->workers[i].capture;
+
+            dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+            oversize += __atomic_load_n(&ring->oversize, __ATOMIC_RELAXED);
+        }
+        json_object_set_new(js_capture, "dropped", json_integer(dropped));
+        json_object_set_new(js_capture, "oversize", json_integer(oversize));
+        json_object_set_new(js, "capture", js_capture);
+    }
+
+    obelisk_writer_init(&w, evb);
+    obelisk_writer_json(&w, js);
+    obelisk_writer_finish(&w);
+    json_decref(js);
+
+    evhttp_add_header(evhttp_request_get_output_headers(req),
+                      "Content-Type", "application/json");
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    evbuffer_free(evb);
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_STATS_H_
+#define OBELISK_STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+#include "obelisk_error.h"
+
+/* Log-linear latency buckets: exact below 8ns, then 8 sub-buckets per
+ * power of two (12.5% precision), saturating at 2^37ns */
+#define OBELISK_HIST_SUB_BITS 3
+#define OBELISK_HIST_SUB (1 << OBELISK_HIST_SUB_BITS)
+#define OBELISK_HIST_MAX_EXP 36
+#define OBELISK_HIST_BUCKETS ((OBELISK_HIST_MAX_EXP - OBELISK_HIST_SUB_BITS + 2) * OBELISK_HIST_SUB)
+
+#define OBELISK_STATS_ERRORS (OBELISK_ERROR_SERVER + 2)
+
+/* Counters are written by their owning worker only, and read by any
+ * worker serving /stats; relaxed atomics keep both sides cheap */
+#define OBELISK_STAT_ADD(v, n) \
+    __atomic_store_n(&(v), (v) + (n), __ATOMIC_RELAXED)
+#define OBELISK_STAT_GET(v) \
+    __atomic_load_n(&(v), __ATOMIC_RELAXED)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[OBELISK_HIST_BUCKETS];
+} obelisk_histogram_t;
+
+/* Per-worker counters, merged on read */
+typedef struct {
+    uint64_t requests;
+    uint64_t calls;
+    uint64_t inflight;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t coalesced;
+    uint64_t rejected;
+    uint64_t expired;
+    uint64_t errors[OBELISK_STATS_ERRORS];
+    obelisk_histogram_t *methods;
+} obelisk_stats_t;
+
+static inline uint64_t
+obelisk_clock_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void
+obelisk_stats_init(obelisk_stats_t *stats, size_t nmethods);
+
+void
+obelisk_stats_error(obelisk_stats_t *stats, obelisk_error_errno_t e);
+
+/* Record one call of method index m taking ns nanoseconds */
+void
+obelisk_stats_record(obelisk_stats_t *stats, size_t m, uint64_t ns);
+
+/* evhttp callback serving the merged counters of every worker as JSON */
+struct evhttp_request;
+
+void
+obelisk_stats_http_cb(struct evhttp_request *req, void *arg);
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "obelisk.h"
+#include "obelisk_request.h"
+#include "obelisk_stream.h"
+
+/* Reading stops while this much output waits for the client, as on
+ * WebSockets, or this many calls run; it resumes below half the output */
+#define OBELISK_STREAM_MAX_BACKLOG (16 * 1024 * 1024)
+#define OBELISK_STREAM_MAX_PENDING 4096
+/* Replies below this are copied rather than keeping their own chains */
+#define OBELISK_STREAM_COPY 4096
+
+typedef struct {
+    obelisk_worker_t *worker;
+    struct bufferevent *bev;
+    char peer[64];
+    size_t pending;
+    int eof;
+    int paused;
+    int final;      /* the client closed while paused */
+} obelisk_stream_conn_t;
+
+static void obelisk_stream_process(obelisk_stream_conn_t *conn, int final);
+
+/* The connection outlives its socket until every request has replied */
+static void
+obelisk_stream_maybe_close(obelisk_stream_conn_t *conn)
+{
+    if (!conn->eof || conn->pending) {
+        return;
+    }
+
+    if (conn->bev) {
+        /* the write callback comes back once the output has drained */
+        if (evbuffer_get_length(bufferevent_get_output(conn->bev))) {
+            return;
+        }
+        bufferevent_free(conn->bev);
+    }
+    free(conn);
+}
+
+/* Has the client sent more than it reads */
+static int
+obelisk_stream_throttled(obelisk_stream_conn_t *conn)
+{
+    return evbuffer_get_length(bufferevent_get_output(conn->bev)) > OBELISK_STREAM_MAX_BACKLOG ||
+           conn->pending > OBELISK_STREAM_MAX_PENDING;
+}
+
+static void
+obelisk_stream_pause(obelisk_stream_conn_t *conn)
+{
+    conn->paused = 1;
+    bufferevent_disable(conn->bev, EV_READ);
+    bufferevent_setwatermark(conn->bev, EV_WRITE, OBELISK_STREAM_MAX_BACKLOG / 2, 0);
+}
+
+/* Pick up the lines left in the input and read again */
+static void
+obelisk_stream_resume(obelisk_stream_conn_t *conn)
+{
+    if (!conn->paused || conn->eof || !conn->bev ||
+        evbuffer_get_length(bufferevent_get_output(conn->bev)) > OBELISK_STREAM_MAX_BACKLOG / 2 ||
+        conn->pending > OBELISK_STREAM_MAX_PENDING / 2) {
+        return;
+    }
+
+    conn->paused = 0;
+    bufferevent_setwatermark(conn->bev, EV_WRITE, 0, 0);
+    obelisk_stream_process(conn, conn->final);
+    if (conn->paused) {
+        return;
+    }
+    if (conn->final) {
+        conn->eof = 1;
+    }
+    else if (!conn->eof) {
+        bufferevent_enable(conn->bev, EV_READ);
+    }
+}
+
+static void
+obelisk_stream_reply(obelisk_request_t *r, struct evbuffer *body)
+{
+    obelisk_stream_conn_t *conn = (obelisk_stream_conn_t*) r->transport;
+
+    conn->pending--;
+    if (conn->bev && evbuffer_get_length(body)) {
+        struct evbuffer *output = bufferevent_get_output(conn->bev);
+        size_t len = evbuffer_get_length(body);
+
+        if (len < OBELISK_STREAM_COPY) {
+            evbuffer_add(output, evbuffer_pullup(body, -1), len);
+        }
+        else {
+            evbuffer_add_buffer(output, body);
+        }
+        evbuffer_add(output, "\n", 1);
+    }
+    obelisk_stream_resume(conn);
+    obelisk_stream_maybe_close(conn);
+}
+
+/**
+ * @brief Run every complete line of the input as a request
+ * @param final treat a trailing line without newline as complete
+ */
+static void
+obelisk_stream_process(obelisk_stream_conn_t *conn, int final)
+{
+    struct evbuffer *input = bufferevent_get_input(conn->bev);
+    size_t max_body = conn->worker->baton->settings->max_body;
+
+    for (;;) {
+        size_t eol_len = 0;
+        size_t len;
+        struct evbuffer *body;
+        obelisk_request_t *r;
+        struct evbuffer_ptr eol = evbuffer_search_eol(input, NULL, &eol_len,
+                                                      EVBUFFER_EOL_CRLF);
+
+        if (eol.pos >= 0) {
+            len = eol.pos;
+        }
+        else if (final && evbuffer_get_length(input)) {
+            len = evbuffer_get_length(input);
+        }
+        else {
+            break;
+        }
+
+        /* the rest waits in the input until replies drain */
+        if (obelisk_stream_throttled(conn)) {
+            obelisk_stream_pause(conn);
+            return;
+        }
+
+        /* blank lines are keep-alives */
+        if (len == 0) {
+            evbuffer_drain(input, eol_len);
+            continue;
+        }
+
+        /* out of memory: leave the line and stop reading, the client
+         * sees the connection close once earlier replies are out */
+        r = obelisk_request_new(conn->worker, obelisk_stream_reply, conn);
+        if (r == NULL) {
+            conn->eof = 1;
+            bufferevent_disable(conn->bev, EV_READ);
+            return;
+        }
+
+        body = evbuffer_new();
+        evbuffer_remove_buffer(input, body, len);
+        evbuffer_drain(input, eol_len);
+
+        conn->pending++;
+        strcpy(r->peer, conn->peer);
+        obelisk_request_run(r, body);
+        evbuffer_free(body);
+    }
+
+    /* A line that can never fit is answered once, then the connection
+     * is closed */
+    if (max_body && evbuffer_get_length(input) > max_body) {
+        obelisk_request_t *r = obelisk_request_new(conn->worker, obelisk_stream_reply, conn);
+
+        conn->eof = 1;
+        bufferevent_disable(conn->bev, EV_READ);
+        evbuffer_drain(input, evbuffer_get_length(input));
+
+        if (r) {
+            conn->pending++;
+            strcpy(r->peer, conn->peer);
+            obelisk_request_fail(r, OBELISK_ERROR_INVALID_REQUEST, "Request Too Large");
+        }
+    }
+}
+
+static void
+obelisk_stream_read_cb(struct bufferevent *bev, void *arg)
+{
+    obelisk_stream_conn_t *conn = (obelisk_stream_conn_t*) arg;
+
+    obelisk_stream_process(conn, 0);
+    obelisk_stream_maybe_close(conn);
+}
+
+/* Called once the output drains to the write low-watermark */
+static void
+obelisk_stream_write_cb(struct bufferevent *bev, void *arg)
+{
+    obelisk_stream_conn_t *conn = (obelisk_stream_conn_t*) arg;
+
+    obelisk_stream_resume(conn);
+    obelisk_stream_maybe_close(conn);
+}
+
+static void
+obelisk_stream_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+    obelisk_stream_conn_t *conn = (obelisk_stream_conn_t*) arg;
+
+    if (what & BEV_EVENT_EOF) {
+        /* finish what the client sent, then close once replies are out */
+        bufferevent_disable(bev, EV_READ);
+        if (!conn->eof) {
+            obelisk_stream_process(conn, 1);
+            if (conn->paused) {
+                /* the remaining lines are run by obelisk_stream_resume() */
+                conn->final = 1;
+                return;
+            }
+        }
+        conn->eof = 1;
+    }
+    else if (what & BEV_EVENT_ERROR) {
+        bufferevent_free(bev);
+        conn->bev = NULL;
+        conn->eof = 1;
+    }
+    else {
+        return;
+    }
+
+    obelisk_stream_maybe_close(conn);
+}
+
+static void
+obelisk_stream_accept_cb(struct evconnlistener *listener,
+                         evutil_socket_t fd,
+                         struct sockaddr *sa,
+                         int socklen,
+                         void *arg)
+{
+    obelisk_worker_t *worker = (obelisk_worker_t*) arg;
+    obelisk_stream_conn_t *conn = calloc(1, sizeof(obelisk_stream_conn_t));
+    /* numeric only, so "host:port" always fits the peer */
+    char host[INET6_ADDRSTRLEN];
+    char serv[8];
+
+    conn->worker = worker;
+    conn->bev = bufferevent_socket_new(worker->base, fd, BEV_OPT_CLOSE_ON_FREE);
+
+    if (sa->sa_family != AF_UNIX &&
+        getnameinfo(sa, socklen, host, sizeof(host), serv, sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+        snprintf(conn->peer, sizeof(conn->peer), "%s:%s", host, serv);
+    }
+    else {
+        strcpy(conn->peer, "unix");
+    }
+
+    bufferevent_setcb(conn->bev, obelisk_stream_read_cb, obelisk_stream_write_cb,
+                      obelisk_stream_event_cb, conn);
+    bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+}
+
+int
+obelisk_stream_listen(obelisk_worker_t *worker, evutil_socket_t fd)
+{
+    struct evconnlistener *listener;
+
+    /* the socket is already listening, hence a backlog of 0 */
+    listener = evconnlistener_new(worker->base, obelisk_stream_accept_cb, worker,
+                                  LEV_OPT_CLOSE_ON_FREE, 0, fd);
+    return listener ? 0 : -1;
+}
+
+evutil_socket_t
+obelisk_stream_unix_socket(const char *path)
+{
+    struct sockaddr_un sun;
+    struct stat st;
+    evutil_socket_t fd;
+
+    if (strlen(path) >= sizeof(sun.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    /* only a socket left behind by an earlier run is replaced */
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            errno = EEXIST;
+            return -1;
+        }
+        unlink(path);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr*) &sun, sizeof(sun)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        evutil_closesocket(fd);
+        return -1;
+    }
+
+    evutil_make_socket_nonblocking(fd);
+    return fd;
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "obelisk.h"
+#include "obelisk_json.h"
+#include "obelisk_trace.h"
+#include "obelisk_worker.h"
+
+void
+obelisk_trace_init(obelisk_trace_t *trace, size_t size)
+{
+    memset(trace, 0, sizeof(*trace));
+    pthread_mutex_init(&trace->lock, NULL);
+    if (size) {
+        trace->events = calloc(size, sizeof(obelisk_trace_event_t));
+        trace->size = trace->events ? size : 0;
+    }
+}
+
+void
+obelisk_trace_add(obelisk_trace_t *trace, uint64_t id, const char *cat,
+                  const char *name, uint64_t start, uint64_t end)
+{
+    obelisk_trace_event_t *ev;
+
+    pthread_mutex_lock(&trace->lock);
+    ev = &trace->events[trace->head++ % trace->size];
+    ev->cat = cat;
+    ev->name = name;
+    ev->id = id;
+    ev->start = start;
+    ev->dur = end - start;
+    pthread_mutex_unlock(&trace->lock);
+}
+
+static void
+obelisk_trace_dump(struct evbuffer *evb, obelisk_trace_t *trace,
+                   unsigned int tid, int *first)
+{
+    uint64_t i;
+    uint64_t tail;
+
+    pthread_mutex_lock(&trace->lock);
+    tail = trace->head > trace->size ? trace->head - trace->size : 0;
+    for (i=tail; i<trace->head; i++) {
+        obelisk_trace_event_t *ev = &trace->events[i % trace->size];
+        obelisk_writer_t w;
+
+        /* any string can be registered as a method name */
+        evbuffer_add_printf(evb, "%s{\"name\":", *first ? "" : ",\n");
+        obelisk_writer_init(&w, evb);
+        obelisk_writer_string(&w, ev->name);
+        obelisk_writer_finish(&w);
+
+        evbuffer_add_printf(evb,
+            ",\"cat\":\"%s\",\"ph\":\"X\","
+            "\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"pid\":%d,\"tid\":%u,"
+            "\"args\":{\"request\":%llu}}",
+            ev->cat,
+            (unsigned long long) (ev->start / 1000), (unsigned int) (ev->start % 1000),
+            (unsigned long long) (ev->dur / 1000), (unsigned int) (ev->dur % 1000),
+            (int) getpid(), tid, (unsigned long long) ev->id);
+        *first = 0;
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+void
+obelisk_trace_http_cb(struct evhttp_request *req, void *arg)
+{
+    obelisk_worker_t *worker = (obelisk_worker_t*) arg;
+    obelisk_baton_t *baton = worker->baton;
+    struct evbuffer *evb = evbuffer_new();
+    unsigned int i;
+    int first = 1;
+
+    evbuffer_add_printf(evb, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (i=0; i<baton->nworkers; i++) {
+        if (baton->workers[i].trace.size) {
+            obelisk_trace_dump(evb, &baton->workers[i].trace, i, &first);
+        }
+    }
+    evbuffer_add_printf(evb, "\n]}\n");
+
+    evhttp_add_header(evhttp_request_get_output_headers(req),
+                      "Content-Type", "application/json");
+    evhttp_send_reply(req, HTTP_OK, "OK", evb);
+    evbuffer_free(evb);
+}
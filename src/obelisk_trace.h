@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_TRACE_H_
+#define OBELISK_TRACE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+/* events kept per worker, older ones are overwritten */
+#define OBELISK_DEFAULT_TRACE_EVENTS 8192
+
+/* One completed stage of a sampled request.  Names are static strings or
+ * registered method names, both outlive the ring. */
+typedef struct {
+    const char *cat;
+    const char *name;
+    uint64_t id;
+    uint64_t start;
+    uint64_t dur;
+} obelisk_trace_event_t;
+
+/* Per-worker ring.  The lock is only taken for sampled requests and by
+ * /trace, so untraced requests never touch it. */
+typedef struct {
+    pthread_mutex_t lock;
+    obelisk_trace_event_t *events;
+    size_t size;
+    uint64_t head;
+    uint64_t seq;
+} obelisk_trace_t;
+
+void
+obelisk_trace_init(obelisk_trace_t *trace, size_t size);
+
+/**
+ * @brief Decide whether the next request is traced
+ * @param rate trace one request in rate, 0 disables tracing
+ * @return a non-zero trace id if the request is sampled
+ */
+static inline uint64_t
+obelisk_trace_sample(obelisk_trace_t *trace, unsigned int rate)
+{
+    if (rate == 0 || trace->size == 0) {
+        return 0;
+    }
+    return (++trace->seq % rate) == 0 ? trace->seq : 0;
+}
+
+void
+obelisk_trace_add(obelisk_trace_t *trace, uint64_t id, const char *cat,
+                  const char *name, uint64_t start, uint64_t end);
+
+/* evhttp callback dumping every worker's ring as Chrome trace-event JSON */
+struct evhttp_request;
+
+void
+obelisk_trace_http_cb(struct evhttp_request *req, void *arg);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_WORKER_H_
+#define OBELISK_WORKER_H_
+
+#include <pthread.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include "obelisk.h"
+#include "obelisk_capture.h"
+#include "obelisk_flight.h"
+#include "obelisk_log.h"
+#include "obelisk_stats.h"
+#include "obelisk_trace.h"
+
+/* Each worker owns one event loop and one evhttp.  The baton is shared
+ * between all workers and must be treated as read-only once running. */
+typedef struct obelisk_worker_s {
+    obelisk_baton_t *baton;
+    struct event_base *base;
+    struct evhttp *http;
+    pthread_t thread;
+    unsigned int index;
+
+    /* jobs finished by the blocking-handler pool */
+    struct obelisk_job_s * volatile completed;
+    int notify[2];
+    struct event *notify_ev;
+
+    obelisk_stats_t stats;
+    obelisk_trace_t trace;
+    obelisk_log_ring_t log;
+    obelisk_capture_ring_t capture;
+
+    /* coalescable calls running on this loop */
+    obelisk_flight_t flight;
+} obelisk_worker_t;
+
+#endif
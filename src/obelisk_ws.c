@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include <event2/http_struct.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "obelisk.h"
+#include "obelisk_json.h"
+#include "obelisk_request.h"
+#include "obelisk_ws.h"
+
+#define OBELISK_WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/* pushes are refused once this much output is queued for a slow client */
+#define OBELISK_WS_MAX_BACKLOG (16 * 1024 * 1024)
+
+/* The session keeps the evhttp connection it was upgraded from, with its
+ * bufferevent taken over, and frees it once closed. */
+struct obelisk_session_s {
+    obelisk_worker_t *worker;
+    struct evhttp_connection *evcon;
+    struct bufferevent *bev;
+    char peer[64];
+
+    /* data frames of the message being received */
+    struct evbuffer *message;
+    int message_op;
+
+    /* requests not replied to yet, and handler references */
+    size_t pending;
+    unsigned int refs;
+
+    /* nothing is read or written any more */
+    int closed;
+};
+
+/* SHA-1 of at most 119 bytes, all the handshake needs */
+static void
+obelisk_ws_sha1(const unsigned char *data, size_t len, unsigned char *out)
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned char msg[128];
+    size_t total = (len + 8) / 64 * 64 + 64;
+    uint64_t bits = (uint64_t) len * 8;
+    size_t blk;
+    int i;
+
+    memset(msg, 0, total);
+    memcpy(msg, data, len);
+    msg[len] = 0x80;
+    for (i=0; i<8; i++) {
+        msg[total - 1 - i] = (unsigned char) (bits >> (8 * i));
+    }
+
+#define OBELISK_ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+    for (blk=0; blk<total; blk+=64) {
+        uint32_t w[80];
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+
+        for (i=0; i<16; i++) {
+            w[i] = (uint32_t) msg[blk + 4 * i] << 24 | (uint32_t) msg[blk + 4 * i + 1] << 16 |
+                   (uint32_t) msg[blk + 4 * i + 2] << 8 | msg[blk + 4 * i + 3];
+        }
+        for (i=16; i<80; i++) {
+            w[i] = OBELISK_ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+
+        for (i=0; i<80; i++) {
+            uint32_t f, k, t;
+
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            t = OBELISK_ROL(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = OBELISK_ROL(b, 30);
+            b = a;
+            a = t;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+#undef OBELISK_ROL
+
+    for (i=0; i<20; i++) {
+        out[i] = (unsigned char) (h[i / 4] >> (24 - 8 * (i % 4)));
+    }
+}
+
+/* Sec-WebSocket-Accept for key, 28 characters and a NUL */
+static void
+obelisk_ws_accept(const char *key, char *out)
+{
+    static const char b64[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    unsigned char buf[128];
+    unsigned char digest[21];
+    size_t len = strlen(key);
+    int i;
+
+    memcpy(buf, key, len);
+    memcpy(buf + len, OBELISK_WS_GUID, sizeof(OBELISK_WS_GUID) - 1);
+    obelisk_ws_sha1(buf, len + sizeof(OBELISK_WS_GUID) - 1, digest);
+    digest[20] = 0;
+
+    for (i=0; i<7; i++) {
+        uint32_t v = (uint32_t) digest[3 * i] << 16 | (uint32_t) digest[3 * i + 1] << 8 |
+                     digest[3 * i + 2];
+
+        out[4 * i] = b64[(v >> 18) & 0x3f];
+        out[4 * i + 1] = b64[(v >> 12) & 0x3f];
+        out[4 * i + 2] = b64[(v >> 6) & 0x3f];
+        out[4 * i + 3] = b64[v & 0x3f];
+    }
+    /* 20 bytes encode to 27 characters and one '=' */
+    out[27] = '=';
+    out[28] = '\0';
+}
+
+static void
+obelisk_ws_send(obelisk_session_t *s, int op, struct evbuffer *payload)
+{
+    struct evbuffer *output = bufferevent_get_output(s->bev);
+    uint64_t len = evbuffer_get_length(payload);
+    unsigned char hdr[10];
+    size_t n = 2;
+    int i;
+
+    hdr[0] = 0x80 | op;
+    if (len < 126) {
+        hdr[1] = (unsigned char) len;
+    }
+    else if (len <= 0xffff) {
+        hdr[1] = 126;
+        hdr[2] = (unsigned char) (len >> 8);
+        hdr[3] = (unsigned char) len;
+        n = 4;
+    }
+    else {
+        hdr[1] = 127;
+        for (i=0; i<8; i++) {
+            hdr[2 + i] = (unsigned char) (len >> (56 - 8 * i));
+        }
+        n = 10;
+    }
+
+    evbuffer_add(output, hdr, n);
+    evbuffer_add_buffer(output, payload);
+}
+
+static void
+obelisk_ws_send_control(obelisk_session_t *s, int op, const void *data, size_t len)
+{
+    struct evbuffer *payload = evbuffer_new();
+
+    evbuffer_add(payload, data, len);
+    obelisk_ws_send(s, op, payload);
+    evbuffer_free(payload);
+}
+
+/* The session outlives its socket until every request has replied and
+ * every handler reference is gone */
+static void
+obelisk_ws_maybe_free(obelisk_session_t *s)
+{
+    if (!s->closed) {
+        return;
+    }
+
+    if (s->evcon) {
+        /* the write callback comes back once the output has drained */
+        if (evbuffer_get_length(bufferevent_get_output(s->bev))) {
+            return;
+        }
+        evhttp_connection_free(s->evcon);
+        s->evcon = NULL;
+        s->bev = NULL;
+    }
+
+    if (s->pending == 0 && s->refs == 0) {
+        evbuffer_free(s->message);
+        free(s);
+    }
+}
+
+static void
+obelisk_ws_close(obelisk_session_t *s, unsigned short code)
+{
+    unsigned char payload[2];
+
+    payload[0] = (unsigned char) (code >> 8);
+    payload[1] = (unsigned char) code;
+    obelisk_ws_send_control(s, OBELISK_WS_CLOSE, payload, 2);
+
+    s->closed = 1;
+    bufferevent_disable(s->bev, EV_READ);
+    obelisk_ws_maybe_free(s);
+}
+
+static void
+obelisk_ws_reply(obelisk_request_t *r, struct evbuffer *body)
+{
+    obelisk_session_t *s = (obelisk_session_t*) r->transport;
+
+    s->pending--;
+    if (!s->closed && evbuffer_get_length(body)) {
+        obelisk_ws_send(s, r->format == OBELISK_FORMAT_MSGPACK ? OBELISK_WS_BINARY
+                                                               : OBELISK_WS_TEXT, body);
+    }
+    obelisk_ws_maybe_free(s);
+}
+
+/**
+ * @brief Run a complete message as a request, its reply may come at any
+ * time
+ * @return 0, or -1 after closing the session when out of memory
+ */
+static int
+obelisk_ws_message(obelisk_session_t *s)
+{
+    obelisk_request_t *r = obelisk_request_new(s->worker, obelisk_ws_reply, s);
+
+    if (r == NULL) {
+        obelisk_ws_close(s, OBELISK_WS_INTERNAL_ERROR);
+        return -1;
+    }
+
+    strcpy(r->peer, s->peer);
+    r->session = s;
+    if (s->message_op == OBELISK_WS_BINARY) {
+        r->format = OBELISK_FORMAT_MSGPACK;
+    }
+
+    s->pending++;
+    obelisk_request_run(r, s->message);
+    evbuffer_drain(s->message, evbuffer_get_length(s->message));
+    s->message_op = 0;
+    return 0;
+}
+
+/**
+ * @brief Move len payload bytes to the message, unmasking on the way
+ * @return 0, or -1 when the message could not grow
+ */
+static int
+obelisk_ws_payload(obelisk_session_t *s, struct evbuffer *input, size_t len,
+                   const unsigned char *mask)
+{
+    struct evbuffer_iovec vec;
+    unsigned char *data;
+    size_t i;
+
+    if (len == 0) {
+        return 0;
+    }
+
+    if (evbuffer_reserve_space(s->message, len, &vec, 1) < 1) {
+        return -1;
+    }
+    data = (unsigned char*) vec.iov_base;
+    evbuffer_remove(input, data, len);
+    for (i=0; i<len; i++) {
+        data[i] ^= mask[i & 3];
+    }
+    vec.iov_len = len;
+    evbuffer_commit_space(s->message, &vec, 1);
+    return 0;
+}
+
+int
+obelisk_ws_frame_parse(const unsigned char *hdr, size_t avail, size_t message_len,
+                       int message_op, size_t max_body, obelisk_ws_frame_t *frame)
+{
+    uint64_t len;
+    int i;
+
+    if (avail < 2) {
+        return 0;
+    }
+    frame->fin = (hdr[0] & 0x80) != 0;
+    frame->op = hdr[0] & 0x0f;
+    frame->off = 2;
+    len = hdr[1] & 0x7f;
+
+    /* clients mask every frame, and no extensions were agreed on */
+    if (!(hdr[1] & 0x80) || (hdr[0] & 0x70)) {
+        return OBELISK_WS_PROTOCOL_ERROR;
+    }
+
+    if (len == 126) {
+        frame->off = 4;
+        if (avail < frame->off) return 0;
+        len = (uint64_t) hdr[2] << 8 | hdr[3];
+    }
+    else if (len == 127) {
+        frame->off = 10;
+        if (avail < frame->off) return 0;
+        /* the most significant bit must be 0 */
+        if (hdr[2] & 0x80) {
+            return OBELISK_WS_PROTOCOL_ERROR;
+        }
+        len = 0;
+        for (i=0; i<8; i++) {
+            len = len << 8 | hdr[2 + i];
+        }
+    }
+    frame->off += 4;
+    frame->len = len;
+
+    if (frame->op & 0x08) {
+        if (!frame->fin || len > 125 || frame->op > OBELISK_WS_PONG) {
+            return OBELISK_WS_PROTOCOL_ERROR;
+        }
+    }
+    else if ((frame->op == OBELISK_WS_CONTINUATION) != (message_op != 0) ||
+             frame->op > OBELISK_WS_BINARY) {
+        /* a continuation needs a message to continue, and vice versa */
+        return OBELISK_WS_PROTOCOL_ERROR;
+    }
+    else if (len > SIZE_MAX - message_len ||
+             (max_body && (message_len > max_body || len > max_body - message_len))) {
+        return OBELISK_WS_TOO_BIG;
+    }
+
+    if (avail < frame->off || len > avail - frame->off) {
+        return 0;
+    }
+    memcpy(frame->mask, hdr + frame->off - 4, 4);
+    return 1;
+}
+
+static void
+obelisk_ws_read_cb(struct bufferevent *bev, void *arg)
+{
+    obelisk_session_t *s = (obelisk_session_t*) arg;
+    struct evbuffer *input = bufferevent_get_input(bev);
+    size_t max_body = s->worker->baton->settings->max_body;
+
+    for (;;) {
+        unsigned char hdr[OBELISK_WS_MAX_HEADER];
+        obelisk_ws_frame_t frame;
+        size_t avail = evbuffer_get_length(input);
+        int rc;
+
+        evbuffer_copyout(input, hdr, avail < sizeof(hdr) ? avail : sizeof(hdr));
+        rc = obelisk_ws_frame_parse(hdr, avail, evbuffer_get_length(s->message),
+                                    s->message_op, max_body, &frame);
+        if (rc == 0) {
+            return;
+        }
+        if (rc != 1) {
+            obelisk_ws_close(s, rc);
+            return;
+        }
+        evbuffer_drain(input, frame.off);
+
+        if (frame.op & 0x08) {
+            unsigned char payload[125];
+            size_t j;
+
+            evbuffer_remove(input, payload, frame.len);
+            for (j=0; j<frame.len; j++) {
+                payload[j] ^= frame.mask[j & 3];
+            }
+
+            if (frame.op == OBELISK_WS_CLOSE) {
+                obelisk_ws_close(s, OBELISK_WS_NORMAL);
+                return;
+            }
+            if (frame.op == OBELISK_WS_PING) {
+                obelisk_ws_send_control(s, OBELISK_WS_PONG, payload, frame.len);
+            }
+            /* unsolicited pongs are ignored */
+            continue;
+        }
+
+        if (frame.op != OBELISK_WS_CONTINUATION) {
+            s->message_op = frame.op;
+        }
+        if (obelisk_ws_payload(s, input, frame.len, frame.mask) < 0) {
+            obelisk_ws_close(s, OBELISK_WS_INTERNAL_ERROR);
+            return;
+        }
+        if (frame.fin && obelisk_ws_message(s) < 0) {
+            return;
+        }
+    }
+}
+
+static void
+obelisk_ws_write_cb(struct bufferevent *bev, void *arg)
+{
+    obelisk_ws_maybe_free((obelisk_session_t*) arg);
+}
+
+static void
+obelisk_ws_event_cb(struct bufferevent *bev, short what, void *arg)
+{
+    obelisk_session_t *s = (obelisk_session_t*) arg;
+
+    if (!(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))) {
+        return;
+    }
+
+    /* gone without a close handshake, drop whatever is queued */
+    evbuffer_drain(bufferevent_get_output(bev), evbuffer_get_length(bufferevent_get_output(bev)));
+    s->closed = 1;
+    obelisk_ws_maybe_free(s);
+}
+
+void
+obelisk_ws_cb(struct evhttp_request *req, void *arg)
+{
+    obelisk_worker_t *worker = (obelisk_worker_t*) arg;
+    struct evkeyvalq *headers = evhttp_request_get_input_headers(req);
+    const char *upgrade = evhttp_find_header(headers, "Upgrade");
+    const char *key = evhttp_find_header(headers, "Sec-WebSocket-Key");
+    const char *version = evhttp_find_header(headers, "Sec-WebSocket-Version");
+    obelisk_session_t *s;
+    char accept[32];
+
+    if (req->type != EVHTTP_REQ_GET || upgrade == NULL ||
+        strcasecmp(upgrade, "websocket") != 0 || key == NULL || strlen(key) > 64) {
+        evhttp_send_error(req, HTTP_BADREQUEST, "WebSocket Upgrade Required");
+        return;
+    }
+    if (version == NULL || strcmp(version, "13") != 0) {
+        evhttp_add_header(evhttp_request_get_output_headers(req),
+                          "Sec-WebSocket-Version", "13");
+        evhttp_send_error(req, 426, "Upgrade Required");
+        return;
+    }
+
+    s = calloc(1, sizeof(obelisk_session_t));
+    s->worker = worker;
+    s->evcon = evhttp_request_get_connection(req);
+    s->bev = evhttp_connection_get_bufferevent(s->evcon);
+    s->message = evbuffer_new();
+    snprintf(s->peer, sizeof(s->peer), "%s:%i",
+             (req->remote_host) ? req->remote_host : "0.0.0.0",
+             req->remote_port);
+
+    /* The request is never answered through evhttp: its bufferevent is
+     * taken over and the connection stays idle until freed with the
+     * session.  Long-lived sessions have no timeouts. */
+    bufferevent_setcb(s->bev, obelisk_ws_read_cb, obelisk_ws_write_cb,
+                      obelisk_ws_event_cb, s);
+    bufferevent_set_timeouts(s->bev, NULL, NULL);
+    bufferevent_setwatermark(s->bev, EV_READ | EV_WRITE, 0, 0);
+
+    obelisk_ws_accept(key, accept);
+    evbuffer_add_printf(bufferevent_get_output(s->bev),
+                        "HTTP/1.1 101 Switching Protocols\r\n"
+                        "Upgrade: websocket\r\n"
+                        "Connection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: %s\r\n"
+                        "\r\n", accept);
+    bufferevent_enable(s->bev, EV_READ | EV_WRITE);
+}
+
+void
+obelisk_session_retain(obelisk_session_t *s)
+{
+    s->refs++;
+}
+
+void
+obelisk_session_release(obelisk_session_t *s)
+{
+    s->refs--;
+    obelisk_ws_maybe_free(s);
+}
+
+int
+obelisk_session_notify(obelisk_session_t *s, const char *method, json_t *params)
+{
+    struct evbuffer *body;
+    obelisk_writer_t w;
+    json_t *note;
+
+    if (s->closed ||
+        evbuffer_get_length(bufferevent_get_output(s->bev)) > OBELISK_WS_MAX_BACKLOG) {
+        json_decref(params);
+        return -1;
+    }
+
+    note = json_object();
+    json_object_set_new(note, "jsonrpc", json_string("2.0"));
+    json_object_set_new(note, "method", json_string(method));
+    if (params) {
+        json_object_set_new(note, "params", params);
+    }
+
+    body = evbuffer_new();
+    obelisk_writer_init(&w, body);
+    obelisk_writer_json(&w, note);
+    obelisk_writer_finish(&w);
+    obelisk_ws_send(s, OBELISK_WS_TEXT, body);
+
+    evbuffer_free(body);
+    json_decref(note);
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef OBELISK_WS_H_
+#define OBELISK_WS_H_
+
+#include <stdint.h>
+#include <event2/http.h>
+#include "obelisk_worker.h"
+
+/* JSON-RPC over WebSocket (RFC 6455).  Every text message is a request
+ * or batch, binary messages carry MessagePack.  Calls on one connection
+ * run concurrently and are answered as they complete, so clients match
+ * replies by id; handlers may push notifications through the session. */
+
+#define OBELISK_WS_CONTINUATION 0x0
+#define OBELISK_WS_TEXT 0x1
+#define OBELISK_WS_BINARY 0x2
+#define OBELISK_WS_CLOSE 0x8
+#define OBELISK_WS_PING 0x9
+#define OBELISK_WS_PONG 0xA
+
+#define OBELISK_WS_NORMAL 1000
+#define OBELISK_WS_PROTOCOL_ERROR 1002
+#define OBELISK_WS_TOO_BIG 1009
+#define OBELISK_WS_INTERNAL_ERROR 1011
+
+/* 2 bytes, a 64-bit length and the mask */
+#define OBELISK_WS_MAX_HEADER 14
+
+/* A client frame header, see obelisk_ws_frame_parse() */
+typedef struct {
+    int fin;
+    int op;
+    uint64_t len;
+    size_t off;
+    unsigned char mask[4];
+} obelisk_ws_frame_t;
+
+/**
+ * @brief Parse and check the frame at the start of the input
+ * @param hdr the first min(avail, OBELISK_WS_MAX_HEADER) input bytes
+ * @param avail bytes of input buffered
+ * @param message_len payload bytes of the message received so far
+ * @param message_op opcode of that message, 0 between messages
+ * @param max_body message size limit, 0 is unlimited
+ * @param frame filled in, off being the header length
+ * @return 1 when the whole frame is buffered, 0 when more input is
+ * needed, otherwise the close code to fail the connection with
+ */
+int
+obelisk_ws_frame_parse(const unsigned char *hdr, size_t avail, size_t message_len,
+                       int message_op, size_t max_body, obelisk_ws_frame_t *frame);
+
+/* evhttp callback upgrading a GET to a WebSocket session */
+void
+obelisk_ws_cb(struct evhttp_request *req, void *arg);
+
+#endif
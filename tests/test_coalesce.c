@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Coalesced calls are shed on their own deadline, not the leader's */
+
+#include <jansson.h>
+#include <string.h>
+#include <time.h>
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include "obelisk.h"
+#include "obelisk_dispatch.h"
+#include "obelisk_request.h"
+#include "obelisk_test.h"
+
+#define TEST_REPLY 512
+
+static obelisk_call_t *slow_calls[4];
+static int nslow;
+static obelisk_call_t *hold_call;
+
+static obelisk_error_t*
+test_slow_cb(json_t *params, obelisk_call_t *call)
+{
+    slow_calls[nslow++] = call;
+    return OBELISK_SUCCESS;
+}
+
+static obelisk_error_t*
+test_hold_cb(json_t *params, obelisk_call_t *call)
+{
+    hold_call = call;
+    return OBELISK_SUCCESS;
+}
+
+static void
+test_reply(obelisk_request_t *r, struct evbuffer *body)
+{
+    char *out = (char*) r->transport;
+    size_t len = evbuffer_get_length(body);
+
+    if (len >= TEST_REPLY) {
+        len = TEST_REPLY - 1;
+    }
+    evbuffer_remove(body, out, len);
+    out[len] = '\0';
+}
+
+static void
+test_run(obelisk_worker_t *worker, char *reply, unsigned int timeout_ms, const char *body)
+{
+    obelisk_request_t *r = obelisk_request_new(worker, test_reply, reply);
+    struct evbuffer *buf = evbuffer_new();
+
+    reply[0] = '\0';
+    obelisk_request_set_timeout(r, timeout_ms);
+    evbuffer_add(buf, body, strlen(body));
+    obelisk_request_run(r, buf);
+    evbuffer_free(buf);
+}
+
+int
+main(int argc, char **argv)
+{
+    static obelisk_rpc_t methods[] = {
+        {"hold", NULL, test_hold_cb, 0, 0, 0},
+        {"slow", NULL, test_slow_cb, OBELISK_RPC_COALESCE, 0, 0}
+    };
+    struct timespec ts = {0, 5 * 1000000L};
+    obelisk_settings_t settings;
+    obelisk_baton_t baton;
+    obelisk_worker_t worker;
+    char leader[TEST_REPLY];
+    char expired[TEST_REPLY];
+    char waiter[TEST_REPLY];
+    size_t i;
+
+    obelisk_init(&settings);
+    settings.batch_parallel = 1;
+    memset(&baton, 0, sizeof(baton));
+    baton.settings = &settings;
+    for (i=0; i<sizeof(methods) / sizeof(methods[0]); i++) {
+        obelisk_register_method(&baton, &methods[i]);
+    }
+    obelisk_dispatch_build(baton.dispatch);
+
+    memset(&worker, 0, sizeof(worker));
+    worker.baton = &baton;
+    worker.base = event_base_new();
+    obelisk_stats_init(&worker.stats, baton.dispatch->count);
+    obelisk_trace_init(&worker.trace, 0);
+    baton.workers = &worker;
+    baton.nworkers = 1;
+
+    /* the leader runs with a deadline well ahead */
+    test_run(&worker, leader, 60000,
+             "{\"jsonrpc\":\"2.0\",\"method\":\"slow\",\"params\":[1],\"id\":1}");
+    OBELISK_CHECK(nslow == 1 && leader[0] == '\0');
+    OBELISK_CHECK(slow_calls[0]->deadline != 0);
+
+    /* the second element of this batch only starts after its deadline */
+    test_run(&worker, expired, 1,
+             "[{\"jsonrpc\":\"2.0\",\"method\":\"hold\",\"params\":[],\"id\":2},"
+             "{\"jsonrpc\":\"2.0\",\"method\":\"slow\",\"params\":[1],\"id\":3}]");
+    OBELISK_CHECK(hold_call != NULL && expired[0] == '\0');
+    nanosleep(&ts, NULL);
+    obelisk_call_complete(hold_call, OBELISK_SUCCESS, json_integer(0));
+    OBELISK_CHECK(strstr(expired, "deadline exceeded") != NULL);
+    OBELISK_CHECK(strstr(expired, "\"id\":3") != NULL);
+
+    /* a waiter without a deadline lifts the leader's */
+    test_run(&worker, waiter, 0,
+             "{\"jsonrpc\":\"2.0\",\"method\":\"slow\",\"params\":[1],\"id\":4}");
+    OBELISK_CHECK(nslow == 1 && waiter[0] == '\0');
+    OBELISK_CHECK(slow_calls[0]->deadline == 0);
+
+    obelisk_call_complete(slow_calls[0], OBELISK_SUCCESS, json_integer(42));
+    OBELISK_CHECK(strstr(leader, "\"result\":42") != NULL);
+    OBELISK_CHECK(strstr(leader, "\"id\":1") != NULL);
+    OBELISK_CHECK(strstr(waiter, "\"result\":42") != NULL);
+    OBELISK_CHECK(strstr(waiter, "\"id\":4") != NULL);
+
+    return OBELISK_TEST_EXIT();
+}
@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Method registration and lookups in the frozen dispatch table */
+
+#include <jansson.h>
+#include <stdio.h>
+#include <string.h>
+#include "obelisk.h"
+#include "obelisk_dispatch.h"
+#include "obelisk_test.h"
+
+#define TEST_METHODS 100
+
+static obelisk_error_t*
+test_cb(json_t *params, json_t **response)
+{
+    return OBELISK_SUCCESS;
+}
+
+static obelisk_error_t*
+test_async_cb(json_t *params, obelisk_call_t *call)
+{
+    return OBELISK_SUCCESS;
+}
+
+int
+main(int argc, char **argv)
+{
+    static char names[TEST_METHODS][16];
+    obelisk_baton_t baton;
+    obelisk_rpc_t rpc;
+    const obelisk_rpc_t *found;
+    int i;
+
+    memset(&baton, 0, sizeof(baton));
+    memset(&rpc, 0, sizeof(rpc));
+
+    rpc.method = "time";
+    rpc.cb = test_cb;
+    OBELISK_CHECK(obelisk_register_method(&baton, &rpc) == 0);
+    OBELISK_CHECK(obelisk_register_method(&baton, &rpc) < 0);
+
+    /* the pool can only run cb handlers */
+    rpc.method = "slow";
+    rpc.cb = NULL;
+    rpc.async_cb = test_async_cb;
+    rpc.flags = OBELISK_RPC_BLOCKING;
+    OBELISK_CHECK(obelisk_register_method(&baton, &rpc) < 0);
+    rpc.flags = 0;
+    OBELISK_CHECK(obelisk_register_method(&baton, &rpc) == 0);
+
+    rpc.async_cb = NULL;
+    rpc.method = "none";
+    OBELISK_CHECK(obelisk_register_method(&baton, &rpc) < 0);
+    rpc.method = NULL;
+    rpc.cb = test_cb;
+    OBELISK_CHECK(obelisk_register_method(&baton, &rpc) < 0);
+
+    /* enough methods for probe chains */
+    for (i=0; i<TEST_METHODS; i++) {
+        snprintf(names[i], sizeof(names[i]), "m%d", i);
+        rpc.method = names[i];
+        OBELISK_CHECK(obelisk_register_method(&baton, &rpc) == 0);
+    }
+
+    OBELISK_CHECK(obelisk_dispatch_build(baton.dispatch) == 0);
+
+    /* frozen */
+    rpc.method = "late";
+    OBELISK_CHECK(obelisk_register_method(&baton, &rpc) < 0);
+    OBELISK_CHECK(obelisk_dispatch_find(baton.dispatch, "late", 4) == NULL);
+
+    found = obelisk_dispatch_find(baton.dispatch, "time", 4);
+    OBELISK_CHECK(found && strcmp(found->method, "time") == 0);
+    found = obelisk_dispatch_find(baton.dispatch, "slow", 4);
+    OBELISK_CHECK(found && found->async_cb == test_async_cb);
+
+    for (i=0; i<TEST_METHODS; i++) {
+        found = obelisk_dispatch_find(baton.dispatch, names[i], strlen(names[i]));
+        OBELISK_CHECK(found && found->method == names[i]);
+    }
+
+    /* prefixes, extensions and embedded NULs never match */
+    OBELISK_CHECK(obelisk_dispatch_find(baton.dispatch, "tim", 3) == NULL);
+    OBELISK_CHECK(obelisk_dispatch_find(baton.dispatch, "times", 5) == NULL);
+    OBELISK_CHECK(obelisk_dispatch_find(baton.dispatch, "time\0x", 6) == NULL);
+    OBELISK_CHECK(obelisk_dispatch_find(baton.dispatch, "time\0", 5) == NULL);
+    OBELISK_CHECK(obelisk_dispatch_find(baton.dispatch, "", 0) == NULL);
+    OBELISK_CHECK(obelisk_dispatch_find(baton.dispatch, "m100", 4) == NULL);
+
+    return OBELISK_TEST_EXIT();
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* msgpack decoding of truncated and oversize bodies */
+
+#include <jansson.h>
+#include <string.h>
+#include <event2/buffer.h>
+#include "obelisk_msgpack.h"
+#include "obelisk_test.h"
+
+static json_t*
+test_load(const void *data, size_t len, json_error_t *error)
+{
+    struct evbuffer *buf = evbuffer_new();
+    json_t *json;
+
+    evbuffer_add(buf, data, len);
+    json = obelisk_msgpack_load_evbuffer(buf, error);
+    evbuffer_free(buf);
+    return json;
+}
+
+static int
+test_rejects(const void *data, size_t len, const char *text)
+{
+    json_error_t error;
+    json_t *json = test_load(data, len, &error);
+
+    if (json) {
+        json_decref(json);
+        return 0;
+    }
+    return strcmp(error.text, text) == 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    /* {"a": [1, "xy", nil]} */
+    static const unsigned char valid[] = {
+        0x81, 0xa1, 'a', 0x93, 0x01, 0xa2, 'x', 'y', 0xc0
+    };
+    static const unsigned char str32[] = {0xdb, 0xff, 0xff, 0xff, 0xff, 'a'};
+    static const unsigned char bin32[] = {0xc6, 0xff, 0xff, 0xff, 0xff};
+    static const unsigned char str8[] = {0xd9, 0x05, 'a', 'b'};
+    static const unsigned char array32[] = {0xdd, 0xff, 0xff, 0xff, 0xff, 0x01};
+    static const unsigned char map32[] = {0xdf, 0x7f, 0xff, 0xff, 0xff, 0xa1, 'a'};
+    static const unsigned char map_odd[] = {0x82, 0xa1, 'a', 0x01, 0xa1};
+    static const unsigned char trailing[] = {0x01, 0x02};
+    static const unsigned char int32[] = {0xd2, 0x00, 0x01};
+    json_error_t error;
+    json_t *json;
+    size_t i;
+
+    json = test_load(valid, sizeof(valid), &error);
+    OBELISK_CHECK(json != NULL);
+    if (json) {
+        json_t *a = json_object_get(json, "a");
+
+        OBELISK_CHECK(json_array_size(a) == 3);
+        OBELISK_CHECK(json_integer_value(json_array_get(a, 0)) == 1);
+        OBELISK_CHECK(strcmp(json_string_value(json_array_get(a, 1)), "xy") == 0);
+        OBELISK_CHECK(json_is_null(json_array_get(a, 2)));
+        json_decref(json);
+    }
+
+    /* every proper prefix of a valid body is truncated */
+    for (i = 0; i < sizeof(valid); i++) {
+        OBELISK_CHECK(test_rejects(valid, i, "unexpected end of input"));
+    }
+
+    OBELISK_CHECK(test_rejects(str32, sizeof(str32), "unexpected end of input"));
+    OBELISK_CHECK(test_rejects(str8, sizeof(str8), "unexpected end of input"));
+    OBELISK_CHECK(test_rejects(bin32, sizeof(bin32), "unexpected end of input"));
+    OBELISK_CHECK(test_rejects(array32, sizeof(array32), "unexpected end of input"));
+    OBELISK_CHECK(test_rejects(map32, sizeof(map32), "unexpected end of input"));
+    OBELISK_CHECK(test_rejects(map_odd, sizeof(map_odd), "unexpected end of input"));
+    OBELISK_CHECK(test_rejects(int32, sizeof(int32), "unexpected end of input"));
+    OBELISK_CHECK(test_rejects(trailing, sizeof(trailing), "trailing data after value"));
+
+    return OBELISK_TEST_EXIT();
+}
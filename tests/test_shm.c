@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Shared-memory ring copies, and their bounds when the peer lies */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obelisk_shm.h"
+#include "obelisk_test.h"
+
+#define TEST_RING 64
+
+int
+main(int argc, char **argv)
+{
+    obelisk_shm_region_t *region = calloc(1, OBELISK_SHM_REGION_SIZE(TEST_RING));
+    obelisk_shm_view_t producer;
+    obelisk_shm_view_t consumer;
+    obelisk_shm_view_t replies;
+    unsigned char in[3 * TEST_RING];
+    unsigned char out[3 * TEST_RING];
+    size_t i, n;
+
+    for (i=0; i<sizeof(in); i++) {
+        in[i] = (unsigned char) i;
+    }
+
+    region->magic = OBELISK_SHM_MAGIC;
+    region->size = TEST_RING;
+    obelisk_shm_view_init(&producer, region, &region->requests, TEST_RING);
+    obelisk_shm_view_init(&consumer, region, &region->requests, TEST_RING);
+    obelisk_shm_view_init(&replies, region, &region->replies, TEST_RING);
+    OBELISK_CHECK(producer.data == (unsigned char*) (region + 1));
+    OBELISK_CHECK(replies.data == producer.data + TEST_RING);
+
+    /* copies stop at a full ring and only show up once published */
+    OBELISK_CHECK(obelisk_shm_writable(&producer) == TEST_RING);
+    OBELISK_CHECK(obelisk_shm_copyin(&producer, in, sizeof(in)) == TEST_RING);
+    OBELISK_CHECK(obelisk_shm_writable(&producer) == 0);
+    OBELISK_CHECK(obelisk_shm_copyin(&producer, in, 1) == 0);
+    OBELISK_CHECK(obelisk_shm_readable(&consumer) == 0);
+    obelisk_shm_publish(&producer);
+    OBELISK_CHECK(obelisk_shm_readable(&consumer) == TEST_RING);
+
+    /* then wrap around the end of the data, in both directions */
+    OBELISK_CHECK(obelisk_shm_copyout(&consumer, out, 40) == 40);
+    OBELISK_CHECK(memcmp(out, in, 40) == 0);
+    OBELISK_CHECK(obelisk_shm_writable(&producer) == 40);
+    OBELISK_CHECK(obelisk_shm_copyin(&producer, in + TEST_RING, 40) == 40);
+    obelisk_shm_publish(&producer);
+    OBELISK_CHECK(obelisk_shm_copyout(&consumer, out + 40, sizeof(out)) == TEST_RING);
+    OBELISK_CHECK(memcmp(out, in, TEST_RING + 40) == 0);
+    OBELISK_CHECK(obelisk_shm_readable(&consumer) == 0);
+    OBELISK_CHECK(region->requests.tail == TEST_RING + 40);
+
+    /* positions keep counting past a 32-bit wrap */
+    producer.pos = consumer.pos = UINT32_MAX - 10;
+    region->requests.head = region->requests.tail = UINT32_MAX - 10;
+    OBELISK_CHECK(obelisk_shm_copyin(&producer, in, 30) == 30);
+    obelisk_shm_publish(&producer);
+    OBELISK_CHECK(obelisk_shm_copyout(&consumer, out, 30) == 30);
+    OBELISK_CHECK(memcmp(out, in, 30) == 0);
+
+    /* a head more than a ring ahead is reported, and never copied past */
+    region->requests.head = consumer.pos + TEST_RING + 1;
+    OBELISK_CHECK(obelisk_shm_readable(&consumer) > TEST_RING);
+    n = obelisk_shm_copyout(&consumer, out, sizeof(out));
+    OBELISK_CHECK(n == TEST_RING);
+    region->requests.head = consumer.pos - 1;
+    OBELISK_CHECK(obelisk_shm_readable(&consumer) > TEST_RING);
+    OBELISK_CHECK(obelisk_shm_copyout(&consumer, out, sizeof(out)) == TEST_RING);
+
+    /* a tail behind or ahead of what fits leaves nothing to write */
+    region->replies.tail = replies.pos + 1;
+    OBELISK_CHECK(obelisk_shm_writable(&replies) == 0);
+    OBELISK_CHECK(obelisk_shm_copyin(&replies, in, 1) == 0);
+    replies.pos = 3 * TEST_RING;
+    region->replies.tail = 0;
+    OBELISK_CHECK(obelisk_shm_writable(&replies) == 0);
+    region->replies.tail = replies.pos - TEST_RING + 8;
+    OBELISK_CHECK(obelisk_shm_writable(&replies) == 8);
+
+    /* the size in the region is never used to size a copy */
+    region->size = UINT32_MAX;
+    region->replies.tail = replies.pos;
+    OBELISK_CHECK(obelisk_shm_copyin(&replies, in, sizeof(in)) == TEST_RING);
+
+    free(region);
+    return OBELISK_TEST_EXIT();
+}
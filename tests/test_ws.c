@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2009 Ryan Phillips
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* WebSocket frame header parsing and length checks */
+
+#include <stdint.h>
+#include <string.h>
+#include "obelisk_ws.h"
+#include "obelisk_test.h"
+
+/* Masked client header for op with a 64-bit length, fin set unless op has
+ * 0x100 */
+static size_t
+test_header64(unsigned char *hdr, int op, uint64_t len)
+{
+    int i;
+
+    hdr[0] = (op & 0x100 ? 0 : 0x80) | (op & 0x0f);
+    hdr[1] = 0x80 | 127;
+    for (i=0; i<8; i++) {
+        hdr[2 + i] = (unsigned char) (len >> (56 - 8 * i));
+    }
+    memcpy(hdr + 10, "\x01\x02\x03\x04", 4);
+    return 14;
+}
+
+int
+main(int argc, char **argv)
+{
+    unsigned char hdr[OBELISK_WS_MAX_HEADER];
+    obelisk_ws_frame_t frame;
+    size_t n;
+
+    /* short text frame, whole and in pieces */
+    memcpy(hdr, "\x81\x83\x01\x02\x03\x04", 6);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 9, 0, 0, 0, &frame) == 1);
+    OBELISK_CHECK(frame.fin && frame.op == OBELISK_WS_TEXT);
+    OBELISK_CHECK(frame.len == 3 && frame.off == 6);
+    OBELISK_CHECK(memcmp(frame.mask, "\x01\x02\x03\x04", 4) == 0);
+    for (n=0; n<9; n++) {
+        OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n, 0, 0, 0, &frame) == 0);
+    }
+
+    /* unmasked and reserved bits */
+    memcpy(hdr, "\x81\x03", 2);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 5, 0, 0, 0, &frame) == OBELISK_WS_PROTOCOL_ERROR);
+    memcpy(hdr, "\xc1\x83", 2);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 9, 0, 0, 0, &frame) == OBELISK_WS_PROTOCOL_ERROR);
+
+    /* 16-bit length needs its 4 byte header before anything is decided */
+    memcpy(hdr, "\x82\xfe\x01\x00\x01\x02\x03\x04", 8);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 3, 0, 0, 0, &frame) == 0);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 8 + 255, 0, 0, 0, &frame) == 0);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 8 + 256, 0, 0, 0, &frame) == 1);
+    OBELISK_CHECK(frame.len == 256 && frame.off == 8);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 8, 0, 0, 255, &frame) == OBELISK_WS_TOO_BIG);
+
+    /* 64-bit lengths, the top bit must be clear */
+    n = test_header64(hdr, OBELISK_WS_BINARY, (uint64_t) 1 << 63);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n, 0, 0, 0, &frame) == OBELISK_WS_PROTOCOL_ERROR);
+    n = test_header64(hdr, OBELISK_WS_BINARY, UINT64_MAX);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n, 0, 0, 0, &frame) == OBELISK_WS_PROTOCOL_ERROR);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 9, 0, 0, 0, &frame) == 0);
+    n = test_header64(hdr, OBELISK_WS_BINARY, ((uint64_t) 1 << 63) - 1);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n, 0, 0, 1024, &frame) == OBELISK_WS_TOO_BIG);
+    if (sizeof(size_t) == sizeof(uint64_t)) {
+        /* unlimited, so wait for the payload rather than wrapping off + len */
+        OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n, 0, 0, 0, &frame) == 0);
+        OBELISK_CHECK(frame.len == ((uint64_t) 1 << 63) - 1);
+    }
+    n = test_header64(hdr, OBELISK_WS_TEXT, 100);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n + 100, 0, 0, 100, &frame) == 1);
+
+    /* a continuation must not wrap message_len + len past max_body */
+    n = test_header64(hdr, OBELISK_WS_CONTINUATION, UINT64_MAX - 4);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n, 10, OBELISK_WS_TEXT, 1024, &frame) ==
+                  OBELISK_WS_PROTOCOL_ERROR);
+    n = test_header64(hdr, OBELISK_WS_CONTINUATION, ((uint64_t) 1 << 63) - 5);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n, 10, OBELISK_WS_TEXT, 1024, &frame) ==
+                  OBELISK_WS_TOO_BIG);
+    n = test_header64(hdr, OBELISK_WS_CONTINUATION, 1014);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n, 10, OBELISK_WS_TEXT, 1024, &frame) == 0);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n + 1014, 10, OBELISK_WS_TEXT, 1024, &frame) == 1);
+    n = test_header64(hdr, OBELISK_WS_CONTINUATION, 1015);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n, 10, OBELISK_WS_TEXT, 1024, &frame) ==
+                  OBELISK_WS_TOO_BIG);
+    n = test_header64(hdr, OBELISK_WS_CONTINUATION | 0x100, 4);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n + 4, 4, OBELISK_WS_TEXT, 0, &frame) == 1);
+    OBELISK_CHECK(!frame.fin && frame.op == OBELISK_WS_CONTINUATION);
+
+    /* continuations only inside a message, new messages only outside */
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n + 4, 0, 0, 0, &frame) == OBELISK_WS_PROTOCOL_ERROR);
+    n = test_header64(hdr, OBELISK_WS_TEXT, 4);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, n + 4, 4, OBELISK_WS_TEXT, 0, &frame) ==
+                  OBELISK_WS_PROTOCOL_ERROR);
+
+    /* control frames are short and never fragmented */
+    memcpy(hdr, "\x89\x80\x01\x02\x03\x04", 6);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 6, 4, OBELISK_WS_TEXT, 0, &frame) == 1);
+    OBELISK_CHECK(frame.op == OBELISK_WS_PING && frame.len == 0);
+    memcpy(hdr, "\x09\x80\x01\x02\x03\x04", 6);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 6, 0, 0, 0, &frame) == OBELISK_WS_PROTOCOL_ERROR);
+    memcpy(hdr, "\x89\xfe\x00\x7e\x01\x02\x03\x04", 8);
+    OBELISK_CHECK(obelisk_ws_frame_parse(hdr, 8 + 126, 0, 0, 0, &frame) == OBELISK_WS_PROTOCOL_ERROR);
+
+    return OBELISK_TEST_EXIT();
+}